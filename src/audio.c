@@ -24,6 +24,7 @@
 #include "audio.h"
 
 #include "resample.h"
+#include "pcmconv.h"
 
 #define MODULE "audio/"
 #include "logging.h"
@@ -63,10 +64,10 @@ void downmix_buffer_float(downmix_state *s, float **buf, int samples)
 }
 
 
-void downmix_buffer(downmix_state *s, signed char *buf, int len, int be)
+void downmix_buffer(downmix_state *s, signed char *buf, int len,
+        input_subtype format)
 {
-    int samples = len/4;
-    int i;
+    int samples = len/(2*pcm_sample_size(format));
 
     if(samples > s->buflen) {
         void *tmp = realloc(s->buffer, samples * sizeof(float));
@@ -76,18 +77,7 @@ void downmix_buffer(downmix_state *s, signed char *buf, int len, int be)
         s->buflen = samples;
     }
 
-    if(be) {
-        for(i=0; i < samples; i++) {
-            s->buffer[i] = (((buf[4*i]<<8) | (buf[4*i + 1]&0xff)) +
-                           ((buf[4*i + 2]<<8) | (buf[4*i + 3]&0xff)))/65536.f;
-        }
-    }
-    else {
-        for(i=0; i < samples; i++) {
-            s->buffer[i] = (((buf[4*i + 1]<<8) | (buf[4*i]&0xff)) +
-                           ((buf[4*i + 3]<<8) | (buf[4*i + 2]&0xff)))/65536.f;
-        }
-    }
+    pcm_downmix(s->buffer, buf, samples, format);
 }
 
 resample_state *resample_initialise(int channels, int infreq, int outfreq)
@@ -106,8 +96,6 @@ resample_state *resample_initialise(int channels, int infreq, int outfreq)
 
         if ((state->buffers = calloc(channels, sizeof(float *))) == NULL)
             break;
-        if ((state->convbuf = calloc(channels, sizeof(float *))) == NULL)
-            break;
         failed = 0;
     }
     while (0); /* not a loop */
@@ -137,53 +125,76 @@ void resample_clear(resample_state *s)
                     free(s->buffers[c]);
             free(s->buffers);
         }
-        if(s->convbuf) {
-            for(c=0; c<s->channels; c++)
-                if (s->convbuf[c])
-                    free(s->convbuf[c]);
-            free(s->convbuf);
-        }
         resampler_clear(&s->resampler);
         free(s);
     }
 }
 
-void resample_buffer(resample_state *s, signed char *buf, int buflen, int be)
+/* Make room for samples per channel in s->buffers */
+static int resample_grow(resample_state *s, int samples)
 {
-    int c,i;
-    buflen /= 2*s->channels; /* bytes -> samples conversion */
+    int c;
 
-    if(s->convbuflen < buflen) {
-        s->convbuflen = buflen;
-        for(c=0; c < s->channels; c++)
-            s->convbuf[c] = realloc(s->convbuf[c], buflen * sizeof(float));
-    }
+    if(s->bufsize >= samples)
+        return 0;
+    for(c=0; c<s->channels; c++) {
+        float *buf = realloc(s->buffers[c], samples * sizeof(float));
 
-    if(be) {
-        for(i=0; i < buflen; i++) {
-            for(c=0; c < s->channels; c++) {
-                s->convbuf[c][i] = ((buf[2*(i*s->channels + c)]<<8) |
-                                    (0x00ff&(int)buf[2*(i*s->channels + c)+1]))/
-                    32768.f;
-            }
-        }
-    }
-    else {
-        for(i=0; i < buflen; i++) {
-            for(c=0; c < s->channels; c++) {
-                s->convbuf[c][i] = ((buf[2*(i*s->channels + c) + 1]<<8) |
-                                    (0x00ff&(int)buf[2*(i*s->channels + c)]))/
-                    32768.f;
-            }
-        }
+        if(buf == NULL)
+            return -1;
+        s->buffers[c] = buf;
     }
+    s->bufsize = samples;
 
-    resample_buffer_float(s, s->convbuf, buflen);
+    return 0;
+}
+
+typedef struct {
+    signed char *buf;
+    int channels;
+    int frame_bytes;
+    input_subtype format;
+} pcm_source;
+
+/* resampler_push_fill() callback: convert the next frames of PCM straight
+ * into the resampler */
+static void resample_fill_pcm(void *arg, float **dest, size_t frames)
+{
+    pcm_source *source = arg;
+
+    pcm_to_float(dest, source->buf, frames, source->channels, source->format);
+    source->buf += frames * source->frame_bytes;
+}
+
+/* The samples per channel resample_buffer() will produce from buflen bytes
+ * of PCM */
+int resample_buffer_size(resample_state *s, int buflen, input_subtype format)
+{
+    return resampler_push_check(&s->resampler,
+            buflen / (pcm_sample_size(format) * s->channels));
+}
+
+/* Resample buflen bytes of PCM into out, which needs room for
+ * resample_buffer_size() samples per channel; the PCM is converted as the
+ * resampler takes it in, and the output can go straight to the encoder.
+ * Returns the samples per channel written.
+ */
+int resample_buffer(resample_state *s, float **out, signed char *buf,
+        int buflen, input_subtype format)
+{
+    pcm_source source;
+
+    source.buf = buf;
+    source.channels = s->channels;
+    source.frame_bytes = pcm_sample_size(format) * s->channels;
+    source.format = format;
+
+    return resampler_push_fill(&s->resampler, out, resample_fill_pcm,
+            &source, buflen / source.frame_bytes);
 }
 
 void resample_buffer_float(resample_state *s, float **buf, int buflen)
 {
-    int c;
     int res;
 
     s->buffill = resampler_push_check(&s->resampler, buflen);
@@ -192,10 +203,10 @@ void resample_buffer_float(resample_state *s, float **buf, int buflen)
                 s->buffill);
     }
 
-    if(s->bufsize < s->buffill) {
-        s->bufsize = s->buffill;
-        for(c=0; c<s->channels; c++)
-            s->buffers[c] = realloc(s->buffers[c], s->bufsize * sizeof(float));
+    if(resample_grow(s, s->buffill) < 0) {
+        LOG_ERROR0("Out of memory resampling, input dropped");
+        s->buffill = 0;
+        return;
     }
 
     if((res = resampler_push(&s->resampler, s->buffers, (float const **)buf, buflen))
@@ -210,17 +221,11 @@ void resample_buffer_float(resample_state *s, float **buf, int buflen)
 
 void resample_finish(resample_state *s)
 {
-    int ret;
-
-    if(!s->buffers[0])
-        return;
-
-    ret = resampler_drain(&s->resampler, s->buffers);
-
-    if(ret > s->bufsize) {
-        LOG_ERROR0("Fatal error in resampler: buffers too small");
+    s->buffill = 0;
+    if(resample_grow(s, resampler_drain_check(&s->resampler)) < 0) {
+        LOG_ERROR0("Out of memory finishing resampling");
         return;
     }
 
-    s->buffill = ret;
+    s->buffill = resampler_drain(&s->resampler, s->buffers);
 }
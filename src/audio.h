@@ -16,6 +16,7 @@
 #define __AUDIO_H
 
 #include "resample.h"
+#include "inputmodule.h"
 
 typedef struct {
     float *buffer;
@@ -29,19 +30,19 @@ typedef struct {
     float **buffers;
     int buffill;
     int bufsize;
-
-    float **convbuf;
-    int convbuflen;
 } resample_state;
 
 downmix_state *downmix_initialise(void);
 void downmix_clear(downmix_state *s);
-void downmix_buffer(downmix_state *s, signed char *buf, int len, int be);
+void downmix_buffer(downmix_state *s, signed char *buf, int len,
+        input_subtype format);
 void downmix_buffer_float(downmix_state *s, float **buf, int samples);
 
 resample_state *resample_initialise(int channels, int infreq, int outfreq);
 void resample_clear(resample_state *s);
-void resample_buffer(resample_state *s, signed char *buf, int buflen, int be);
+int resample_buffer_size(resample_state *s, int buflen, input_subtype format);
+int resample_buffer(resample_state *s, float **out, signed char *buf,
+        int buflen, input_subtype format);
 void resample_buffer_float(resample_state *s, float **buf, int buflen);
 void resample_finish(resample_state *s);
 
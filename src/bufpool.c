@@ -0,0 +1,283 @@
+/* bufpool.c
+ * - recycling allocator for ref_buffers and their payloads.
+ *
+ * Every chunk of input used to cost a calloc for the ref_buffer and a
+ * malloc for the data, freed again by whichever instance thread dropped
+ * the last reference. Instead, released blocks go onto a free list for
+ * their size class and are handed straight back out to the input thread.
+ *
+ * Payloads are rounded up to a power of two between BUFPOOL_MIN_SHIFT and
+ * BUFPOOL_MAX_SHIFT, with a small header in front recording the class so
+ * that bufpool_free() doesn't need to be told the size. Larger requests
+ * fall through to plain malloc. Each class only keeps up to
+ * BUFPOOL_CLASS_BYTES of idle memory, so a burst doesn't pin memory for
+ * the rest of the run.
+ *
+ * Copyright (c) 2026 The IceS Development Team <team@icecast.org>
+ *
+ * This program is distributed under the terms of the GNU General
+ * Public License, version 2. You may use, modify, and redistribute
+ * it under the terms of this license. A copy should be included
+ * with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+ #include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include <common/thread/thread.h>
+
+#include "cfgparse.h"
+#include "stream.h"
+#include "bufpool.h"
+
+#define MODULE "bufpool/"
+#include "logging.h"
+
+#define BUFPOOL_MIN_SHIFT 8     /* 256 bytes */
+#define BUFPOOL_MAX_SHIFT 17    /* 128k, enough for any Ogg page */
+#define BUFPOOL_CLASSES (BUFPOOL_MAX_SHIFT - BUFPOOL_MIN_SHIFT + 1)
+#define BUFPOOL_CLASS_BYTES (1024*1024)
+#define BUFPOOL_MIN_CACHED 4
+
+#define BUFPOOL_REF_CLASS BUFPOOL_CLASSES
+#define BUFPOOL_OVERSIZE -1
+
+/* sits in front of every payload; the union keeps the data after it
+ * suitably aligned for anything */
+typedef union pool_header {
+    int size_class;
+    union pool_header *next;
+    long l;
+    double d;
+    void *p;
+} pool_header;
+
+typedef struct {
+    mutex_t lock;
+    pool_header *free_list;
+    int cached;
+    int max_cached;
+    size_t size;
+
+    atomic_ulong hits;
+    atomic_ulong misses;
+    atomic_ulong frees;
+} pool_class;
+
+/* one extra class for the ref_buffer headers themselves */
+static pool_class classes[BUFPOOL_CLASSES + 1];
+static atomic_ulong oversize;
+static atomic_ulong oversize_frees;
+static int initialised;
+
+void bufpool_initialise(void)
+{
+    int i;
+
+    for(i = 0; i <= BUFPOOL_CLASSES; i++)
+    {
+        pool_class *class = &classes[i];
+
+        if(i == BUFPOOL_REF_CLASS)
+            class->size = sizeof(pool_header) + sizeof(ref_buffer);
+        else
+            class->size = sizeof(pool_header) +
+                ((size_t)1 << (i + BUFPOOL_MIN_SHIFT));
+
+        class->max_cached = BUFPOOL_CLASS_BYTES / class->size;
+        if(class->max_cached < BUFPOOL_MIN_CACHED)
+            class->max_cached = BUFPOOL_MIN_CACHED;
+        class->free_list = NULL;
+        class->cached = 0;
+        atomic_init(&class->hits, 0);
+        atomic_init(&class->misses, 0);
+        atomic_init(&class->frees, 0);
+        thread_mutex_create(&class->lock);
+    }
+    atomic_init(&oversize, 0);
+    atomic_init(&oversize_frees, 0);
+    initialised = 1;
+}
+
+void bufpool_shutdown(void)
+{
+    bufpool_stats stats;
+    int i;
+
+    if(!initialised)
+        return;
+
+    bufpool_get_stats(&stats);
+    LOG_INFO4("Buffer pool: %lu hits, %lu misses, %lu oversize allocations, "
+            "%ld never given back", stats.hits, stats.misses, stats.oversize,
+            (long)(stats.hits + stats.misses + stats.oversize - stats.frees));
+
+    for(i = 0; i <= BUFPOOL_CLASSES; i++)
+    {
+        pool_class *class = &classes[i];
+        pool_header *block;
+
+        if(atomic_load(&class->misses))
+            LOG_DEBUG4("Buffer pool class %lu: %lu hits, %lu misses, %d cached",
+                    (unsigned long)(class->size - sizeof(pool_header)),
+                    (unsigned long)atomic_load(&class->hits),
+                    (unsigned long)atomic_load(&class->misses),
+                    class->cached);
+
+        thread_mutex_lock(&class->lock);
+        while((block = class->free_list))
+        {
+            class->free_list = block->next;
+            free(block);
+        }
+        class->cached = 0;
+        thread_mutex_unlock(&class->lock);
+        thread_mutex_destroy(&class->lock);
+    }
+    initialised = 0;
+}
+
+static int bufpool_class_for(size_t len)
+{
+    int class = 0;
+
+    while(class < BUFPOOL_CLASSES &&
+            ((size_t)1 << (class + BUFPOOL_MIN_SHIFT)) < len)
+        class++;
+
+    return class < BUFPOOL_CLASSES ? class : BUFPOOL_OVERSIZE;
+}
+
+static pool_header *bufpool_get(int index)
+{
+    pool_class *class = &classes[index];
+    pool_header *block;
+
+    thread_mutex_lock(&class->lock);
+    block = class->free_list;
+    if(block)
+    {
+        class->free_list = block->next;
+        class->cached--;
+    }
+    thread_mutex_unlock(&class->lock);
+
+    if(block)
+        atomic_fetch_add_explicit(&class->hits, 1, memory_order_relaxed);
+    else
+    {
+        atomic_fetch_add_explicit(&class->misses, 1, memory_order_relaxed);
+        block = malloc(class->size);
+        if(!block)
+            return NULL;
+    }
+    block->size_class = index;
+
+    return block;
+}
+
+static void bufpool_put(pool_header *block)
+{
+    pool_class *class = &classes[block->size_class];
+
+    atomic_fetch_add_explicit(&class->frees, 1, memory_order_relaxed);
+    thread_mutex_lock(&class->lock);
+    if(class->cached < class->max_cached)
+    {
+        block->next = class->free_list;
+        class->free_list = block;
+        class->cached++;
+        block = NULL;
+    }
+    thread_mutex_unlock(&class->lock);
+
+    /* the class is already holding as much as it's allowed to */
+    free(block);
+}
+
+ref_buffer *bufpool_get_ref(void)
+{
+    pool_header *block = bufpool_get(BUFPOOL_REF_CLASS);
+    ref_buffer *buf;
+
+    if(!block)
+        return NULL;
+
+    buf = (ref_buffer *)(block + 1);
+    memset(buf, 0, sizeof(ref_buffer));
+
+    return buf;
+}
+
+void bufpool_put_ref(ref_buffer *buf)
+{
+    if(buf)
+        bufpool_put((pool_header *)buf - 1);
+}
+
+void *bufpool_alloc(size_t len)
+{
+    int index = bufpool_class_for(len);
+    pool_header *block;
+
+    if(index == BUFPOOL_OVERSIZE)
+    {
+        atomic_fetch_add_explicit(&oversize, 1, memory_order_relaxed);
+        block = malloc(sizeof(pool_header) + len);
+        if(!block)
+            return NULL;
+        block->size_class = BUFPOOL_OVERSIZE;
+    }
+    else
+    {
+        block = bufpool_get(index);
+        if(!block)
+            return NULL;
+    }
+
+    return block + 1;
+}
+
+void bufpool_free(void *data)
+{
+    pool_header *block;
+
+    if(!data)
+        return;
+
+    block = (pool_header *)data - 1;
+    if(block->size_class == BUFPOOL_OVERSIZE)
+    {
+        atomic_fetch_add_explicit(&oversize_frees, 1, memory_order_relaxed);
+        free(block);
+    }
+    else
+        bufpool_put(block);
+}
+
+void bufpool_get_stats(bufpool_stats *stats)
+{
+    int i;
+
+    stats->hits = 0;
+    stats->misses = 0;
+    stats->frees = 0;
+    for(i = 0; i <= BUFPOOL_CLASSES; i++)
+    {
+        stats->hits += atomic_load_explicit(&classes[i].hits,
+                memory_order_relaxed);
+        stats->misses += atomic_load_explicit(&classes[i].misses,
+                memory_order_relaxed);
+        stats->frees += atomic_load_explicit(&classes[i].frees,
+                memory_order_relaxed);
+    }
+    stats->oversize = atomic_load_explicit(&oversize, memory_order_relaxed);
+    stats->frees += atomic_load_explicit(&oversize_frees,
+            memory_order_relaxed);
+}
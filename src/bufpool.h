@@ -0,0 +1,40 @@
+/* bufpool.h
+ * - recycling allocator for ref_buffers and their payloads.
+ *
+ * Copyright (c) 2026 The IceS Development Team <team@icecast.org>
+ *
+ * This program is distributed under the terms of the GNU General
+ * Public License, version 2. You may use, modify, and redistribute
+ * it under the terms of this license. A copy should be included
+ * with this source.
+ */
+
+#ifndef __BUFPOOL_H
+#define __BUFPOOL_H
+
+#include <stddef.h>
+
+#include "stream.h"
+
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long oversize;     /* too big for any class, always malloc'd */
+    unsigned long frees;        /* blocks given back, of any kind */
+} bufpool_stats;
+
+void bufpool_initialise(void);
+void bufpool_shutdown(void);
+
+/* a zeroed ref_buffer, to be given back with bufpool_put_ref() */
+ref_buffer *bufpool_get_ref(void);
+void bufpool_put_ref(ref_buffer *buf);
+
+/* payload memory; anything from bufpool_alloc() must be released with
+ * bufpool_free() rather than free() */
+void *bufpool_alloc(size_t len);
+void bufpool_free(void *data);
+
+void bufpool_get_stats(bufpool_stats *stats);
+
+#endif /* __BUFPOOL_H */
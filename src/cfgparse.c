@@ -29,6 +29,7 @@
 
 #include "cfgparse.h"
 #include "stream.h"
+#include "queue.h"
 
 #define DEFAULT_BACKGROUND 0
 #define DEFAULT_LOGPATH "/tmp"
@@ -40,6 +41,7 @@
 #define DEFAULT_STREAM_GENRE "ices unset"
 #define DEFAULT_STREAM_DESCRIPTION "no description set"
 #define DEFAULT_PLAYLIST_MODULE "playlist"
+#define DEFAULT_READAHEAD 16
 #define DEFAULT_HOSTNAME "localhost"
 #define DEFAULT_PORT 8000
 #if SHOUT_TLS
@@ -58,12 +60,21 @@
 #define DEFAULT_MAX_BITRATE -1
 #define DEFAULT_QUALITY 3
 #define DEFAULT_REENCODE 0
+#define DEFAULT_CODEC CODEC_VORBIS
+#define DEFAULT_LATENCY_MS 0
+#define DEFAULT_PASSTHROUGH 0
 #define DEFAULT_DOWNMIX 0
 #define DEFAULT_RESAMPLE 0
 #define DEFAULT_RECONN_DELAY 2
 #define DEFAULT_RECONN_ATTEMPTS 10
 #define DEFAULT_RETRY_INIT 0
+#define DEFAULT_RESTART_DELAY 5
+#define DEFAULT_RESTART_ATTEMPTS -1
 #define DEFAULT_MAXQUEUELENGTH 100 /* Make it _BIG_ by default */
+#define DEFAULT_OVERFLOW_POLICY OVERFLOW_DROP_OLDEST
+#define DEFAULT_WAKEUP_BATCH 1
+#define DEFAULT_PREROLL 0
+#define DEFAULT_CATCHUP_RATE 0
 #define DEFAULT_SAVEFILENAME NULL /* NULL == don't save */
 
 /* helper macros so we don't have to write the same
@@ -96,6 +107,35 @@
                 (x) = (char *)xmlGetProp(node, p);\
     } while (0)
 
+#define SET_OVERFLOW(x) \
+    do {\
+        char *tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);\
+        if (tmp) {\
+            if (strcasecmp(tmp,"drop-oldest")==0)(x) = OVERFLOW_DROP_OLDEST;\
+            else if (strcasecmp(tmp,"drop-newest")==0)(x) = OVERFLOW_DROP_NEWEST;\
+            else if (strcasecmp(tmp,"resync")==0)(x) = OVERFLOW_RESYNC;\
+            else fprintf(stderr, "Unknown overflow-policy \"%s\"\n", tmp);\
+            xmlFree(tmp);\
+        }\
+    } while (0)
+
+#ifdef HAVE_OPUS
+#define CODEC_OPUS_NAME "opus"
+#else
+#define CODEC_OPUS_NAME NULL
+#endif
+
+#define SET_CODEC(x) \
+    do {\
+        char *tmp = (char *)xmlNodeListGetString(doc, node->xmlChildrenNode, 1);\
+        if (tmp) {\
+            if (strcasecmp(tmp,"vorbis")==0)(x) = CODEC_VORBIS;\
+            else if (CODEC_OPUS_NAME && strcasecmp(tmp,"opus")==0)(x) = CODEC_OPUS;\
+            else fprintf(stderr, "Unknown or unsupported codec \"%s\"\n", tmp);\
+            xmlFree(tmp);\
+        }\
+    } while (0)
+
 #if SHOUT_TLS
 #define SET_TLSMODE(x) \
     do {\
@@ -116,6 +156,8 @@
 config_t *ices_config;
 
 static int _using_default_instance = 1;
+/* set when something couldn't be allocated, config_read() then fails */
+static int _parse_failed = 0;
 
 static void _free_instances(instance_t *instance)
 {
@@ -144,11 +186,7 @@ void config_free_instance(instance_t *instance)
     if (instance->allowed_ciphers) xmlFree(instance->allowed_ciphers);
     if (instance->client_certificate) xmlFree(instance->client_certificate);
 #endif
-    if (instance->queue) 
-    {
-        thread_mutex_destroy(&instance->queue->lock);
-        free(instance->queue);
-    }
+    queue_free(instance->queue);
 }
 
 static void _set_instance_defaults(instance_t *instance)
@@ -170,6 +208,9 @@ static void _set_instance_defaults(instance_t *instance)
     instance->nom_br = DEFAULT_NOM_BITRATE;
     instance->max_br = DEFAULT_MAX_BITRATE;
     instance->quality = DEFAULT_QUALITY;
+    instance->codec = DEFAULT_CODEC;
+    instance->latency_ms = DEFAULT_LATENCY_MS;
+    instance->passthrough = DEFAULT_PASSTHROUGH;
     instance->encode = DEFAULT_REENCODE;
     instance->downmix = DEFAULT_DOWNMIX;
     instance->resampleinrate = DEFAULT_RESAMPLE;
@@ -177,11 +218,18 @@ static void _set_instance_defaults(instance_t *instance)
     instance->reconnect_delay = DEFAULT_RECONN_DELAY;
     instance->reconnect_attempts = DEFAULT_RECONN_ATTEMPTS;
     instance->retry_initial_connection = DEFAULT_RETRY_INIT;
+    instance->restart_delay = DEFAULT_RESTART_DELAY;
+    instance->restart_attempts = DEFAULT_RESTART_ATTEMPTS;
     instance->max_queue_length = DEFAULT_MAXQUEUELENGTH;
+    instance->overflow_policy = DEFAULT_OVERFLOW_POLICY;
+    instance->wakeup_batch = DEFAULT_WAKEUP_BATCH;
+    instance->preroll = DEFAULT_PREROLL;
+    instance->catchup_rate = DEFAULT_CATCHUP_RATE;
     instance->savefilename = DEFAULT_SAVEFILENAME;
 
-    instance->queue = calloc(1, sizeof(buffer_queue));
-    thread_mutex_create(&instance->queue->lock);
+    instance->queue = NULL; /* sized from maxqueuelength once parsed */
+    instance->encode_group = NULL;
+    atomic_init(&instance->wait_for_critical, 0);
 
     instance->next = NULL;
 }
@@ -206,7 +254,9 @@ static void _parse_encode(instance_t *instance,xmlDocPtr doc, xmlNodePtr node)
         if (node == NULL) break;
         if (xmlIsBlankNode(node)) continue;
 
-        if (strcmp(node->name, "nominal-bitrate") == 0)
+        if (strcmp(node->name, "codec") == 0)
+            SET_CODEC(instance->codec);
+        else if (strcmp(node->name, "nominal-bitrate") == 0)
             SET_INT(instance->nom_br);
         else if (strcmp(node->name, "minimum-bitrate") == 0)
             SET_INT(instance->min_br);
@@ -222,11 +272,17 @@ static void _parse_encode(instance_t *instance,xmlDocPtr doc, xmlNodePtr node)
             SET_INT(instance->managed);
         else if (strcmp(node->name, "flush-samples") == 0)
             SET_INT(instance->max_samples_ppage);
+        else if (strcmp(node->name, "latency-ms") == 0)
+            SET_INT(instance->latency_ms);
+        else if (strcmp(node->name, "passthrough") == 0)
+            SET_INT(instance->passthrough);
     } while ((node = node->next));
     if (instance->max_samples_ppage == 0)
         instance->max_samples_ppage = instance->samplerate;
     if (instance->max_samples_ppage < instance->samplerate/100)
         instance->max_samples_ppage = instance->samplerate/100;
+    if (instance->latency_ms < 0)
+        instance->latency_ms = 0;
 }
 
 static void _parse_metadata(instance_t *instance, config_t *config, 
@@ -308,8 +364,20 @@ static void _parse_instance(config_t *config, xmlDocPtr doc, xmlNodePtr node)
             SET_INT(instance->reconnect_attempts);
         else if(strcmp(node->name, "retry-initial") == 0)
             SET_INT(instance->retry_initial_connection);
+        else if(strcmp(node->name, "restartdelay") == 0)
+            SET_INT(instance->restart_delay);
+        else if(strcmp(node->name, "restartattempts") == 0)
+            SET_INT(instance->restart_attempts);
         else if(strcmp(node->name, "maxqueuelength") == 0)
             SET_INT(instance->max_queue_length);
+        else if(strcmp(node->name, "overflow-policy") == 0)
+            SET_OVERFLOW(instance->overflow_policy);
+        else if(strcmp(node->name, "wakeup-batch") == 0)
+            SET_INT(instance->wakeup_batch);
+        else if(strcmp(node->name, "preroll") == 0)
+            SET_INT(instance->preroll);
+        else if(strcmp(node->name, "catchup-rate") == 0)
+            SET_INT(instance->catchup_rate);
         else if(strcmp(node->name, "downmix") == 0)
             SET_INT(instance->downmix);
         else if(strcmp(node->name, "resample") == 0)
@@ -320,7 +388,32 @@ static void _parse_instance(config_t *config, xmlDocPtr doc, xmlNodePtr node)
             _parse_metadata(instance, config, doc, node->xmlChildrenNode);
     } while ((node = node->next));
 
+    if (instance->max_queue_length < 1)
+        instance->max_queue_length = 1;
+    /* waiting for more than the queue can hold would never wake up */
+    if (instance->wakeup_batch < 1)
+        instance->wakeup_batch = 1;
+    else if (instance->wakeup_batch > instance->max_queue_length)
+        instance->wakeup_batch = instance->max_queue_length;
+
+    /* anything slower would never catch up */
+    if (instance->catchup_rate < 0)
+        instance->catchup_rate = 0;
+    else if (instance->catchup_rate > 0 && instance->catchup_rate <= 100)
+        instance->catchup_rate = 101;
+    /* a spare slot at least, so that drop-oldest can still queue the
+     * newest buffer while the instance gets round to trimming */
+    instance->queue = queue_create(instance->max_queue_length + 1);
     instance->next = NULL;
+    if (instance->queue == NULL)
+    {
+        fprintf(stderr, "Out of memory allocating the queue for mount %s\n",
+                instance->mount);
+        config_free_instance(instance);
+        free(instance);
+        _parse_failed = 1;
+        return;
+    }
 
     if (_using_default_instance) 
     {
@@ -352,6 +445,8 @@ static void _parse_input(config_t *config, xmlDocPtr doc, xmlNodePtr node)
 
         if (strcmp(node->name, "module") == 0)
             SET_STRING(config->playlist_module);
+        else if (strcmp(node->name, "readahead") == 0)
+            SET_INT(config->readahead);
         else if (strcmp(node->name, "param") == 0) {
             param = (module_param_t *)calloc(1, sizeof(module_param_t));
             SET_PARM_STRING("name", param->name);
@@ -431,11 +526,15 @@ static void _set_defaults(config_t *c)
     c->stream_url = NULL;
 
     c->playlist_module = xmlStrdup(DEFAULT_PLAYLIST_MODULE);
+    c->readahead = DEFAULT_READAHEAD;
 
     c->module_params = NULL;
 
-    instance = (instance_t *)malloc(sizeof(instance_t));
+    instance = (instance_t *)calloc(1, sizeof(instance_t));
     _set_instance_defaults(instance);
+    instance->queue = queue_create(instance->max_queue_length + 1);
+    if (instance->queue == NULL)
+        _parse_failed = 1;
     c->instances = instance;
 }
 
@@ -523,5 +622,8 @@ int config_read(const char *fn)
 
     xmlFreeDoc(doc);
 
+    if (_parse_failed)
+        return -1;
+
     return 1;
 }
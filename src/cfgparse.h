@@ -15,6 +15,8 @@
 #ifndef __CONFIG_H__
 #define __CONFIG_H__
 
+#include <stdint.h>
+
 #include "stream.h"
 #include "inputmodule.h"
 
@@ -29,6 +31,19 @@ typedef struct _module_param_tag
 /* FIXME: forward declaraction because my headers are a mess. */
 struct buffer_queue;
 
+/* What to do when an instance falls more than maxqueuelength behind */
+typedef enum _overflow_policy {
+    OVERFLOW_DROP_OLDEST, /* drop queued data up to the next critical buffer */
+    OVERFLOW_DROP_NEWEST, /* drop incoming data until there is room */
+    OVERFLOW_RESYNC,      /* reconnect, restart at the next logical stream */
+} overflow_policy;
+
+/* What an <encode> block produces */
+typedef enum _encode_codec {
+    CODEC_VORBIS,
+    CODEC_OPUS,         /* only if built with HAVE_OPUS */
+} encode_codec;
+
 typedef struct _instance_tag
 {
     char *hostname;
@@ -46,11 +61,17 @@ typedef struct _instance_tag
     int reconnect_delay;
     int reconnect_attempts;
     int retry_initial_connection;
+    int restart_delay;
+    int restart_attempts;
     int encode;
     int downmix;
     int resampleinrate;
     int resampleoutrate;
     int max_queue_length;
+    overflow_policy overflow_policy;
+    int wakeup_batch;
+    int preroll;
+    int catchup_rate;
     char *savefilename;
 
     /* local metadata */
@@ -60,23 +81,40 @@ typedef struct _instance_tag
     char *stream_url;
 
     /* Parameters for re-encoding */
+    encode_codec codec;
     int managed;
     int min_br, nom_br, max_br;
     float quality;
     int samplerate;
     int channels;
     int max_samples_ppage;
+    int latency_ms;     /* flush pages once audio is this old, 0 for off */
+    int passthrough;    /* reencode only input that doesn't fit already */
 
     /* private */
     FILE *savefile;
     int buffer_failures;
     int died;
+    int setup_failed;   /* died before connecting, a restart won't help */
     int kill;
     int skip;
     int public_stream;
-    int wait_for_critical;
+    atomic_int wait_for_critical;   /* read by the input thread and the
+                                     * encoder pool without a lock */
+    int queue_full;
+    int resync;
+
+    /* supervisor bookkeeping, times are in ms */
+    int restart_pending;
+    int restarts;
+    int consecutive_restarts;
+    uint64_t started_at;
+    uint64_t died_at;
+    uint64_t restart_at;
+    uint64_t downtime;
 
     struct buffer_queue *queue;
+    struct encode_group *encode_group;  /* shared encoder, if any */
 
     struct _instance_tag *next;
 } instance_t;
@@ -103,6 +141,7 @@ typedef struct _config_tag
     /* <playlist> */
 
     char *playlist_module;
+    int readahead;
     module_param_t *module_params;
 
     /* <instance> */
@@ -113,9 +152,7 @@ typedef struct _config_tag
     int log_id;
     int shutdown;
     char *metadata_filename;
-    cond_t queue_cond;
     cond_t event_pending_cond;
-    mutex_t refcount_lock;
     mutex_t flush_lock;
     input_module_t *inmod;
     struct _config_tag *next;
@@ -0,0 +1,283 @@
+/* decode.c
+ * - single shared Vorbis decode of the input for reencoding instances.
+ *
+ * Every reencoding instance used to run its own Vorbis decoder over the
+ * same input pages. Instead the input thread decodes each page once and
+ * attaches the planar float PCM to the page's ref_buffer before handing it
+ * out, so each reencoder only has to resample, downmix and encode. The
+ * PCM goes away with the buffer once the last instance has released it.
+ *
+ * Copyright (c) 2026 The IceS Development Team <team@icecast.org>
+ *
+ * This program is distributed under the terms of the GNU General
+ * Public License, version 2. You may use, modify, and redistribute
+ * it under the terms of this license. A copy should be included
+ * with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+ #include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ogg/ogg.h>
+#include <vorbis/codec.h>
+
+#include "cfgparse.h"
+#include "stream.h"
+#include "bufpool.h"
+#include "decode.h"
+
+#define MODULE "decode/"
+#include "logging.h"
+
+decode_state *decode_initialise(void)
+{
+    decode_state *s = calloc(1, sizeof(decode_state));
+
+    if(!s)
+        return NULL;
+    s->serial = -1;
+    s->failed = 1;  /* nothing to decode until the first bos page */
+
+    return s;
+}
+
+void decode_stream_acquire(decode_stream *stream)
+{
+    atomic_fetch_add_explicit(&stream->count, 1, memory_order_relaxed);
+}
+
+void decode_stream_release(decode_stream *stream)
+{
+    if(!stream)
+        return;
+
+    if(atomic_fetch_sub_explicit(&stream->count, 1, memory_order_release) == 1)
+    {
+        atomic_thread_fence(memory_order_acquire);
+        vorbis_comment_clear(&stream->vc);
+        free(stream);
+    }
+}
+
+void decode_free_pcm(decoded_pcm *pcm)
+{
+    decode_stream_release(pcm->stream);
+    bufpool_free(pcm);
+}
+
+static void decode_reset(decode_state *s)
+{
+    if(s->stream)
+    {
+        ogg_stream_clear(&s->os);
+        vorbis_block_clear(&s->vb);
+        vorbis_dsp_clear(&s->vd);
+    }
+    else if(s->serial != -1)
+        ogg_stream_clear(&s->os);
+    vorbis_comment_clear(&s->vc);
+    vorbis_info_clear(&s->vi);
+
+    decode_stream_release(s->stream);
+    s->stream = NULL;
+}
+
+void decode_clear(decode_state *s)
+{
+    int i;
+
+    if(s)
+    {
+        LOG_DEBUG0("Clearing decoder");
+        decode_reset(s);
+        for(i = 0; i < s->scratch_channels; i++)
+            free(s->scratch[i]);
+        free(s->scratch);
+        free(s);
+    }
+}
+
+/* All headers are in: start the decoder proper, and describe the stream
+ * for the reencoders.
+ */
+static int decode_start_stream(decode_state *s)
+{
+    decode_stream *stream;
+    int i;
+
+    if(s->vi.channels > s->scratch_channels)
+    {
+        float **scratch = realloc(s->scratch, s->vi.channels * sizeof(float *));
+
+        if(!scratch)
+            return -1;
+        for(i = s->scratch_channels; i < s->vi.channels; i++)
+            scratch[i] = malloc(s->scratch_size * sizeof(float));
+        s->scratch = scratch;
+        s->scratch_channels = s->vi.channels;
+    }
+
+    stream = calloc(1, sizeof(decode_stream));
+    if(!stream)
+        return -1;
+    atomic_init(&stream->count, 1);
+    stream->serial = s->serial;
+    stream->rate = s->vi.rate;
+    stream->channels = s->vi.channels;
+    stream->bitrate_nominal = s->vi.bitrate_nominal;
+    stream->bitrate_upper = s->vi.bitrate_upper;
+
+    /* the encoders write their own vendor string, so only the user
+     * comments need copying */
+    vorbis_comment_init(&stream->vc);
+    for(i = 0; i < s->vc.comments; i++)
+        vorbis_comment_add(&stream->vc, s->vc.user_comments[i]);
+
+    vorbis_synthesis_init(&s->vd, &s->vi);
+    vorbis_block_init(&s->vd, &s->vb);
+    s->stream = stream;
+
+    LOG_DEBUG3("Decoding logical stream %d: %d channels, %d Hz",
+            stream->serial, stream->channels, stream->rate);
+    return 0;
+}
+
+static int decode_grow_scratch(decode_state *s, int size)
+{
+    int i;
+
+    if(size <= s->scratch_size)
+        return 0;
+
+    size = size * 3 / 2;
+    for(i = 0; i < s->scratch_channels; i++)
+    {
+        float *buf = realloc(s->scratch[i], size * sizeof(float));
+
+        if(!buf)
+            return -1;
+        s->scratch[i] = buf;
+    }
+    s->scratch_size = size;
+
+    return 0;
+}
+
+/* Decode one input page and attach the result to buf as buf->pcm. Pages
+ * that can't be decoded (headers, or a stream that isn't Vorbis) are left
+ * without.
+ */
+void decode_page(decode_state *s, ref_buffer *buf)
+{
+    ogg_page og;
+    ogg_packet op;
+    decoded_pcm *block;
+    int samples = 0, size, i;
+
+    og.header_len = buf->aux_data;
+    og.body_len = buf->len - buf->aux_data;
+    og.header = buf->buf;
+    og.body = buf->buf + og.header_len;
+
+    if(s->serial != ogg_page_serialno(&og))
+    {
+        /* Some other logical stream multiplexed with ours. A link in the
+         * chain starts with a critical page; any further bos pages are
+         * only worth a look if we haven't found Vorbis yet. */
+        if(!ogg_page_bos(&og) || (!buf->critical && !s->failed))
+            return;
+
+        decode_reset(s);
+        s->serial = ogg_page_serialno(&og);
+        s->failed = 0;
+
+        ogg_stream_init(&s->os, s->serial);
+        ogg_stream_pagein(&s->os, &og);
+        vorbis_info_init(&s->vi);
+        vorbis_comment_init(&s->vc);
+
+        if(ogg_stream_packetout(&s->os, &op) != 1)
+        {
+            LOG_ERROR0("Invalid primary header in stream");
+            s->failed = 1;
+        }
+        else if(vorbis_synthesis_headerin(&s->vi, &s->vc, &op) < 0)
+        {
+            LOG_ERROR0("Input stream not vorbis, can't reencode");
+            s->failed = 1;
+        }
+        s->need_headers = 2; /* We still need two more header packets */
+        return;
+    }
+
+    if(s->failed)
+        return;
+
+    ogg_stream_pagein(&s->os, &og);
+    while(ogg_stream_packetout(&s->os, &op) > 0)
+    {
+        float **pcm;
+        int got;
+
+        if(s->need_headers)
+        {
+            if(vorbis_synthesis_headerin(&s->vi, &s->vc, &op) < 0)
+            {
+                LOG_ERROR0("Corrupt header in input stream, can't reencode");
+                s->failed = 1;
+                return;
+            }
+            /* If this was the last header, init the rest */
+            if(!--s->need_headers && decode_start_stream(s) < 0)
+            {
+                LOG_ERROR0("Out of memory starting decoder");
+                s->failed = 1;
+                return;
+            }
+            continue;
+        }
+
+        if(vorbis_synthesis(&s->vb, &op)==0)
+            vorbis_synthesis_blockin(&s->vd, &s->vb);
+
+        while((got = vorbis_synthesis_pcmout(&s->vd, &pcm))>0)
+        {
+            if(decode_grow_scratch(s, samples + got) < 0)
+            {
+                LOG_ERROR0("Out of memory decoding, dropping audio");
+                vorbis_synthesis_read(&s->vd, got);
+                continue;
+            }
+            for(i = 0; i < s->vi.channels; i++)
+                memcpy(s->scratch[i] + samples, pcm[i], got * sizeof(float));
+            samples += got;
+            vorbis_synthesis_read(&s->vd, got);
+        }
+    }
+
+    if(!s->stream)
+        return;
+
+    /* one allocation: the block, the channel pointers, then the audio */
+    size = sizeof(decoded_pcm) + s->vi.channels * sizeof(float *) +
+        s->vi.channels * samples * sizeof(float);
+    block = bufpool_alloc(size);
+    if(!block)
+        return;
+    block->pcm = (float **)(block + 1);
+    for(i = 0; i < s->vi.channels; i++)
+    {
+        block->pcm[i] = (float *)(block->pcm + s->vi.channels) + i * samples;
+        memcpy(block->pcm[i], s->scratch[i], samples * sizeof(float));
+    }
+    block->samples = samples;
+    block->stream = s->stream;
+    decode_stream_acquire(s->stream);
+
+    buf->pcm = block;
+}
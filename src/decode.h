@@ -0,0 +1,68 @@
+/* decode.h
+ * - single shared Vorbis decode of the input for reencoding instances.
+ *
+ * Copyright (c) 2026 The IceS Development Team <team@icecast.org>
+ *
+ * This program is distributed under the terms of the GNU General
+ * Public License, version 2. You may use, modify, and redistribute
+ * it under the terms of this license. A copy should be included
+ * with this source.
+ */
+
+#ifndef __DECODE_H
+#define __DECODE_H
+
+#include <stdatomic.h>
+
+#include <ogg/ogg.h>
+#include <vorbis/codec.h>
+
+#include "stream.h"
+
+/* What a reencoder needs to know about the logical stream a block of PCM
+ * came from. Shared by every block of that stream. */
+typedef struct decode_stream {
+    atomic_int count;
+    int serial;
+    int rate;
+    int channels;
+    long bitrate_nominal;   /* from the identification header, <= 0 if */
+    long bitrate_upper;     /* not given */
+    vorbis_comment vc;
+} decode_stream;
+
+/* the decoded audio of one input page, hung off its ref_buffer */
+typedef struct decoded_pcm {
+    decode_stream *stream;
+    int samples;
+    float **pcm;        /* stream->channels planar arrays */
+} decoded_pcm;
+
+typedef struct {
+    int serial;
+    int need_headers;
+    int failed;         /* not decodable, ignore it until the next stream */
+
+    ogg_stream_state os;
+    vorbis_info vi;
+    vorbis_comment vc;
+    vorbis_dsp_state vd;
+    vorbis_block vb;
+
+    decode_stream *stream;  /* set once the headers are all in */
+
+    /* collects the PCM from every packet on a page */
+    float **scratch;
+    int scratch_channels;
+    int scratch_size;
+} decode_state;
+
+decode_state *decode_initialise(void);
+void decode_page(decode_state *s, ref_buffer *buf);
+void decode_clear(decode_state *s);
+
+void decode_stream_acquire(decode_stream *stream);
+void decode_stream_release(decode_stream *stream);
+void decode_free_pcm(decoded_pcm *pcm);
+
+#endif /* __DECODE_H */
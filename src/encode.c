@@ -18,6 +18,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <ogg/ogg.h>
 #include <vorbis/codec.h>
@@ -25,6 +26,11 @@
 
 #include "cfgparse.h"
 #include "encode.h"
+#include "input.h"
+#include "pcmconv.h"
+#ifdef HAVE_OPUS
+#include "encode_opus.h"
+#endif
 
 #define MODULE "encode/"
 #include "logging.h"
@@ -46,26 +52,87 @@ static long _get_serial()
     return serial;
 }
 
+/* processor time used by the calling thread, in ns */
+static uint64_t _cpu_time()
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_THREAD_CPUTIME_ID)
+    struct timespec now;
+
+    if(clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now) == 0)
+        return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+    return (uint64_t)clock() * (1000000000 / CLOCKS_PER_SEC);
+}
+
 void encode_clear(encoder_state *s)
 {
     if(s)
     {
         LOG_DEBUG0("Clearing encoder engine");
+
+        /* enough to compare codecs and settings by, per stream */
+        if(s->samplerate && s->samples >= (uint64_t)s->samplerate)
+            LOG_INFO4("%s encoder used %lu ms of processor time for %lu s of "
+                    "audio, %lu ms per minute",
+                    s->codec == CODEC_OPUS ? "Opus" : "Vorbis",
+                    (unsigned long)(s->cpu_time / 1000000),
+                    (unsigned long)(s->samples / s->samplerate),
+                    (unsigned long)(s->cpu_time * 60 / 1000000 /
+                        (s->samples / s->samplerate)));
+
         ogg_stream_clear(&s->os);
-        vorbis_block_clear(&s->vb);
-        vorbis_dsp_clear(&s->vd);
-        vorbis_info_clear(&s->vi);
+#ifdef HAVE_OPUS
+        if(s->codec == CODEC_OPUS)
+            encode_opus_clear(s);
+        else
+#endif
+        {
+            vorbis_block_clear(&s->vb);
+            vorbis_dsp_clear(&s->vd);
+            vorbis_info_clear(&s->vi);
+        }
         free(s);
     }
 }
 
 
-encoder_state *encode_initialise(int channels, int rate, int managed,
-        int min_br, int nom_br, int max_br, float quality, vorbis_comment *vc)
+encoder_state *encode_initialise(encode_codec codec, int channels, int rate,
+        int managed, int min_br, int nom_br, int max_br, float quality,
+        vorbis_comment *vc)
 {
     encoder_state *s = calloc(1, sizeof(encoder_state));
+    uint64_t start = input_clock();
     ogg_packet h1,h2,h3;
 
+    s->codec = codec;
+    s->granule_scale = 1;
+    s->in_header = 1;
+    s->samplerate = rate;
+    s->samples_in_current_page = 0;
+    s->prevgranulepos = 0;
+    s->max_samples_ppage = rate*2;
+
+#ifdef HAVE_OPUS
+    if(codec == CODEC_OPUS)
+    {
+        /* Opus granule positions always count at 48kHz */
+        s->granule_scale = 48000 / rate;
+        ogg_stream_init(&s->os, _get_serial());
+        if(encode_opus_initialise(s, channels, rate, managed, min_br, nom_br,
+                    max_br, vc) == 0)
+        {
+            LOG_DEBUG1("Encoder set up in %lu us",
+                    (unsigned long)((input_clock() - start) / 1000));
+            return s;
+        }
+
+        LOG_INFO0("Failed to configure encoder, verify settings");
+        ogg_stream_clear(&s->os);
+        free(s);
+        return NULL;
+    }
+#endif
+
     /* Have vorbisenc choose a mode for us */
     vorbis_info_init(&s->vi);
 
@@ -136,12 +203,8 @@ encoder_state *encode_initialise(int channels, int rate, int managed,
         ogg_stream_packetin(&s->os, &h2);
         ogg_stream_packetin(&s->os, &h3);
 
-        s->in_header = 1;
-        s->samplerate = rate;
-        s->samples_in_current_page = 0;
-        s->prevgranulepos = 0;
-        s->max_samples_ppage = rate*2;
-
+        LOG_DEBUG1("Encoder set up in %lu us",
+                (unsigned long)((input_clock() - start) / 1000));
         return s;
     } while (0);
 
@@ -151,62 +214,158 @@ encoder_state *encode_initialise(int channels, int rate, int managed,
     return NULL;
 }
 
+/* Start a new logical stream, with new headers, on an encoder that has
+ * been through encode_finish() and had all its pages flushed. Everything
+ * that only depends on the settings is kept. For Opus that is nearly all
+ * of it. For Vorbis it is only the mode setup in vorbis_info: nearly all
+ * of the cost is vorbis_analysis_init(), which libvorbis gives no way to
+ * skip for a new stream (see tests/restart_bench).
+ * Returns 0, or -1 if the encoder has to be cleared and set up afresh.
+ */
+int encode_restart(encoder_state *s, vorbis_comment *vc)
+{
+    uint64_t start = input_clock();
+    ogg_packet h1,h2,h3;
+
+    ogg_stream_clear(&s->os);
+    ogg_stream_init(&s->os, _get_serial());
+
+#ifdef HAVE_OPUS
+    if(s->codec == CODEC_OPUS)
+    {
+        if(encode_opus_restart(s, vc) < 0)
+            return -1;
+    }
+    else
+#endif
+    {
+        vorbis_block_clear(&s->vb);
+        vorbis_dsp_clear(&s->vd);
+        if(vorbis_analysis_init(&s->vd, &s->vi))
+            return -1;
+        vorbis_block_init(&s->vd, &s->vb);
+
+        vorbis_analysis_headerout(&s->vd, vc, &h1,&h2,&h3);
+        ogg_stream_packetin(&s->os, &h1);
+        ogg_stream_packetin(&s->os, &h2);
+        ogg_stream_packetin(&s->os, &h3);
+    }
+
+    s->in_header = 1;
+    s->samples_in_current_page = 0;
+    s->prevgranulepos = 0;
+    s->page_captured = 0;
+
+    LOG_DEBUG1("Encoder restarted in %lu us",
+            (unsigned long)((input_clock() - start) / 1000));
+    return 0;
+}
+
 void encode_data_float(encoder_state *s, float **pcm, int samples)
 {
+    uint64_t start = _cpu_time();
     float **buf;
     int i;
 
-    buf = vorbis_analysis_buffer(&s->vd, samples); 
-
-    for(i=0; i < s->vi.channels; i++)
+#ifdef HAVE_OPUS
+    if(s->codec == CODEC_OPUS)
+        encode_opus_data_float(s, pcm, samples);
+    else
+#endif
     {
-        memcpy(buf[i], pcm[i], samples*sizeof(float));
+        buf = vorbis_analysis_buffer(&s->vd, samples); 
+
+        for(i=0; i < s->vi.channels; i++)
+        {
+            memcpy(buf[i], pcm[i], samples*sizeof(float));
+        }
+
+        vorbis_analysis_wrote(&s->vd, samples);
     }
 
-    vorbis_analysis_wrote(&s->vd, samples);
+    s->samples_in_current_page += samples;
+    s->samples += samples;
+    s->cpu_time += _cpu_time() - start;
+}
+
+/* Room for samples more of planar float input, for a resampler to write
+ * straight into, to be handed over with encode_wrote(). NULL if out of
+ * memory. */
+float **encode_buffer(encoder_state *s, int samples)
+{
+#ifdef HAVE_OPUS
+    if(s->codec == CODEC_OPUS)
+        return encode_opus_buffer(s, samples);
+#endif
+    return vorbis_analysis_buffer(&s->vd, samples);
+}
+
+void encode_wrote(encoder_state *s, int samples)
+{
+    uint64_t start = _cpu_time();
+
+    /* vorbis takes no samples to mean the end of the stream */
+    if(samples <= 0)
+        return;
+
+#ifdef HAVE_OPUS
+    if(s->codec == CODEC_OPUS)
+        encode_opus_wrote(s, samples);
+    else
+#endif
+        vorbis_analysis_wrote(&s->vd, samples);
 
     s->samples_in_current_page += samples;
+    s->samples += samples;
+    s->cpu_time += _cpu_time() - start;
 }
 
-/* Requires little endian data (currently) */
-void encode_data(encoder_state *s, signed char *buf, int bytes, int bigendian)
+void encode_data(encoder_state *s, signed char *buf, int bytes,
+        input_subtype format)
 {
+    uint64_t start = _cpu_time();
     float **buffer;
-    int i,j;
     int channels = s->vi.channels;
-    int samples = bytes/(2*channels);
-
-    buffer = vorbis_analysis_buffer(&s->vd, samples);
+    int size = pcm_sample_size(format);
+    int samples;
 
-    if(bigendian)
+#ifdef HAVE_OPUS
+    if(s->codec == CODEC_OPUS)
     {
-        for(i=0; i < samples; i++)
-        {
-            for(j=0; j < channels; j++)
-            {
-                buffer[j][i]=((buf[2*(i*channels + j)]<<8) |
-                              (0x00ff&(int)buf[2*(i*channels + j)+1]))/32768.f;
-            }
-        }
+        channels = encode_opus_channels(s);
+        samples = bytes/(size*channels);
+        encode_opus_data(s, buf, samples, format);
     }
     else
+#endif
     {
-        for(i=0; i < samples; i++)
-        {
-            for(j=0; j < channels; j++)
-            {
-                buffer[j][i]=((buf[2*(i*channels + j) + 1]<<8) |
-                              (0x00ff&(int)buf[2*(i*channels + j)]))/32768.f;
-            }
-        }
-    }
+        samples = bytes/(size*channels);
+        buffer = vorbis_analysis_buffer(&s->vd, samples);
+
+        pcm_to_float(buffer, buf, samples, channels, format);
 
-    vorbis_analysis_wrote(&s->vd, samples);
+        vorbis_analysis_wrote(&s->vd, samples);
+    }
 
     s->samples_in_current_page += samples;
+    s->samples += samples;
+    s->cpu_time += _cpu_time() - start;
 }
 
 
+/* When the oldest audio not yet out in a page was captured, or 0 */
+static uint64_t _oldest_captured(encoder_state *s)
+{
+    uint64_t waiting;
+
+    if(!s->captured || s->samples_in_current_page <= 0)
+        return 0;
+    waiting = (uint64_t)s->samples_in_current_page * 1000000000 /
+        s->samplerate;
+
+    return waiting < s->captured ? s->captured - waiting : 0;
+}
+
 /* Returns:
  *   0     No output at this time
  *   >0    Page produced
@@ -217,10 +376,18 @@ void encode_data(encoder_state *s, signed char *buf, int bytes, int bigendian)
 int encode_dataout(encoder_state *s, ogg_page *og)
 {
     ogg_packet op;
+    uint64_t oldest;
     int result;
 
     if(s->in_header)
     {
+        s->page_captured = 0;
+#ifdef HAVE_OPUS
+        /* flushed already, before any audio went in after them */
+        if(s->codec == CODEC_OPUS)
+            result = encode_opus_headerout(s, og);
+        else
+#endif
         result = ogg_stream_flush(&s->os, og);
         if(result==0) 
         {
@@ -232,7 +399,11 @@ int encode_dataout(encoder_state *s, ogg_page *og)
     }
     else
     {
-        while(vorbis_analysis_blockout(&s->vd, &s->vb)==1)
+        uint64_t start = _cpu_time();
+
+        /* Opus packets go into the stream as they're encoded */
+        while(s->codec == CODEC_VORBIS &&
+                vorbis_analysis_blockout(&s->vd, &s->vb)==1)
         {
             vorbis_analysis(&s->vb, NULL);
             vorbis_bitrate_addblock(&s->vb);
@@ -240,14 +411,20 @@ int encode_dataout(encoder_state *s, ogg_page *og)
             while(vorbis_bitrate_flushpacket(&s->vd, &op)) 
                 ogg_stream_packetin(&s->os, &op);
         }
+        s->cpu_time += _cpu_time() - start;
 
-        /* FIXME: Make this threshold configurable.
-         * We don't want to buffer too many samples in one page when doing
+        /* We don't want to buffer too many samples in one page when doing
          * live encoding - that's fine for non-live encoding, but breaks
          * badly when doing things live. 
-         * So, we flush the stream if we have too many samples buffered
+         * So, we flush the stream if we have too many samples buffered,
+         * or if the oldest of them has been waiting for longer than the
+         * latency asked for, which also counts time spent queued before
+         * reaching the encoder.
          */
-        if(s->samples_in_current_page > s->max_samples_ppage)
+        oldest = _oldest_captured(s);
+        if(s->samples_in_current_page > s->max_samples_ppage ||
+                (s->flush_latency && oldest &&
+                 input_clock() - oldest >= s->flush_latency))
         {
             /*LOG_DEBUG1("Forcing flush: Too many samples in current page (%d)",
                     s->samples_in_current_page); */
@@ -260,8 +437,9 @@ int encode_dataout(encoder_state *s, ogg_page *og)
             return 0;
         else /* Page found! */
         {
-            s->samples_in_current_page -= ogg_page_granulepos(og) - 
-                    s->prevgranulepos;
+            s->page_captured = oldest;
+            s->samples_in_current_page -= (ogg_page_granulepos(og) - 
+                    s->prevgranulepos) / s->granule_scale;
             s->prevgranulepos = ogg_page_granulepos(og);
             return 1;
         }
@@ -271,6 +449,15 @@ int encode_dataout(encoder_state *s, ogg_page *og)
 void encode_finish(encoder_state *s)
 {
     ogg_packet op;
+
+#ifdef HAVE_OPUS
+    if(s->codec == CODEC_OPUS)
+    {
+        encode_opus_finish(s);
+        return;
+    }
+#endif
+
     vorbis_analysis_wrote(&s->vd, 0);
 
     while(vorbis_analysis_blockout(&s->vd, &s->vb)==1)
@@ -14,27 +14,57 @@
 #ifndef __ENCODE_H
 #define __ENCODE_H
 
+#include <stdint.h>
+
 #include <ogg/ogg.h>
 #include <vorbis/codec.h>
 
+#include "cfgparse.h"
+#include "inputmodule.h"
+
+struct encode_opus_state;
+
 typedef struct {
+    encode_codec codec;
     ogg_stream_state os;
+
+    /* Vorbis */
     vorbis_block vb;
     vorbis_dsp_state vd;
     vorbis_info vi;
 
+    /* Opus, see encode_opus.c */
+    struct encode_opus_state *opus;
+
     int samples_in_current_page;
     int max_samples_ppage;
     int samplerate;
+    int granule_scale;      /* granulepos units per input sample */
     ogg_int64_t prevgranulepos;
     int in_header;
+
+    /* Time based flushing, in ns on input_clock(): when the audio last
+     * passed in was captured, set by the caller, and a page is forced out
+     * once the oldest audio still waiting is flush_latency old */
+    uint64_t flush_latency;
+    uint64_t captured;
+    uint64_t page_captured;     /* of the oldest audio in the last page */
+
+    /* processor time spent encoding, and how much audio it was for */
+    uint64_t cpu_time;
+    uint64_t samples;
 } encoder_state;
 
-encoder_state *encode_initialise(int channels, int rate, int managed,
-    int min_br, int nom_br, int max_br, float quality, vorbis_comment *vc);
+encoder_state *encode_initialise(encode_codec codec, int channels, int rate,
+    int managed, int min_br, int nom_br, int max_br, float quality,
+    vorbis_comment *vc);
 void encode_clear(encoder_state *s);
+int encode_restart(encoder_state *s, vorbis_comment *vc);
 void encode_data_float(encoder_state *s, float **pcm, int samples);
-void encode_data(encoder_state *s, signed char *buf, int bytes, int bigendian);
+void encode_data(encoder_state *s, signed char *buf, int bytes,
+        input_subtype format);
+float **encode_buffer(encoder_state *s, int samples);
+void encode_wrote(encoder_state *s, int samples);
 int encode_dataout(encoder_state *s, ogg_page *og);
 void encode_finish(encoder_state *s);
 int encode_flush(encoder_state *s, ogg_page *og);
@@ -0,0 +1,461 @@
+/* encode_group.c
+ * - one shared encoder for instances with identical encoder settings.
+ *
+ * Publishing the same PCM input to several servers (a primary and a
+ * backup, say) used to run a complete Vorbis encoder per instance, all
+ * producing byte-identical output. At startup, instances whose encoder
+ * settings match are put into a group with a single encoder. The input
+ * thread hands that encoder the PCM once, and every Ogg page it produces
+ * is queued by reference to each member, which then sends it on as-is.
+ *
+ * Every encoding or reencoding instance is in a group, if only on its own,
+ * and the encoders are run by the worker pool in encode_pool.c, so the
+ * instance threads only ever send.
+ *
+ * The group keeps the header pages of the logical stream it is producing,
+ * so a member that is restarted can be sent those and carry on from the
+ * next page, without the other members' listeners seeing a new stream.
+ *
+ * Copyright (c) 2026 The IceS Development Team <team@icecast.org>
+ *
+ * This program is distributed under the terms of the GNU General
+ * Public License, version 2. You may use, modify, and redistribute
+ * it under the terms of this license. A copy should be included
+ * with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+ #include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ogg/ogg.h>
+#include <vorbis/codec.h>
+
+#include <common/thread/thread.h>
+
+#include "cfgparse.h"
+#include "stream.h"
+#include "queue.h"
+#include "input.h"
+#include "inputmodule.h"
+#include "stream_shared.h"
+#include "bufpool.h"
+#include "encode.h"
+#include "reencode.h"
+#include "audio.h"
+#include "encode_pool.h"
+#include "encode_group.h"
+
+#define MODULE "encode-group/"
+#include "logging.h"
+
+/* buffers a worker encodes before giving other groups a turn */
+#define ENCODE_GROUP_BATCH 8
+
+static encode_group *groups;
+
+/* Everything that affects the encoded output has to match */
+static int encode_group_match(instance_t *a, instance_t *b)
+{
+    return a->codec == b->codec &&
+        a->channels == b->channels &&
+        a->samplerate == b->samplerate &&
+        a->managed == b->managed &&
+        a->min_br == b->min_br &&
+        a->nom_br == b->nom_br &&
+        a->max_br == b->max_br &&
+        a->quality == b->quality &&
+        a->downmix == b->downmix &&
+        a->resampleinrate == b->resampleinrate &&
+        a->resampleoutrate == b->resampleoutrate &&
+        a->max_samples_ppage == b->max_samples_ppage &&
+        a->latency_ms == b->latency_ms &&
+        a->passthrough == b->passthrough;
+}
+
+/* Set up the encoder the same way ices_instance_stream() would for a
+ * single instance.
+ */
+static int encode_group_start_encoder(encode_group *group,
+        input_module_t *inmod)
+{
+    stream_description *sdsc = &group->sdsc;
+    instance_t *profile = &group->profile;
+
+    sdsc->stream = profile;
+    sdsc->input = inmod;
+    vorbis_comment_init(&sdsc->vc);
+    /* just the headers, for members that rejoin */
+    sdsc->preroll = preroll_initialise(0);
+
+    if(inmod->type == ICES_INPUT_VORBIS)
+    {
+        sdsc->reenc = reencode_init(profile);
+        return sdsc->reenc ? 0 : -1;
+    }
+
+    if(profile->downmix && profile->channels == 1)
+        sdsc->downmix = downmix_initialise();
+
+    if(profile->resampleinrate && profile->resampleoutrate) {
+        profile->samplerate = profile->resampleoutrate;
+        sdsc->resamp = resample_initialise(profile->channels,
+                profile->resampleinrate, profile->resampleoutrate);
+    }
+
+    if(inmod->metadata_update)
+        inmod->metadata_update(inmod->internal, &sdsc->vc);
+    sdsc->enc = encode_initialise(profile->codec, profile->channels,
+            profile->samplerate, profile->managed, profile->min_br,
+            profile->nom_br, profile->max_br, profile->quality, &sdsc->vc);
+    if(!sdsc->enc)
+        return -1;
+    sdsc->enc->max_samples_ppage = profile->max_samples_ppage;
+    sdsc->enc->flush_latency = (uint64_t)profile->latency_ms * 1000000;
+    sdsc->encoding = 1;
+
+    return 0;
+}
+
+static void encode_group_free(encode_group *group)
+{
+    stream_description *sdsc = &group->sdsc;
+
+    encode_clear(sdsc->enc);
+    reencode_clear(sdsc->reenc);
+    downmix_clear(sdsc->downmix);
+    resample_clear(sdsc->resamp);
+    preroll_clear(sdsc->preroll);
+    vorbis_comment_clear(&sdsc->vc);
+
+    queue_free(group->queue);
+    thread_mutex_destroy(&group->lock);
+    free(group->profile.mount);
+    free(group->members);
+    free(group);
+}
+
+/* Page sink for stream_encode_buffer(): wrap the page up in a ref_buffer
+ * and queue it to every member that wants it, as the input loop would.
+ */
+static int encode_group_send_page(void *arg, ogg_page *og)
+{
+    encode_group *group = arg;
+    ref_buffer *page;
+    int i;
+
+    preroll_add_page(group->sdsc.preroll, og);
+
+    page = bufpool_get_ref();
+    if(!page)
+        return 0;
+    page->len = og->header_len + og->body_len;
+    page->buf = bufpool_alloc(page->len);
+    if(!page->buf)
+    {
+        bufpool_put_ref(page);
+        return 0;
+    }
+    memcpy(page->buf, og->header, og->header_len);
+    memcpy(page->buf + og->header_len, og->body, og->body_len);
+    page->aux_data = og->header_len;
+    page->deadline = group->deadline;
+    /* pages from our own encoder know how old their audio is; reencoded
+     * ones go by the input page */
+    page->captured = group->sdsc.enc ? group->sdsc.enc->page_captured :
+        group->captured;
+    /* a member that has lost its connection picks up again from the start
+     * of the next logical stream */
+    page->critical = ogg_page_bos(og);
+    atomic_init(&page->count, 1);
+
+    thread_mutex_lock(&group->lock);
+    for(i = 0; i < group->count; i++)
+    {
+        instance_t *instance = group->members[i];
+
+        if(atomic_load(&instance->wait_for_critical) && !page->critical)
+            continue;
+        if(instance->skip)
+            continue;
+
+        input_queue_buffer(instance, page);
+    }
+    for(i = 0; i < group->count; i++)
+        queue_signal(group->members[i]->queue);
+    thread_mutex_unlock(&group->lock);
+
+    group->pages++;
+    group->bytes += page->len;
+    stream_release_buffer(page);
+
+    return 1;
+}
+
+/* Queue the headers of the current logical stream to every member that is
+ * waiting for them, and let the pages that follow through to it. Returns
+ * -1 if the headers aren't known, so the members have to wait for the
+ * next logical stream.
+ */
+static int encode_group_send_headers(encode_group *group)
+{
+    ref_buffer *headers;
+    int i;
+
+    headers = bufpool_get_ref();
+    if(!headers)
+        return -1;
+    headers->buf = preroll_get_headers(group->sdsc.preroll, &headers->len);
+    if(!headers->buf)
+    {
+        bufpool_put_ref(headers);
+        return -1;
+    }
+    headers->deadline = group->deadline;
+    headers->critical = 1;
+    atomic_init(&headers->count, 1);
+
+    thread_mutex_lock(&group->lock);
+    for(i = 0; i < group->count; i++)
+    {
+        instance_t *instance = group->members[i];
+
+        if(!atomic_load(&instance->wait_for_critical) || instance->skip)
+            continue;
+
+        LOG_DEBUG1("Sending stream headers to rejoining mount %s",
+                instance->mount);
+        if(input_queue_buffer(instance, headers))
+            atomic_store(&instance->wait_for_critical, 0);
+        queue_signal(instance->queue);
+    }
+    thread_mutex_unlock(&group->lock);
+    stream_release_buffer(headers);
+
+    return 0;
+}
+
+static int encode_group_reencode(encode_group *group, ref_buffer *buffer)
+{
+    unsigned char *buf;
+    int len, ret;
+
+    ret = reencode_page(group->sdsc.reenc, buffer, &buf, &len);
+    if(ret > 0)
+        return stream_split_pages(buf, len, encode_group_send_page, group);
+    return ret == 0 ? -1 : -2;
+}
+
+/* Pool job: encode a batch of what the input thread has queued. */
+static void encode_group_run(void *arg)
+{
+    encode_group *group = arg;
+    ref_buffer *buffer;
+    int ret, i;
+
+    for(i = 0; i < ENCODE_GROUP_BATCH; i++)
+    {
+        buffer = queue_pop(group->queue);
+        if(!buffer)
+            break;
+
+        /* a member rejoining needs headers: those of the current
+         * stream if there are any, or a new stream. A critical buffer
+         * starts a new stream anyway. */
+        if(atomic_exchange(&group->rejoin, 0) && !buffer->critical &&
+                encode_group_send_headers(group) < 0)
+        {
+            if(group->sdsc.reenc)
+                reencode_restart(group->sdsc.reenc);
+            else
+                stream_encode_restart(&group->sdsc, encode_group_send_page,
+                        group);
+        }
+
+        group->deadline = buffer->deadline;
+        group->captured = buffer->captured;
+        if(group->sdsc.reenc)
+            ret = encode_group_reencode(group, buffer);
+        else
+            ret = stream_encode_buffer(&group->sdsc, buffer,
+                    encode_group_send_page, group);
+        if(ret == 0)
+            LOG_ERROR0("Out of memory queueing encoded page, page dropped");
+        else if(ret == -2)
+            LOG_ERROR0("Serious error in shared encoder, waiting to restart "
+                    "on next substream. Streams temporarily suspended.");
+
+        stream_release_buffer(buffer);
+    }
+}
+
+/* Called before the instance threads are started. Instances with matching
+ * encoder settings are grouped and given a shared encoder, and the worker
+ * pool is started to run them. If that fails the instances encode for
+ * themselves. Returns the number of groups.
+ */
+int encode_groups_create(instance_t *instances, input_module_t *inmod)
+{
+    instance_t *instance, *other;
+    encode_group *group;
+    int created = 0, i;
+
+    if(inmod->type != ICES_INPUT_PCM && inmod->type != ICES_INPUT_VORBIS)
+        return 0;
+
+    for(instance = instances; instance; instance = instance->next)
+    {
+        int count = 1, length = instance->max_queue_length;
+
+        if(!instance->encode || instance->encode_group)
+            continue;
+
+        for(other = instance->next; other; other = other->next)
+            if(other->encode && !other->encode_group &&
+                    encode_group_match(instance, other))
+            {
+                count++;
+                if(other->max_queue_length > length)
+                    length = other->max_queue_length;
+            }
+
+        group = calloc(1, sizeof(encode_group));
+        if(!group)
+            break;
+        group->profile = *instance;
+        group->profile.queue = NULL;
+        group->profile.next = NULL;
+        /* logged at shutdown, when the member it came from is long gone */
+        group->profile.mount = strdup(instance->mount);
+        group->members = calloc(count, sizeof(instance_t *));
+        atomic_init(&group->rejoin, 0);
+        group->queue = queue_create(length);
+        group->job.run = encode_group_run;
+        group->job.arg = group;
+        group->job.queue = group->queue;
+        thread_mutex_create(&group->lock);
+
+        if(!group->profile.mount || !group->members || !group->queue ||
+                encode_group_start_encoder(group, inmod) < 0)
+        {
+            LOG_WARN0("Failed to set up shared encoder, instances will "
+                    "encode separately");
+            encode_group_free(group);
+            continue;
+        }
+
+        for(other = instance; other; other = other->next)
+            if(other->encode && !other->encode_group &&
+                    encode_group_match(instance, other))
+            {
+                other->encode_group = group;
+                /* what the server is told about the stream */
+                other->samplerate = group->profile.samplerate;
+                group->members[group->count++] = other;
+            }
+
+        if(group->count > 1)
+            LOG_INFO2("Sharing one encoder between %d instances, starting "
+                    "with mount %s", group->count, instance->mount);
+
+        group->next = groups;
+        groups = group;
+        created++;
+    }
+
+    if(created && encode_pool_start(created) <= 0)
+    {
+        LOG_WARN0("Failed to start encoder threads, instances will encode "
+                "separately");
+        while((group = groups))
+        {
+            groups = group->next;
+            for(i = 0; i < group->count; i++)
+                group->members[i]->encode_group = NULL;
+            encode_group_free(group);
+        }
+        created = 0;
+    }
+
+    return created;
+}
+
+/* Input thread: hand a chunk of PCM to every group that still has
+ * members.
+ */
+void encode_groups_queue_buffer(ref_buffer *chunk)
+{
+    encode_group *group;
+
+    for(group = groups; group; group = group->next)
+    {
+        if(!group->count)
+            continue;
+
+        stream_acquire_buffer(chunk);
+        if(queue_push(group->queue, chunk) < 0)
+        {
+            if(!group->queue_full)
+                LOG_WARN0("Shared encoder isn't keeping up, dropping input");
+            group->queue_full = 1;
+            stream_release_buffer(chunk);
+            queue_dropped(group->queue, chunk);
+            continue;
+        }
+        group->queue_full = 0;
+        encode_pool_schedule(&group->job);
+    }
+}
+
+/* Input thread: stop sending pages to an instance that is about to be
+ * freed.
+ */
+void encode_group_remove(instance_t *instance)
+{
+    encode_group *group = instance->encode_group;
+    int i;
+
+    if(!group)
+        return;
+
+    thread_mutex_lock(&group->lock);
+    for(i = 0; i < group->count; i++)
+        if(group->members[i] == instance)
+        {
+            group->members[i] = group->members[--group->count];
+            break;
+        }
+    thread_mutex_unlock(&group->lock);
+
+    instance->encode_group = NULL;
+}
+
+/* A member that has just (re)started, and is waiting for a critical
+ * buffer, needs headers. The group sends it those of the current logical
+ * stream before its next buffer, see encode_group_send_headers().
+ */
+void encode_group_rejoin(encode_group *group)
+{
+    atomic_store(&group->rejoin, 1);
+}
+
+void encode_groups_shutdown(void)
+{
+    encode_group *group;
+
+    encode_pool_shutdown();
+
+    while((group = groups))
+    {
+        groups = group->next;
+
+        LOG_INFO4("Encoder for mount %s: %lu pages (%lu bytes), %lu ms "
+                "encoding", group->profile.mount, group->pages, group->bytes,
+                (unsigned long)(group->job.busy / 1000000));
+        encode_group_free(group);
+    }
+}
@@ -0,0 +1,58 @@
+/* encode_group.h
+ * - one shared encoder for instances with identical encoder settings.
+ *
+ * Copyright (c) 2026 The IceS Development Team <team@icecast.org>
+ *
+ * This program is distributed under the terms of the GNU General
+ * Public License, version 2. You may use, modify, and redistribute
+ * it under the terms of this license. A copy should be included
+ * with this source.
+ */
+
+#ifndef __ENCODE_GROUP_H
+#define __ENCODE_GROUP_H
+
+#include <stdatomic.h>
+
+#include <common/thread/thread.h>
+
+#include "cfgparse.h"
+#include "stream.h"
+#include "queue.h"
+#include "input.h"
+#include "encode_pool.h"
+
+typedef struct encode_group {
+    /* the encoder settings, copied from the first member so they outlive
+     * it; only the encoding fields and mount, which is the group's own
+     * copy, are meaningful. Any other strings still belong to the member. */
+    instance_t profile;
+    stream_description sdsc;
+
+    buffer_queue *queue;        /* PCM, or pages to reencode, from the input
+                                 * thread */
+    encode_pool_job job;
+    int queue_full;
+    atomic_int rejoin;          /* a member needs the stream headers */
+    uint64_t deadline;          /* of the PCM being encoded */
+    uint64_t captured;
+
+    /* members are only added before the group starts, and removed by the
+     * input thread; lock covers removal against fan-out */
+    mutex_t lock;
+    instance_t **members;
+    int count;
+
+    unsigned long pages;
+    unsigned long bytes;
+
+    struct encode_group *next;
+} encode_group;
+
+int encode_groups_create(instance_t *instances, input_module_t *inmod);
+void encode_groups_queue_buffer(ref_buffer *chunk);
+void encode_group_remove(instance_t *instance);
+void encode_group_rejoin(encode_group *group);
+void encode_groups_shutdown(void);
+
+#endif /* __ENCODE_GROUP_H */
@@ -0,0 +1,399 @@
+/* encode_opus.c
+ * - Opus encoding behind the encoder_state API.
+ *
+ * Takes the same planar float or 16 bit PCM as the Vorbis encoder, cuts
+ * it into 20ms frames and packs the Opus packets into the encoder's Ogg
+ * stream following RFC 7845: an OpusHead page, OpusTags, then audio with
+ * granule positions counted at 48kHz whatever the input rate, including
+ * the encoder's pre-skip, and trimmed to the real end of the audio on the
+ * last page. Only mono and stereo are supported.
+ *
+ * Copyright (c) 2026 The IceS Development Team <team@icecast.org>
+ *
+ * This program is distributed under the terms of the GNU General
+ * Public License, version 2. You may use, modify, and redistribute
+ * it under the terms of this license. A copy should be included
+ * with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+ #include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ogg/ogg.h>
+#include <vorbis/codec.h>
+#include <opus/opus.h>
+
+#include "cfgparse.h"
+#include "encode.h"
+#include "encode_opus.h"
+#include "pcmconv.h"
+
+#define MODULE "encode-opus/"
+#include "logging.h"
+
+/* the largest packet opus_encode_float() can produce, RFC 6716 3.2.1 */
+#define OPUS_MAX_PACKET 1275
+#define OPUS_FRAME_MS 20
+
+typedef struct encode_opus_state {
+    OpusEncoder *enc;
+    int channels;
+    int rate;
+    int frame_size;             /* samples per channel per packet */
+    int lookahead;              /* in input samples */
+
+    float *frame;               /* interleaved, frame_size * channels */
+    int fill;
+
+    /* for PCM input */
+    float *conv[2];
+    int convlen;
+
+    ogg_int64_t packetno;
+    ogg_int64_t granulepos;     /* at 48kHz, of the last packet */
+    ogg_int64_t samples;        /* real input so far */
+    int preskip;                /* at 48kHz */
+
+    /* The header pages, flushed out of the Ogg stream as soon as they are
+     * made so that no audio packet can share a page with them, and handed
+     * out by encode_opus_headerout(). */
+    unsigned char *headers;
+    long headers_len;
+    long headers_pos;
+
+    unsigned char packet[OPUS_MAX_PACKET];
+} encode_opus_state;
+
+static void put_le16(unsigned char *p, int v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+}
+
+static void put_le32(unsigned char *p, unsigned v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+static void encode_opus_headers(encoder_state *s, vorbis_comment *vc)
+{
+    encode_opus_state *o = s->opus;
+    const char *vendor = opus_get_version_string();
+    unsigned char head[19], *tags;
+    ogg_packet op;
+    ogg_page og;
+    long len;
+    int i;
+
+    memcpy(head, "OpusHead", 8);
+    head[8] = 1;                    /* version */
+    head[9] = o->channels;
+    put_le16(head + 10, o->preskip);
+    put_le32(head + 12, o->rate);   /* what the input was, for information */
+    put_le16(head + 16, 0);         /* output gain */
+    head[18] = 0;                   /* mono or stereo mapping */
+
+    memset(&op, 0, sizeof(op));
+    op.packet = head;
+    op.bytes = sizeof(head);
+    op.b_o_s = 1;
+    op.packetno = o->packetno++;
+    ogg_stream_packetin(&s->os, &op);
+
+    len = 8 + 4 + strlen(vendor) + 4;
+    for(i = 0; i < vc->comments; i++)
+        len += 4 + vc->comment_lengths[i];
+    tags = malloc(len);
+    if(!tags)
+        return;
+
+    memcpy(tags, "OpusTags", 8);
+    len = 8;
+    put_le32(tags + len, strlen(vendor));
+    memcpy(tags + len + 4, vendor, strlen(vendor));
+    len += 4 + strlen(vendor);
+    put_le32(tags + len, vc->comments);
+    len += 4;
+    for(i = 0; i < vc->comments; i++)
+    {
+        put_le32(tags + len, vc->comment_lengths[i]);
+        memcpy(tags + len + 4, vc->user_comments[i], vc->comment_lengths[i]);
+        len += 4 + vc->comment_lengths[i];
+    }
+
+    memset(&op, 0, sizeof(op));
+    op.packet = tags;
+    op.bytes = len;
+    op.packetno = o->packetno++;
+    ogg_stream_packetin(&s->os, &op);
+    free(tags);
+
+    /* RFC 7845 section 3: audio starts on a new page */
+    o->headers_len = 0;
+    o->headers_pos = 0;
+    while(ogg_stream_flush(&s->os, &og))
+    {
+        unsigned char *headers = realloc(o->headers,
+                o->headers_len + og.header_len + og.body_len);
+
+        if(!headers)
+            return;
+        memcpy(headers + o->headers_len, og.header, og.header_len);
+        memcpy(headers + o->headers_len + og.header_len, og.body,
+                og.body_len);
+        o->headers = headers;
+        o->headers_len += og.header_len + og.body_len;
+    }
+}
+
+/* The next of the header pages kept by encode_opus_headers(), in og until
+ * the next call. Returns 0 once they have all been handed out. */
+int encode_opus_headerout(encoder_state *s, ogg_page *og)
+{
+    encode_opus_state *o = s->opus;
+    unsigned char *page = o->headers + o->headers_pos;
+    int i;
+
+    if(o->headers_pos >= o->headers_len)
+        return 0;
+
+    /* 27 bytes of fixed header, then the segment table */
+    og->header = page;
+    og->header_len = 27 + page[26];
+    og->body = page + og->header_len;
+    og->body_len = 0;
+    for(i = 0; i < page[26]; i++)
+        og->body_len += page[27 + i];
+    o->headers_pos += og->header_len + og->body_len;
+
+    return 1;
+}
+
+/* Returns -1 if Opus can't encode with these settings. The Ogg stream in s
+ * is already set up. */
+int encode_opus_initialise(encoder_state *s, int channels, int rate,
+        int managed, int min_br, int nom_br, int max_br, vorbis_comment *vc)
+{
+    encode_opus_state *o;
+    int err;
+
+    if(rate != 8000 && rate != 12000 && rate != 16000 && rate != 24000 &&
+            rate != 48000)
+    {
+        LOG_ERROR1("Opus can't encode at %d Hz, resample to 8000, 12000, "
+                "16000, 24000 or 48000", rate);
+        return -1;
+    }
+    if(channels < 1 || channels > 2)
+    {
+        LOG_ERROR1("Opus encoding of %d channels is not supported", channels);
+        return -1;
+    }
+
+    o = calloc(1, sizeof(encode_opus_state));
+    if(!o)
+        return -1;
+    o->channels = channels;
+    o->rate = rate;
+    o->frame_size = rate * OPUS_FRAME_MS / 1000;
+    o->frame = calloc(o->frame_size * channels, sizeof(float));
+    o->enc = opus_encoder_create(rate, channels, OPUS_APPLICATION_AUDIO,
+            &err);
+    if(!o->frame || err != OPUS_OK)
+    {
+        if(err != OPUS_OK)
+            LOG_ERROR1("Failed to create Opus encoder: %s", opus_strerror(err));
+        if(o->enc)
+            opus_encoder_destroy(o->enc);
+        free(o->frame);
+        free(o);
+        return -1;
+    }
+
+    if(nom_br > 0)
+    {
+        LOG_INFO4("Opus encoder initialising: %d channel(s), %d Hz, bitrate "
+                "%d, %s", channels, rate, nom_br,
+                managed ? "constrained VBR" : "VBR");
+        opus_encoder_ctl(o->enc, OPUS_SET_BITRATE(nom_br));
+        opus_encoder_ctl(o->enc, OPUS_SET_VBR_CONSTRAINT(managed ? 1 : 0));
+    }
+    else
+        LOG_INFO2("Opus encoder initialising: %d channel(s), %d Hz, "
+                "automatic bitrate", channels, rate);
+    if(min_br > 0 || max_br > 0)
+        LOG_INFO0("ignoring min/max bitrate, not supported by Opus, use "
+                "managed with nominal-bitrate instead");
+
+    opus_encoder_ctl(o->enc, OPUS_GET_LOOKAHEAD(&o->lookahead));
+    o->preskip = o->lookahead * s->granule_scale;
+
+    s->opus = o;
+    encode_opus_headers(s, vc);
+
+    return 0;
+}
+
+/* For encode_restart(): same settings, new stream */
+int encode_opus_restart(encoder_state *s, vorbis_comment *vc)
+{
+    encode_opus_state *o = s->opus;
+
+    if(opus_encoder_ctl(o->enc, OPUS_RESET_STATE) != OPUS_OK)
+        return -1;
+    o->fill = 0;
+    o->packetno = 0;
+    o->granulepos = 0;
+    o->samples = 0;
+    encode_opus_headers(s, vc);
+
+    return 0;
+}
+
+void encode_opus_clear(encoder_state *s)
+{
+    encode_opus_state *o = s->opus;
+
+    if(o)
+    {
+        opus_encoder_destroy(o->enc);
+        free(o->frame);
+        free(o->conv[0]);
+        free(o->conv[1]);
+        free(o->headers);
+        free(o);
+        s->opus = NULL;
+    }
+}
+
+int encode_opus_channels(encoder_state *s)
+{
+    return s->opus->channels;
+}
+
+static void encode_opus_packet(encoder_state *s, int eos)
+{
+    encode_opus_state *o = s->opus;
+    ogg_packet op;
+    int len;
+
+    len = opus_encode_float(o->enc, o->frame, o->frame_size, o->packet,
+            sizeof(o->packet));
+    o->fill = 0;
+    o->granulepos += o->frame_size * s->granule_scale;
+    if(len < 0)
+    {
+        LOG_ERROR1("Opus encoding failed: %s", opus_strerror(len));
+        return;
+    }
+
+    memset(&op, 0, sizeof(op));
+    op.packet = o->packet;
+    op.bytes = len;
+    op.e_o_s = eos;
+    op.packetno = o->packetno++;
+    /* the last page says where the real audio ends */
+    op.granulepos = eos ? o->preskip + o->samples * s->granule_scale :
+        o->granulepos;
+    ogg_stream_packetin(&s->os, &op);
+}
+
+/* Add samples to the current frame, from pcm if given or silence if not,
+ * encoding each frame as it fills up. */
+static void encode_opus_add(encoder_state *s, float **pcm, int samples)
+{
+    encode_opus_state *o = s->opus;
+    int i, c, n;
+
+    for(i = 0; i < samples; i += n)
+    {
+        float *out = o->frame + o->fill * o->channels;
+
+        n = o->frame_size - o->fill;
+        if(n > samples - i)
+            n = samples - i;
+
+        if(pcm)
+        {
+            if(o->channels == 1)
+                memcpy(out, pcm[0] + i, n * sizeof(float));
+            else
+                for(c = 0; c < n; c++)
+                {
+                    out[2*c] = pcm[0][i + c];
+                    out[2*c + 1] = pcm[1][i + c];
+                }
+        }
+        else
+            memset(out, 0, n * o->channels * sizeof(float));
+
+        o->fill += n;
+        if(o->fill == o->frame_size)
+            encode_opus_packet(s, 0);
+    }
+}
+
+void encode_opus_data_float(encoder_state *s, float **pcm, int samples)
+{
+    s->opus->samples += samples;
+    encode_opus_add(s, pcm, samples);
+}
+
+/* The conversion buffers, with room for samples; NULL if out of memory */
+float **encode_opus_buffer(encoder_state *s, int samples)
+{
+    encode_opus_state *o = s->opus;
+    int c;
+
+    if(samples > o->convlen)
+    {
+        for(c = 0; c < o->channels; c++)
+        {
+            float *conv = realloc(o->conv[c], samples * sizeof(float));
+
+            if(!conv)
+                return NULL;
+            o->conv[c] = conv;
+        }
+        o->convlen = samples;
+    }
+
+    return o->conv;
+}
+
+/* samples have been written to the conversion buffers */
+void encode_opus_wrote(encoder_state *s, int samples)
+{
+    encode_opus_data_float(s, s->opus->conv, samples);
+}
+
+void encode_opus_data(encoder_state *s, signed char *buf, int samples,
+        input_subtype format)
+{
+    float **conv = encode_opus_buffer(s, samples);
+
+    if(!conv)
+        return;
+    pcm_to_float(conv, buf, samples, s->opus->channels, format);
+    encode_opus_data_float(s, conv, samples);
+}
+
+/* Push the audio still inside the encoder out with silence, and end the
+ * stream with what's left in a padded final packet. */
+void encode_opus_finish(encoder_state *s)
+{
+    encode_opus_state *o = s->opus;
+
+    encode_opus_add(s, NULL, o->lookahead);
+    memset(o->frame + o->fill * o->channels, 0,
+            (o->frame_size - o->fill) * o->channels * sizeof(float));
+    encode_opus_packet(s, 1);
+}
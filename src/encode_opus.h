@@ -0,0 +1,32 @@
+/* encode_opus.h
+ * - Opus encoding behind the encoder_state API.
+ *
+ * Copyright (c) 2026 The IceS Development Team <team@icecast.org>
+ *
+ * This program is distributed under the terms of the GNU General
+ * Public License, version 2. You may use, modify, and redistribute
+ * it under the terms of this license. A copy should be included
+ * with this source.
+ */
+
+#ifndef __ENCODE_OPUS_H
+#define __ENCODE_OPUS_H
+
+#include <vorbis/codec.h>
+
+#include "encode.h"
+
+int encode_opus_initialise(encoder_state *s, int channels, int rate,
+        int managed, int min_br, int nom_br, int max_br, vorbis_comment *vc);
+int encode_opus_restart(encoder_state *s, vorbis_comment *vc);
+void encode_opus_clear(encoder_state *s);
+int encode_opus_headerout(encoder_state *s, ogg_page *og);
+int encode_opus_channels(encoder_state *s);
+void encode_opus_data_float(encoder_state *s, float **pcm, int samples);
+void encode_opus_data(encoder_state *s, signed char *buf, int samples,
+        input_subtype format);
+float **encode_opus_buffer(encoder_state *s, int samples);
+void encode_opus_wrote(encoder_state *s, int samples);
+void encode_opus_finish(encoder_state *s);
+
+#endif /* __ENCODE_OPUS_H */
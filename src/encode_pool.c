@@ -0,0 +1,223 @@
+/* encode_pool.c
+ * - worker threads shared by all the encoders.
+ *
+ * Encoding used to happen either in the instance thread, between blocking
+ * sends to the server, or on a thread per shared encoder. Now every
+ * encoder is a job run by a fixed set of workers, one per core: the input
+ * thread queues PCM (or pages to reencode) for a job and schedules it, a
+ * worker encodes a batch of it and queues the pages to the instances, and
+ * the instance threads do nothing but send. A slow server no longer holds
+ * up encoding, and a burst of encoding no longer delays sends.
+ *
+ * Copyright (c) 2026 The IceS Development Team <team@icecast.org>
+ *
+ * This program is distributed under the terms of the GNU General
+ * Public License, version 2. You may use, modify, and redistribute
+ * it under the terms of this license. A copy should be included
+ * with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+ #include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <common/thread/thread.h>
+
+#include "cfgparse.h"
+#include "stream.h"
+#include "input.h"
+#include "queue.h"
+#include "encode_pool.h"
+
+#define MODULE "encode-pool/"
+#include "logging.h"
+
+/* how often to log how busy the workers are, in ns */
+#define ENCODE_POOL_REPORT 3600000000000ULL
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int stop;
+
+    encode_pool_job *ready;     /* waiting for a worker, oldest first */
+    encode_pool_job **ready_tail;
+
+    thread_type **threads;
+    int count;
+
+    /* since the last report */
+    uint64_t report_time;
+    uint64_t busy;
+    unsigned long runs;
+} pool;
+
+static int encode_pool_cores(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if(cores > 0)
+        return (int)cores;
+#endif
+    return 1;
+}
+
+/* with pool.lock held */
+static void encode_pool_report(uint64_t now)
+{
+    uint64_t elapsed = now - pool.report_time;
+
+    if(elapsed && pool.runs)
+        LOG_INFO3("Encoder pool: %d threads, %lu%% busy, %lu batches encoded",
+                pool.count,
+                (unsigned long)(pool.busy * 100 / (elapsed * pool.count)),
+                pool.runs);
+
+    pool.report_time = now;
+    pool.busy = 0;
+    pool.runs = 0;
+}
+
+static void *encode_pool_worker(void *arg)
+{
+    encode_pool_job *job;
+    uint64_t start, end;
+
+    (void)arg;
+
+    pthread_mutex_lock(&pool.lock);
+    while(1)
+    {
+        while(!pool.ready && !pool.stop)
+            pthread_cond_wait(&pool.cond, &pool.lock);
+        if(pool.stop)
+            break;
+
+        job = pool.ready;
+        pool.ready = job->next;
+        if(!pool.ready)
+            pool.ready_tail = &pool.ready;
+        pthread_mutex_unlock(&pool.lock);
+
+        start = input_clock();
+        job->run(job->arg);
+        end = input_clock();
+        job->busy += end - start;
+
+        pthread_mutex_lock(&pool.lock);
+        pool.busy += end - start;
+        pool.runs++;
+
+        /* Anything queued after run() looked is seen here, as the input
+         * thread only schedules after queueing, under the lock. Go to the
+         * back so one busy job can't starve the others. */
+        if(queue_length(job->queue))
+        {
+            job->next = NULL;
+            *pool.ready_tail = job;
+            pool.ready_tail = &job->next;
+        }
+        else
+            job->scheduled = 0;
+
+        if(end - pool.report_time >= ENCODE_POOL_REPORT)
+            encode_pool_report(end);
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    return NULL;
+}
+
+/* Start a worker per core, but no more than there are jobs to run.
+ * Returns the number of workers started.
+ */
+int encode_pool_start(int jobs)
+{
+    int count = encode_pool_cores();
+    int i;
+
+    if(count > jobs)
+        count = jobs;
+    if(count <= 0)
+        return 0;
+
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+    pool.ready = NULL;
+    pool.ready_tail = &pool.ready;
+    pool.report_time = input_clock();
+
+    pool.threads = calloc(count, sizeof(thread_type *));
+    if(!pool.threads)
+        goto fail;
+
+    for(i = 0; i < count; i++)
+    {
+        /* not detached, encode_pool_shutdown() joins them */
+        pool.threads[i] = thread_create("encode-worker", encode_pool_worker,
+                NULL, 0);
+        if(!pool.threads[i])
+            break;
+        pool.count++;
+    }
+    /* fewer workers than asked for will do, none won't */
+    if(!pool.count)
+        goto fail;
+
+    LOG_INFO2("Started %d encoder threads for %d encoders", pool.count, jobs);
+
+    return pool.count;
+
+fail:
+    free(pool.threads);
+    pool.threads = NULL;
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.cond);
+    return 0;
+}
+
+/* Input thread: job has just had input queued. */
+void encode_pool_schedule(encode_pool_job *job)
+{
+    pthread_mutex_lock(&pool.lock);
+    if(!job->scheduled)
+    {
+        job->scheduled = 1;
+        job->next = NULL;
+        *pool.ready_tail = job;
+        pool.ready_tail = &job->next;
+        pthread_cond_signal(&pool.cond);
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/* Stop the workers, once they have finished whatever they are running. */
+void encode_pool_shutdown(void)
+{
+    int i;
+
+    if(!pool.threads)
+        return;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.stop = 1;
+    pthread_cond_broadcast(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
+
+    for(i = 0; i < pool.count; i++)
+        thread_join(pool.threads[i]);
+
+    encode_pool_report(input_clock());
+
+    free(pool.threads);
+    pool.threads = NULL;
+    pool.count = 0;
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.cond);
+}
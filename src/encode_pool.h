@@ -0,0 +1,36 @@
+/* encode_pool.h
+ * - worker threads shared by all the encoders.
+ *
+ * Copyright (c) 2026 The IceS Development Team <team@icecast.org>
+ *
+ * This program is distributed under the terms of the GNU General
+ * Public License, version 2. You may use, modify, and redistribute
+ * it under the terms of this license. A copy should be included
+ * with this source.
+ */
+
+#ifndef __ENCODE_POOL_H
+#define __ENCODE_POOL_H
+
+#include <stdint.h>
+
+#include "queue.h"
+
+/* Something with input waiting in queue for a worker to run. A job is only
+ * ever run by one worker at a time, so it needs no locking of its own. */
+typedef struct encode_pool_job {
+    void (*run)(void *arg);     /* take some input off queue and process it */
+    void *arg;
+    buffer_queue *queue;
+
+    /* owned by the pool */
+    int scheduled;
+    uint64_t busy;              /* ns spent running it */
+    struct encode_pool_job *next;
+} encode_pool_job;
+
+int encode_pool_start(int jobs);
+void encode_pool_schedule(encode_pool_job *job);
+void encode_pool_shutdown(void);
+
+#endif /* __ENCODE_POOL_H */
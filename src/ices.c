@@ -33,6 +33,9 @@
 #include "stream.h"
 #include "signals.h"
 #include "input.h"
+#include "bufpool.h"
+#include "pcmconv.h"
+#include "resample.h"
 
 #define MODULE "ices-core/"
 #include "logging.h"
@@ -94,6 +97,8 @@ int main(int argc, char **argv)
 
     log_initialize();
     thread_initialize();
+    bufpool_initialise();
+    resampler_cache_init();
     shout_init();
     encode_init();
 #ifndef _WIN32	
@@ -118,6 +123,8 @@ int main(int argc, char **argv)
     ices_config->log_id = log;
 
     LOG_INFO0(PACKAGE_STRING " started...");
+    /* after the log is open, so the kernels picked are logged */
+    pcmconv_initialise();
     if (ices_config->pidfile != NULL)
     {
         FILE *f = fopen (ices_config->pidfile, "w");
@@ -137,6 +144,10 @@ int main(int argc, char **argv)
     /* Start the core streaming loop */
     input_loop();
 
+    /* every instance is gone by now, so all buffers are back in the pool */
+    bufpool_shutdown();
+    resampler_cache_clear();
+
     if (ices_config->pidfile)
         remove (ices_config->pidfile);
 
@@ -34,6 +34,8 @@
 #include "stream.h"
 #include "metadata.h"
 #include "inputmodule.h"
+#include "bufpool.h"
+#include "pcmconv.h"
 
 #define ALSA_PCM_NEW_HW_PARAMS_API
 #include "im_alsa.h"
@@ -121,7 +123,7 @@ static int alsa_read(void *self, ref_buffer *rb)
     int result;
     im_alsa_state *s = self;
 
-    rb->buf = malloc(SAMPLES*2*s->channels);
+    rb->buf = bufpool_alloc(SAMPLES*s->frame_bytes);
     if(!rb->buf)
         return -1;
     result = snd_pcm_readi(s->fd, rb->buf, SAMPLES);
@@ -129,7 +131,7 @@ static int alsa_read(void *self, ref_buffer *rb)
     if (result >= 0)
     {
         rb->len = result*s->frame_bytes;
-        rb->aux_data = s->rate*s->channels*2;
+        rb->aux_data = s->rate*s->frame_bytes;
         if (s->newtrack)
         {
             rb->critical = 1;
@@ -138,7 +140,7 @@ static int alsa_read(void *self, ref_buffer *rb)
         return rb->len;
     }
 
-    free (rb->buf);
+    bufpool_free(rb->buf);
     if (result == -EINTR)
         return 0;
     if (result == -EPIPE)
@@ -156,7 +158,7 @@ input_module_t *alsa_open_module(module_param_t *params)
     im_alsa_state *s;
     module_param_t *current;
     char *device = "plughw:0,0"; /* default device */
-    snd_pcm_format_t format = SND_PCM_FORMAT_S16_LE;
+    snd_pcm_format_t format;
     int use_metadata = 1; /* Default to on */
     unsigned int exact_rate;
     int dir;
@@ -201,12 +203,37 @@ input_module_t *alsa_open_module(module_param_t *params)
             s->buffer_time = atoi (current->value) * 1000;
         else if(!strcmp(current->name, "periods"))
             s->periods = atoi (current->value);
+        else if(!strcmp(current->name, "format"))
+        {
+            if(pcm_parse_format(current->value, &mod->subtype) < 0)
+                LOG_WARN1("Unknown sample format %s, using s16",
+                        current->value);
+        }
         else
             LOG_WARN1("Unknown parameter %s for alsa module", current->name);
 
         current = current->next;
     }
 
+    switch(mod->subtype)
+    {
+        case INPUT_PCM_BE_16:
+            format = SND_PCM_FORMAT_S16_BE;
+            break;
+        case INPUT_PCM_LE_24:
+            format = SND_PCM_FORMAT_S24_3LE;
+            break;
+        case INPUT_PCM_LE_32:
+            format = SND_PCM_FORMAT_S32_LE;
+            break;
+        case INPUT_PCM_LE_FLOAT:
+            format = SND_PCM_FORMAT_FLOAT_LE;
+            break;
+        default:
+            format = SND_PCM_FORMAT_S16_LE;
+            break;
+    }
+
     snd_pcm_hw_params_alloca(&hwparams);
 
     if ((err = snd_pcm_open(&s->fd, device, stream, 0)) < 0)
@@ -270,10 +297,11 @@ input_module_t *alsa_open_module(module_param_t *params)
 
     /* We're done, and we didn't fail! */
     LOG_INFO1 ("Opened audio device %s", device);
-    LOG_INFO3 ("using %d channel(s), %d Hz, buffer %u ms ",
-            s->channels, s->rate, s->buffer_time/1000);
+    LOG_INFO4 ("using %d channel(s), %d Hz, %s samples, buffer %u ms ",
+            s->channels, s->rate, pcm_format_name(mod->subtype),
+            s->buffer_time/1000);
 
-    s->frame_bytes = s->channels * (snd_pcm_format_width(format) / 8);
+    s->frame_bytes = s->channels * pcm_sample_size(mod->subtype);
     if(use_metadata)
     {
         LOG_INFO0("Starting metadata update thread");
@@ -32,6 +32,7 @@
 #include "stream.h"
 #include "metadata.h"
 #include "inputmodule.h"
+#include "bufpool.h"
 
 #include "im_oss.h"
 
@@ -125,7 +126,7 @@ static int oss_read(void *self, ref_buffer *rb)
     int result;
     im_oss_state *s = self;
 
-    rb->buf = malloc(BUFSIZE*2*s->channels);
+    rb->buf = bufpool_alloc(BUFSIZE*2*s->channels);
     if(!rb->buf)
         return -1;
     result = read(s->fd, rb->buf, BUFSIZE*2*s->channels);
@@ -149,7 +150,7 @@ static int oss_read(void *self, ref_buffer *rb)
             LOG_INFO0("Reached EOF, no more data available");
         else
             LOG_ERROR1("Error reading from audio device: %s", strerror(errno));
-        free(rb->buf);
+        bufpool_free(rb->buf);
         return -1;
     }
 
@@ -28,6 +28,7 @@
 #include "event.h"
 
 #include "inputmodule.h"
+#include "bufpool.h"
 #include "input.h"
 #include "im_playlist.h"
 
@@ -61,6 +62,7 @@ static void close_module(input_module_t *mod)
         playlist_state_t *pl = (playlist_state_t *)mod->internal;
         pl->clear(pl->data);
         ogg_sync_clear(&pl->oy);
+        input_ogg_timing_clear(&pl->timing);
         free(pl);
     }
     free(mod);
@@ -179,19 +181,20 @@ static int playlist_read(void *self, ref_buffer *rb)
 
                pl->current_serial = ogg_page_serialno (&og);
             }
-            if (input_calculate_ogg_sleep (&og) < 0)
+            if ((result = input_calculate_ogg_sleep (&pl->timing, &og)) < 0)
             {
                 LOG_WARN1 ("Failed to calculate ogg sleep, skipping file \"%s\"", pl->filename);
                 pl->nexttrack = 1;
                 return 0;
             }
             rb->len = og.header_len + og.body_len;
-            rb->buf = malloc(rb->len);
+            rb->buf = bufpool_alloc(rb->len);
             rb->aux_data = og.header_len;
 
             memcpy(rb->buf, og.header, og.header_len);
             memcpy(rb->buf+og.header_len, og.body, og.body_len);
-            if(ogg_page_granulepos(&og)==0)
+            /* only the start of a link, where the headers are */
+            if(result > 0)
                 rb->critical = 1;
             break;
         }
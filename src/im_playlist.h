@@ -15,6 +15,7 @@
 #define __IM_PLAYLIST_H__
 
 #include "inputmodule.h"
+#include "input.h"
 #include <ogg/ogg.h>
 
 typedef struct _playlist_state_tag
@@ -26,6 +27,7 @@ typedef struct _playlist_state_tag
     int nexttrack;
     int allow_repeat;
     ogg_sync_state oy;
+    ogg_timing timing;
 
     char *(*get_filename)(void *data); /* returns the next desired filename */
     void (*free_filename)(void *data, char *fn); /* Called when im_playlist is
@@ -28,6 +28,7 @@
 #include "stream.h"
 #include "metadata.h"
 #include "inputmodule.h"
+#include "bufpool.h"
 
 #include "im_roar.h"
 
@@ -133,7 +134,7 @@ static int roar_read(void *self, ref_buffer *rb)
 
     roar_plugincontainer_appsched_trigger(s->plugins, ROAR_DL_APPSCHED_UPDATE);
 
-    rb->buf = malloc(BUFSIZE * roar_info2framesize(&s->info)/8);
+    rb->buf = bufpool_alloc(BUFSIZE * roar_info2framesize(&s->info)/8);
     if(!rb->buf)
         return -1;
 
@@ -158,7 +159,7 @@ static int roar_read(void *self, ref_buffer *rb)
             LOG_INFO0("Reached EOF, no more data available");
         else
             LOG_ERROR1("Error reading from sound server: %s", roar_vs_strerr(err));
-        free(rb->buf);
+        bufpool_free(rb->buf);
         rb->buf = NULL;
         return -1;
     }
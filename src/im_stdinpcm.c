@@ -28,7 +28,9 @@
 
 #include "metadata.h"
 #include "inputmodule.h"
+#include "bufpool.h"
 #include "input.h"
+#include "pcmconv.h"
 #include "im_stdinpcm.h"
 
 #define MODULE "input-stdinpcm/"
@@ -114,14 +116,15 @@ static int stdin_read(void *self, ref_buffer *rb)
     int result;
     stdinpcm_state *s = self;
 
-    rb->buf = malloc(BUFSIZE);
+    rb->buf = bufpool_alloc(BUFSIZE);
     if(!rb->buf)
         return -1;
 
-    result = fread(rb->buf, 1,BUFSIZE, stdin);
+    /* whole frames only, so no sample is split between buffers */
+    result = fread(rb->buf, 1, BUFSIZE - BUFSIZE % s->frame_bytes, stdin);
 
-    rb->len = result;
-    rb->aux_data = s->rate*s->channels*2;
+    rb->len = result - result % s->frame_bytes;
+    rb->aux_data = s->rate*s->frame_bytes;
     if(s->newtrack)
     {
         rb->critical = 1;
@@ -131,7 +134,7 @@ static int stdin_read(void *self, ref_buffer *rb)
     if(rb->len <= 0)
     {
         LOG_INFO0("Reached EOF, no more data available\n");
-        free(rb->buf);
+        bufpool_free(rb->buf);
         return -1;
     }
     input_calculate_pcm_sleep (rb->len, rb->aux_data);
@@ -173,11 +176,18 @@ input_module_t *stdin_open_module(module_param_t *params)
             use_metadata = atoi(current->value);
         else if(!strcmp(current->name, "metadatafilename"))
             ices_config->metadata_filename = current->value;
+        else if(!strcmp(current->name, "format"))
+        {
+            if(pcm_parse_format(current->value, &mod->subtype) < 0)
+                LOG_WARN1("Unknown sample format %s, using s16",
+                        current->value);
+        }
         else
             LOG_WARN1("Unknown parameter %s for stdinpcm module", current->name);
 
         current = current->next;
     }
+    s->frame_bytes = s->channels * pcm_sample_size(mod->subtype);
     if(use_metadata)
     {
         if (ices_config->metadata_filename)
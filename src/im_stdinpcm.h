@@ -21,6 +21,7 @@ typedef struct
 {
     int rate;
     int channels;
+    int frame_bytes;
     char **metadata;
     int newtrack;
     mutex_t metadatalock;
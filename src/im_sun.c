@@ -34,6 +34,7 @@
 #include "cfgparse.h"
 #include "stream.h"
 #include "inputmodule.h"
+#include "bufpool.h"
 #include "metadata.h"
 
 #include "im_sun.h"
@@ -122,7 +123,7 @@ static int sun_read(void *self, ref_buffer *rb)
     im_sun_state *s = self;
     unsigned char *i, j;
 
-    rb->buf = malloc(BUFSIZE*2*s->device_info.record.channels);
+    rb->buf = bufpool_alloc(BUFSIZE*2*s->device_info.record.channels);
     if(!rb->buf)
         return -1;
     result = read(s->fd, rb->buf, BUFSIZE*2*s->device_info.record.channels);
@@ -146,7 +147,7 @@ static int sun_read(void *self, ref_buffer *rb)
             LOG_INFO0("Reached EOF, no more data available");
         else
             LOG_ERROR1("Error reading from audio device: %s", strerror(errno));
-        free(rb->buf);
+        bufpool_free(rb->buf);
         return -1;
     }
 
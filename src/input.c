@@ -27,12 +27,19 @@
 #include <ogg/ogg.h>
 #include <vorbis/codec.h>
 #include <string.h>
+#include <time.h>
+#include <errno.h>
 
 #include <common/timing/timing.h>
 #include <common/thread/thread.h>
 #include "cfgparse.h"
 #include "stream.h"
 #include "input.h"
+#include "stream_shared.h"
+#include "bufpool.h"
+#include "encode_group.h"
+#include "decode.h"
+#include "supervisor.h"
 #include "event.h"
 #include "signals.h"
 #include "inputmodule.h"
@@ -65,16 +72,42 @@ typedef unsigned __int64 uint64_t
 
 #define MAX_BUFFER_FAILURES 15
 
+/* starttime and deadline are in ns on the monotonic clock. What has been
+ * sent is counted exactly, as sent units (samples, or bytes for PCM) at
+ * rate units a second since anchor ns after starttime, and only turned
+ * into ns for each deadline, so no rounding adds up over a long stream.
+ * The anchor moves on when the rate changes between tracks.
+ */
 typedef struct _timing_control_tag 
 {
     uint64_t starttime;
-    uint64_t senttime;
-    uint64_t samples;
-    uint64_t oldsamples;
-    unsigned samplerate;
-    long serialno;
+    uint64_t anchor;
+    uint64_t sent;
+    uint64_t rate;
+    uint64_t deadline;
 } timing_control;
 
+/* The reader thread keeps up to depth chunks, each stamped with the time
+ * it is due to be sent, in lookahead. The input loop takes them off and
+ * holds each one back until it is due, so a slow read (opening the next
+ * file over NFS, say) is soaked up by the lookahead instead of delaying
+ * everything after it. With a depth of 0 the input loop reads for itself.
+ */
+typedef struct _input_reader_tag
+{
+    input_module_t *inmod;
+    decode_state *decoder;
+    buffer_queue *lookahead;
+    int depth;
+    atomic_int finished;
+    thread_type *thread;
+    unsigned long underruns;
+    int skip_to_critical;   /* drop what was read before a forced track
+                             * change, see input_loop() */
+    atomic_int next_track;  /* forced track change for the reader thread
+                             * to pass on to the input module */
+} input_reader;
+
 typedef struct _module 
 {
     char *name;
@@ -99,34 +132,164 @@ static module modules[] = {
     {NULL,NULL}
 };
 
-static timing_control control;
+/* How far behind schedule each chunk went out, measured by the input loop
+ * once it wakes up for it. Times in ns. offset is how far the schedule as a
+ * whole has been moved back after falling hopelessly behind, rather than
+ * bursting to catch up.
+ */
+typedef struct _pacing_stats_tag
+{
+    uint64_t offset;
 
+    /* since the last report */
+    uint64_t report_time;
+    unsigned long pages;
+    unsigned long late_pages;
+    uint64_t total_lateness;
+    uint64_t max_lateness;
+} pacing_stats;
 
-/* This is identical to shout_sync(), really. */
-void input_sleep(void)
+static timing_control control;
+static input_reader reader;
+static pacing_stats pacing;
+
+/* anything later than this counts as a late page */
+#define PACING_LATE_NS 20000000ULL
+/* this far behind, give up on catching up and move the schedule instead */
+#define PACING_RESYNC_NS 2000000000ULL
+/* how often to log the pacing figures */
+#define PACING_REPORT_NS 3600000000000ULL
+
+/* How long units take to send at rate units a second, in ns, split so
+ * that neither overflows nor loses its remainder */
+static uint64_t input_units_to_ns(uint64_t units, uint64_t rate)
+{
+    return units / rate * 1000000000 + units % rate * 1000000000 / rate;
+}
+
+/* Count units more as sent, at rate units a second */
+static void input_advance(uint64_t units, uint64_t rate)
 {
-    int64_t sleep;
+    if (rate == 0)
+        return;
+    if (rate != control.rate)
+    {
+        if (control.rate)
+            control.anchor += input_units_to_ns(control.sent, control.rate);
+        control.sent = 0;
+        control.rate = rate;
+    }
+    control.sent += units;
+}
 
+/* Called by the input modules once they know when the chunk they are
+ * reading should go out. Rather than sleeping here, which would hold up
+ * the reading, the time is recorded and the input loop waits for it in
+ * input_wait_until(). Returns the deadline, 0 before anything was sent.
+ */
+uint64_t input_sleep(void)
+{
     /* no need to sleep if we haven't sent data */
-    if (control.senttime == 0) return;
+    if (control.sent == 0 && control.anchor == 0) return 0;
+
+    control.deadline = control.starttime + control.anchor +
+        input_units_to_ns(control.sent, control.rate);
+    return control.deadline;
+}
+
+/* ns on a clock that isn't affected by setting the time of day */
+uint64_t input_clock(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#else
+    return timing_get_time() * 1000000;
+#endif
+}
+
+static void input_report_pacing(void)
+{
+    if(pacing.pages)
+        LOG_INFO5("Pacing: %lu buffers, %lu late, lateness mean %lu us, "
+                "max %lu us, schedule moved back %lu ms in total",
+                pacing.pages, pacing.late_pages,
+                (unsigned long)(pacing.total_lateness / pacing.pages / 1000),
+                (unsigned long)(pacing.max_lateness / 1000),
+                (unsigned long)(pacing.offset / 1000000));
+
+    pacing.pages = 0;
+    pacing.late_pages = 0;
+    pacing.total_lateness = 0;
+    pacing.max_lateness = 0;
+}
 
-    sleep = ((double)control.senttime / 1000) - 
-        (timing_get_time() - control.starttime);
+static void input_account_lateness(uint64_t now, uint64_t lateness)
+{
+    pacing.pages++;
+    pacing.total_lateness += lateness;
+    if(lateness > pacing.max_lateness)
+        pacing.max_lateness = lateness;
+    if(lateness > PACING_LATE_NS)
+        pacing.late_pages++;
+
+    if(lateness > PACING_RESYNC_NS)
+    {
+        LOG_WARN1("Fell %lu ms behind schedule, resynchronising",
+                (unsigned long)(lateness / 1000000));
+        pacing.offset += lateness;
+    }
 
-    /* trap for long sleeps, typically indicating a clock change.  it's not */
-    /* perfect though, as low bitrate/low samplerate vorbis can trigger this */
-    if(sleep > 8000) {
-        LOG_WARN1("Extended sleep requested (%ld ms), sleeping for 5 seconds",
-                sleep);
-        timing_sleep(5000);
+    if(pacing.report_time == 0)
+        pacing.report_time = now;
+    else if(now - pacing.report_time >= PACING_REPORT_NS)
+    {
+        input_report_pacing();
+        pacing.report_time = now;
     }
-    else if(sleep > 0) 
-        timing_sleep((uint64_t)sleep);
+}
+
+/* Sleep until an absolute time on input_clock(). Sleeping to an absolute
+ * deadline, rather than for an interval, means time spent elsewhere in a
+ * loop doesn't add up into drift.
+ */
+void input_sleep_until(uint64_t deadline)
+{
+#if defined(HAVE_CLOCK_NANOSLEEP) && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    ts.tv_sec = deadline / 1000000000;
+    ts.tv_nsec = deadline % 1000000000;
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+#else
+    uint64_t now = input_clock();
+
+    if(deadline > now)
+        timing_sleep((deadline - now + 999999) / 1000000);
+#endif
+}
+
+/* Hold the input loop back until a chunk is due, then note how late we
+ * actually were.
+ */
+static void input_wait_until(uint64_t deadline)
+{
+    uint64_t now;
+
+    if (deadline == 0) return;
+
+    input_sleep_until(deadline);
+
+    now = input_clock();
+    input_account_lateness(now, now > deadline ? now - deadline : 0);
 }
 
 int input_calculate_pcm_sleep(unsigned bytes, unsigned bytes_per_sec)
 {
-    control.senttime += ((uint64_t)bytes * 1000000)/bytes_per_sec;
+    input_advance(bytes, bytes_per_sec);
 
     return 0;
 }
@@ -156,230 +319,400 @@ static uint32_t __read_int20_be(const unsigned char in[3])
     return ret;
 }
 
-int input_calculate_ogg_sleep(ogg_page *page)
+static void ogg_timing_release(ogg_timing *t)
+{
+    if (t->state_in_use)
+    {
+        vorbis_comment_clear (&t->vc);
+        vorbis_info_clear (&t->vi);
+        ogg_stream_clear (&t->os);
+        t->state_in_use = 0;
+    }
+}
+
+void input_ogg_timing_clear(ogg_timing *t)
+{
+    ogg_timing_release (t);
+    t->have_audio = 0;
+    t->in_bos = 0;
+}
+
+/* Work out the sample rate from the first header packet of a logical
+ * stream. Returns 0 if it isn't audio we know how to time.
+ */
+static int ogg_timing_identify(ogg_timing *t, ogg_packet *op)
+{
+    /* check for Vorbis. For Vorbis the Magic is {0x01|0x03|0x05}"vorbis" */
+    if (op->bytes > 7 && memcmp(op->packet+1, "vorbis", 6) == 0)
+    {
+        if (vorbis_synthesis_headerin (&t->vi, &t->vc, op) < 0)
+        {
+            LOG_WARN0("Timing control: corrupt Vorbis header, ignoring stream.");
+            return 0;
+        }
+        t->samplerate = t->vi.rate;
+        t->codec = ICES_INPUT_VORBIS;
+        t->need_headers = 2;
+        return 1;
+    }
+    /* check for Opus. For Opus the magic is "OpusHead" */
+    if (op->bytes == 19 && memcmp(op->packet, "OpusHead", 8) == 0)
+    {
+        if (op->packet[8] != 1)
+        {
+            LOG_WARN0("Timing control: unsupported Opus version, ignoring stream.");
+            return 0;
+        }
+        /* Sample rate is fixed for Opus: 48kHz */
+        t->samplerate = 48000;
+        t->codec = ICES_INPUT_OGG;
+        t->need_headers = 0;
+        return 1;
+    }
+    if (op->bytes >= 80 && memcmp(op->packet, "Speex   ", 8) == 0)
+    {
+        if (__read_int32_le(op->packet+28) != 1 || __read_int32_le(op->packet+32) != op->bytes)
+        {
+            LOG_WARN0("Timing control: bad or unsupported Speex header, ignoring stream.");
+            return 0;
+        }
+        t->samplerate = __read_int32_le(op->packet+36);
+        t->codec = ICES_INPUT_OGG;
+        t->need_headers = 0;
+        return 1;
+    }
+    if (op->bytes >= 51 && memcmp(op->packet, "\177FLAC\1\0", 7) == 0 && memcmp(op->packet+9, "fLaC\0", 5) == 0)
+    {
+        t->samplerate = __read_int20_be(op->packet+27);
+        t->codec = ICES_INPUT_OGG;
+        t->need_headers = 0;
+        return 1;
+    }
+
+    return 0;
+}
+
+/* A bos page while no audio stream has been picked for this link: take it
+ * if it is audio, otherwise leave it to pass through untimed.
+ */
+static void ogg_timing_select(ogg_timing *t, ogg_page *page)
 {
-    static ogg_stream_state os;
     ogg_packet op;
-    static vorbis_info vi;
-    static vorbis_comment vc;
-    static input_type codec = ICES_INPUT_UNKNOWN;
-    static int need_start_pos, need_headers, state_in_use = 0;
-    static int serialno = 0;
-    static uint64_t offset;
-    static uint64_t first_granulepos;
-
-    if (ogg_page_granulepos(page) == -1)
+
+    ogg_stream_init (&t->os, ogg_page_serialno (page));
+    vorbis_info_init (&t->vi);
+    vorbis_comment_init (&t->vc);
+    t->state_in_use = 1;
+
+    ogg_stream_pagein (&t->os, page);
+    if (ogg_stream_packetout (&t->os, &op) != 1 || !ogg_timing_identify (t, &op))
     {
-        LOG_ERROR0("Timing control: corrupt timing information in vorbis file, cannot stream.");
-        return -1;
+        ogg_timing_release (t);
+        return;
     }
+
+    t->have_audio = 1;
+    t->serial = ogg_page_serialno (page);
+    t->need_start_pos = 1;
+    t->offset = 0;
+    t->first_granulepos = 0;
+    t->oldsamples = 0;
+}
+
+/* Advance the input clock by the length of the audio on an Ogg page. The
+ * first audio stream of each link in the chain drives the clock; pages of
+ * any other logical stream multiplexed with it go out along with the audio
+ * pages around them. Returns 1 for the page starting a new link, 0 for any
+ * other page, and -1 if the link can't be timed.
+ */
+int input_calculate_ogg_sleep(ogg_timing *t, ogg_page *page)
+{
+    ogg_packet op;
+    int ret = 0;
+    uint64_t samples;
+
     if (ogg_page_bos (page))
     {
-        control.oldsamples = 0;
-
-        if (state_in_use)
-            ogg_stream_clear (&os);
-        ogg_stream_init (&os, ogg_page_serialno (page));
-        serialno = ogg_page_serialno (page);
-        state_in_use = 1;
-        vorbis_info_init (&vi);
-        vorbis_comment_init (&vc);
-        need_start_pos = 1;
-        need_headers = 3;
-        codec = ICES_INPUT_UNKNOWN;
-        offset = (uint64_t)0;
+        if (!t->in_bos)
+        {
+            /* the first of the bos pages of a new link */
+            input_ogg_timing_clear (t);
+            t->in_bos = 1;
+            ret = 1;
+        }
+        if (!t->have_audio)
+            ogg_timing_select (t, page);
+        return ret;
+    }
+    t->in_bos = 0;
+
+    if (!t->have_audio)
+    {
+        LOG_ERROR0("Timing control: no audio stream to time the input by, cannot stream.");
+        return -1;
     }
-    if (need_start_pos)
+    if (ogg_page_serialno (page) != t->serial)
+        return 0;
+
+    if (t->need_start_pos)
     {
         int found_first_granulepos = 0;
 
-        ogg_stream_pagein (&os, page);
-        while (ogg_stream_packetout (&os, &op) == 1)
+        ogg_stream_pagein (&t->os, page);
+        while (ogg_stream_packetout (&t->os, &op) == 1)
         {
-            if (need_headers)
+            if (t->need_headers)
             {
-                /* check for Vorbis. For Vorbis the Magic is {0x01|0x03|0x05}"vorbis" */
-                if (op.bytes > 7 && memcmp(op.packet+1, "vorbis", 6) == 0)
-                {
-                    if (vorbis_synthesis_headerin (&vi, &vc, &op) < 0)
-                    {
-                        LOG_ERROR0("Timing control: can't determine sample rate for input, not vorbis.");
-                        control.samplerate = 0;
-                        vorbis_info_clear (&vi);
-                        ogg_stream_clear (&os);
-                        return -1;
-                    }
-                    control.samplerate = vi.rate;
-                    codec = ICES_INPUT_VORBIS;
-                }
-                /* check for Opus. For Opus the magic is "OpusHead" */
-                else if (op.bytes == 19 && memcmp(op.packet, "OpusHead", 8) == 0)
-                {
-                    if (op.packet[8] != 1)
-                    {
-                        LOG_ERROR0("Timing control: can't determine sample rate for input, unsupported Opus version.");
-                        control.samplerate = 0;
-                        vorbis_info_clear (&vi);
-                        ogg_stream_clear (&os);
-                        return -1;
-                    }
-                    /* Sample rate is fixed for Opus: 48kHz */
-                    control.samplerate = 48000;
-                    codec = ICES_INPUT_OGG;
-                    /* No more headers after this one needed */
-                    need_headers = 1;
-                }
-                else if (op.bytes >= 80 && memcmp(op.packet, "Speex   ", 8) == 0)
-                {
-                    if (__read_int32_le(op.packet+28) != 1 || __read_int32_le(op.packet+32) != op.bytes)
-                    {
-                        LOG_ERROR0("Timing control: can't determine sample rate for input, bad or unsupported Speex header.");
-                        control.samplerate = 0;
-                        vorbis_info_clear (&vi);
-                        ogg_stream_clear (&os);
-                        return -1;
-                    }
-
-                    control.samplerate = __read_int32_le(op.packet+36);
-                    codec = ICES_INPUT_OGG;
-                    /* No more headers after this one needed */
-                    need_headers = 1;
-                }
-                else if (op.bytes >= 51 && memcmp(op.packet, "\177FLAC\1\0", 7) == 0 && memcmp(op.packet+9, "fLaC\0", 5) == 0)
-                {
-                    control.samplerate = __read_int20_be(op.packet+27);
-                    codec = ICES_INPUT_OGG;
-                    /* No more headers after this one needed */
-                    need_headers = 1;
-                }
-                else if (codec == ICES_INPUT_UNKNOWN)
+                if (t->codec == ICES_INPUT_VORBIS &&
+                        vorbis_synthesis_headerin (&t->vi, &t->vc, &op) < 0)
                 {
-                    LOG_ERROR0("Timing control: can't determine sample rate for input, unsupported input format.");
-                    control.samplerate = 0;
-                    vorbis_info_clear (&vi);
-                    ogg_stream_clear (&os);
+                    LOG_ERROR0("Timing control: corrupt Vorbis header, cannot stream.");
+                    input_ogg_timing_clear (t);
                     return -1;
                 }
-                need_headers--;
-
-                if (need_headers == 0)
-                {
-                    vorbis_comment_clear (&vc);
-                    first_granulepos = (uint64_t)0;
-                    return 0;
-                }
+                t->need_headers--;
                 continue;
             }
             /* headers have been read */
-            if (first_granulepos == 0 && op.granulepos > 0)
+            if (t->first_granulepos == 0 && op.granulepos > 0)
             {
-                first_granulepos = op.granulepos;
+                t->first_granulepos = op.granulepos;
                 found_first_granulepos = 1;
             }
-            if (codec == ICES_INPUT_VORBIS)
+            if (t->codec == ICES_INPUT_VORBIS)
             {
-                offset += vorbis_packet_blocksize (&vi, &op) / 4;
+                t->offset += vorbis_packet_blocksize (&t->vi, &op) / 4;
             }
         }
         if (!found_first_granulepos)
             return 0;
 
-        need_start_pos = 0;
-        control.oldsamples = first_granulepos - offset;
-        vorbis_info_clear (&vi);
-        ogg_stream_clear (&os);
-        state_in_use = 0;
+        t->need_start_pos = 0;
+        t->oldsamples = t->first_granulepos - t->offset;
+        ogg_timing_release (t);
     }
-    if (serialno != ogg_page_serialno (page))
-    {
-        LOG_ERROR0 ("Found page which does not belong to current logical stream");
-        return -1;
-    }
-    control.samples = ogg_page_granulepos (page) - control.oldsamples;
-    control.oldsamples = ogg_page_granulepos (page);
 
-    control.senttime += ((uint64_t)control.samples * 1000000 /
-            (uint64_t)control.samplerate);
+    /* no packet ends on this page, so no time passes */
+    if (ogg_page_granulepos (page) == -1)
+        return 0;
+
+    samples = ogg_page_granulepos (page) - t->oldsamples;
+    t->oldsamples = ogg_page_granulepos (page);
+
+    input_advance(samples, t->samplerate);
 
     return 0;
 }
 
 
 
-void input_flush_queue(buffer_queue *queue, int keep_critical)
+/* Hand a buffer to an instance, applying its overflow policy if it has
+ * fallen more than max_queue_length buffers behind. Returns 1 if the
+ * buffer was queued, 0 if it was dropped.
+ */
+int input_queue_buffer(instance_t *instance, ref_buffer *chunk)
 {
-    queue_item *item, *next, *prev=NULL;
+    buffer_queue *queue = instance->queue;
+
+    if(queue_length(queue) >= instance->max_queue_length)
+    {
+        if(!instance->queue_full)
+        {
+            LOG_WARN2("Queue for mount %s is full (%d buffers), server "
+                    "isn't keeping up", instance->mount,
+                    instance->max_queue_length);
+            atomic_fetch_add(&queue->overflows, 1);
+            instance->queue_full = 1;
+        }
+
+        switch(instance->overflow_policy)
+        {
+            case OVERFLOW_DROP_NEWEST:
+                queue_dropped(queue, chunk);
+                return 0;
+
+            case OVERFLOW_RESYNC:
+                thread_mutex_lock(&ices_config->flush_lock);
+                instance->skip = 1;
+                instance->resync = 1;
+                thread_mutex_unlock(&ices_config->flush_lock);
+                queue_dropped(queue, chunk);
+                return 0;
+
+            case OVERFLOW_DROP_OLDEST:
+            default:
+                /* the instance makes room on its next dequeue, until then
+                 * use whatever slack the ring has */
+                queue_request_trim(queue);
+                break;
+        }
+    }
+    else
+        instance->queue_full = 0;
+
+    /* the reference has to be in place before the consumer can see the
+     * buffer */
+    stream_acquire_buffer(chunk);
+    if(queue_push(queue, chunk) < 0)
+    {
+        stream_release_buffer(chunk);
+        queue_dropped(queue, chunk);
+        return 0;
+    }
+
+    return 1;
+}
 
+/* Consumer side: must only be called from the thread draining the queue,
+ * or once that thread has gone away.
+ */
+void input_flush_queue(buffer_queue *queue, int keep_critical)
+{
     LOG_DEBUG0("Input queue flush requested");
 
-    thread_mutex_lock(&queue->lock);
-    if(!queue->head)
+    queue_flush(queue, keep_critical);
+}
+
+/* Wake every instance, whether or not it has anything queued */
+static void input_wake_instances(void)
+{
+    instance_t *instance = ices_config->instances;
+
+    while(instance)
     {
-        thread_mutex_unlock(&queue->lock);
-        return;
+        queue_wake(instance->queue);
+        instance = instance->next;
     }
+}
+
+/* Get the next chunk from the input module, stamped with its deadline
+ * and, if anything reencodes, decoded. Returns 1 with *chunkp set, 0 if
+ * there was nothing this time, -1 if the input has finished.
+ */
+static int input_read_chunk(ref_buffer **chunkp)
+{
+    input_module_t *inmod = reader.inmod;
+    ref_buffer *chunk;
+    int ret;
+
+    /* If this is the first time through, set initial time. This should
+     * be done before the call to inmod->getdata() below, in order to
+     * properly keep time if this input module blocks.
+     */
+    if (control.starttime == 0)
+        control.starttime = input_clock();
 
-    item = queue->head;
-    while(item)
+    chunk = bufpool_get_ref();
+    if(!chunk)
     {
-        next = item->next;
+        LOG_ERROR0("Out of memory allocating input buffer");
+        return -1;
+    }
+    /* the input loop holds the initial reference until fan-out is done */
+    atomic_init(&chunk->count, 1);
 
-        if(!(keep_critical && item->buf->critical))
-        {
-            thread_mutex_lock(&ices_config->refcount_lock);
-            item->buf->count--;
-            if(!item->buf->count)
-            {
-                free(item->buf->buf);
-                free(item->buf);
-            }
-            thread_mutex_unlock(&ices_config->refcount_lock);
+    /* get a chunk of data from the input module */
+    control.deadline = 0;
+    ret = inmod->getdata(inmod->internal, chunk);
 
-            if(prev)
-                prev->next = next;
-            else
-                queue->head = next;
+    /* input module signalled non-fatal error. Skip this chunk */
+    if(ret==0)
+    {
+        bufpool_put_ref(chunk);
+        return 0;
+    }
 
-            free(item);
-            item = next;
+    /* Input module signalled fatal error, shut down - nothing we can do
+     * from here */
+    if(ret < 0)
+    {
+        bufpool_put_ref(chunk);
+        return -1;
+    }
 
-            queue->length--;
-        }
-        else
+    chunk->deadline = control.deadline;
+    chunk->captured = input_clock();
+    if(reader.decoder)
+        decode_page(reader.decoder, chunk);
+
+    *chunkp = chunk;
+    return 1;
+}
+
+static void *input_reader_thread(void *arg)
+{
+    ref_buffer *chunk;
+    int ret;
+
+    (void)arg;
+
+    while(!ices_config->shutdown)
+    {
+        /* only this thread calls into the module while it reads, so the
+         * input loop leaves a forced track change here for it */
+        if(atomic_exchange(&reader.next_track, 0))
+            reader.inmod->handle_event(reader.inmod, EVENT_NEXTTRACK, NULL);
+
+        if(queue_length(reader.lookahead) >= reader.depth)
         {
-            prev = item;
-            item = next;
+            queue_wait_space(reader.lookahead, reader.depth);
+            continue;
         }
+
+        ret = input_read_chunk(&chunk);
+        if(ret < 0)
+            break;
+        if(ret == 0)
+            continue;
+
+        /* can't fail, we're the only producer and there is room */
+        queue_push(reader.lookahead, chunk);
+        queue_signal(reader.lookahead);
     }
 
-    /* Now, fix up the tail pointer */
-    queue->tail = NULL;
-    item = queue->head;
+    atomic_store_explicit(&reader.finished, 1, memory_order_release);
+    queue_wake(reader.lookahead);
+
+    return NULL;
+}
 
-    while(item)
+/* Returns 1 with *chunkp set, 0 if nothing is ready yet, -1 once the
+ * input has finished and everything read has been handed out.
+ */
+static int input_next_chunk(ref_buffer **chunkp)
+{
+    if(!reader.thread)
+        return input_read_chunk(chunkp);
+
+    if((*chunkp = queue_pop(reader.lookahead)))
+    {
+        queue_signal_space(reader.lookahead);
+        return 1;
+    }
+
+    if(atomic_load_explicit(&reader.finished, memory_order_acquire))
     {
-        queue->tail = item;
-        item = item->next;
+        /* anything pushed before finished was set is visible now */
+        if((*chunkp = queue_pop(reader.lookahead)))
+            return 1;
+        return -1;
     }
 
-    thread_mutex_unlock(&queue->lock);
+    reader.underruns++;
+    queue_wait(reader.lookahead, 1);
+    return 0;
 }
 
 void input_loop(void)
 {
     input_module_t *inmod=NULL;
     instance_t *instance, *prev, *next;
-    queue_item *queued;
     int shutdown = 0;
     int current_module = 0;
-    int valid_stream = 1;
-    int inc_count;
     int not_waiting_for_critical;
     int foundmodule = 0;
 
-    thread_cond_create(&ices_config->queue_cond);
     thread_cond_create(&ices_config->event_pending_cond);
-    thread_mutex_create(&ices_config->refcount_lock);
     thread_mutex_create(&ices_config->flush_lock);
 
     memset (&control, 0, sizeof (control));
@@ -408,6 +741,30 @@ void input_loop(void)
 
     ices_config->inmod = inmod;
 
+    encode_groups_create(ices_config->instances, inmod);
+
+    /* reencoding instances share a single decode of the input */
+    if(inmod->type == ICES_INPUT_VORBIS)
+    {
+        for(instance = ices_config->instances; instance; 
+                instance = instance->next)
+            if(instance->encode)
+                break;
+        if(instance)
+            reader.decoder = decode_initialise();
+    }
+
+    reader.inmod = inmod;
+    reader.depth = ices_config->readahead;
+    atomic_init(&reader.finished, 0);
+    atomic_init(&reader.next_track, 0);
+    if(reader.depth > 0)
+    {
+        reader.lookahead = queue_create(reader.depth);
+        if(reader.lookahead)
+            reader.thread = thread_create("input-reader", 
+                    input_reader_thread, NULL, 0);
+    }
 
     /* ok, basic config stuff done. Now, we want to start all our listening
      * threads.
@@ -417,15 +774,9 @@ void input_loop(void)
 
     while(instance) 
     {
-        stream_description *arg = calloc(1, sizeof(stream_description));
-        arg->stream = instance;
-        arg->input = inmod;
-        /*
-        if(instance->savefilename != NULL)
-            thread_create("savefile", savefile_stream, arg, 1);
-         */
-        thread_create("stream", ices_instance_stream, arg, 1);
-
+        if(supervisor_start_instance(instance, inmod) < 0)
+            LOG_ERROR1("Failed to start instance for mount %s",
+                    instance->mount);
         instance = instance->next;
     }
     /* treat as if a signal has arrived straight away */
@@ -437,8 +788,7 @@ void input_loop(void)
      */
     while(!shutdown) 
     {
-        ref_buffer *chunk = calloc(1, sizeof(ref_buffer));
-        buffer_queue *current;
+        ref_buffer *chunk;
         int ret;
 
         instance = ices_config->instances;
@@ -446,11 +796,10 @@ void input_loop(void)
 
         while(instance)
         {
-            /* if an instance has died, get rid of it
-            ** this should be replaced with something that tries to 
-            ** restart the instance, probably.
-            */
-            if (instance->died) 
+            /* if an instance has died, the supervisor either restarts it
+             * or we get rid of it
+             */
+            if (instance->died && supervisor_instance_died(instance) < 0) 
             {
                 LOG_DEBUG0("An instance died, removing it");
                 next = instance->next;
@@ -460,12 +809,15 @@ void input_loop(void)
                 else
                     ices_config->instances = next;
 
+                encode_group_remove(instance);
+
                 /* Just in case, flush any existing buffers
                  * Locks shouldn't be needed, but lets be SURE */
                 thread_mutex_lock(&ices_config->flush_lock);
                 input_flush_queue(instance->queue, 0);
                 thread_mutex_unlock(&ices_config->flush_lock);
 
+                supervisor_report(instance);
                 config_free_instance(instance);
                 free(instance);
 
@@ -477,156 +829,157 @@ void input_loop(void)
             instance = instance->next;
         }
 
+        supervisor_poll(ices_config->instances, inmod);
+
         instance = ices_config->instances;
 
         if(!instance)
         {
             shutdown = 1;
-            free(chunk);
             continue;
         }
 
         if(ices_config->shutdown) /* We've been signalled to shut down, but */
         {                          /* the instances haven't done so yet... */
+            input_wake_instances();
             timing_sleep(250); /* sleep for quarter of a second */
-            free(chunk);
             continue;
         }
 
-        /* If this is the first time through, set initial time. This should
-         * be done before the call to inmod->getdata() below, in order to
-         * properly keep time if this input module blocks.
-         */
-        if (control.starttime == 0)
-            control.starttime = timing_get_time();
-
-        /* get a chunk of data from the input module */
-        ret = inmod->getdata(inmod->internal, chunk);
+        ret = input_next_chunk(&chunk);
 
-        /* input module signalled non-fatal error. Skip this chunk */
+        /* nothing ready yet */
         if(ret==0)
-        {
-            free(chunk);
             continue;
-        }
 
-        /* Input module signalled fatal error, shut down - nothing we can do
-         * from here */
+        /* The input has finished, or failed - nothing we can do from
+         * here */
         if(ret < 0)
         {
             ices_config->shutdown = 1;
-            thread_cond_broadcast(&ices_config->queue_cond);
-            free(chunk);
+            input_wake_instances();
             continue;
         }
 
-        if(chunk->critical)
-            valid_stream = 1;
+        if(reader.skip_to_critical)
+        {
+            if(!chunk->critical)
+            {
+                stream_release_buffer(chunk);
+                continue;
+            }
+            reader.skip_to_critical = 0;
+        }
 
-        if(ret < 0) {
-            /* Tell the input module to go to the next track, hopefully allowing
-             * resync. */
-            ices_config->inmod->handle_event(ices_config->inmod,
-                    EVENT_NEXTTRACK,NULL);
-            valid_stream = 0;
+        /* hold it back until it is due; the instances pace themselves
+         * against the same schedule, including any moves */
+        if(chunk->deadline)
+        {
+            chunk->deadline += pacing.offset;
+            /* read ahead of time, so it only counts from when it's due */
+            chunk->captured = chunk->deadline;
         }
+        input_wait_until(chunk->deadline);
 
-        inc_count = 0;
         not_waiting_for_critical = 0;
 
-        if(valid_stream) 
+        while(instance)
         {
-            while(instance)
+            if(atomic_load(&instance->wait_for_critical) && !chunk->critical)
             {
-                if(instance->wait_for_critical && !chunk->critical)
-                {
-                    instance = instance->next;
-                    continue;
-
-                }
-
-                not_waiting_for_critical = 1;
-
-                if(instance->skip)
-                {
-                    instance = instance->next;
-                    continue;
-                }
-
-                queued = malloc(sizeof(queue_item));
-
-                queued->buf = chunk;
-                current = instance->queue;
-
-                inc_count++;
-
-                thread_mutex_lock(&current->lock);
+                instance = instance->next;
+                continue;
 
-                if(current->head == NULL)
-                {
-                    current->head = current->tail = queued;
-                    current->head->next = current->tail->next = NULL;
-                }
-                else
-                {
-                    current->tail->next = queued;
-                    queued->next = NULL;
-                    current->tail = queued;
-                }
+            }
 
-                current->length++;
-                thread_mutex_unlock(&current->lock);
+            not_waiting_for_critical = 1;
 
+            /* fed with pages by its group's encoder instead */
+            if(instance->skip || instance->encode_group)
+            {
                 instance = instance->next;
+                continue;
             }
+
+            input_queue_buffer(instance, chunk);
+
+            instance = instance->next;
         }
 
+        encode_groups_queue_buffer(chunk);
+
         /* If everything is waiting for a critical buffer, force one
-         * early. (This will take effect on the next pass through)
+         * early. The input module starts the next track on its next read;
+         * anything of this one already read ahead, or being read, is
+         * dropped above, so the next buffer handed out is the new track's
+         * first.
          */
-        if(valid_stream && !not_waiting_for_critical) {
-            ices_config->inmod->handle_event(ices_config->inmod,
-                    EVENT_NEXTTRACK,NULL);
+        if(!not_waiting_for_critical) {
+            if(reader.thread)
+            {
+                atomic_store(&reader.next_track, 1);
+                queue_flush(reader.lookahead, 1);
+                queue_signal_space(reader.lookahead);
+                reader.skip_to_critical = 1;
+            }
+            else
+                ices_config->inmod->handle_event(ices_config->inmod,
+                        EVENT_NEXTTRACK,NULL);
             instance = ices_config->instances;
             while(instance) {
+                /* the group's encoder feeds these, and is the only one
+                 * that may push to their queues; its next new stream
+                 * starts with a critical page for them anyway */
+                if(instance->encode_group)
+                {
+                    instance = instance->next;
+                    continue;
+                }
                 thread_mutex_lock(&ices_config->flush_lock);
-                input_flush_queue(instance->queue, 0);
-                instance->wait_for_critical = 0;
+                queue_request_flush(instance->queue);
+                atomic_store(&instance->wait_for_critical, 0);
                 thread_mutex_unlock(&ices_config->flush_lock);
                 instance = instance->next;
             }
         }
 
-        /* Make sure we don't end up with a 0-refcount buffer that 
-         * will never hit any of the free points. (this happens
-         * if all threads are set to skip, for example).
+        /* Drop our own reference. If no instance took the buffer (all
+         * set to skip, for example) this is where it gets freed.
          */
-        thread_mutex_lock(&ices_config->refcount_lock);
-        chunk->count += inc_count;
-        if(!chunk->count)
-        {
-            free(chunk->buf);
-            free(chunk);
-        }
-        thread_mutex_unlock(&ices_config->refcount_lock);
-
-        if(valid_stream) {
-            /* wake up the instances */
-            thread_cond_broadcast(&ices_config->queue_cond);
+        stream_release_buffer(chunk);
 
+        /* wake up the instances that were given something, once the
+         * whole chunk has been handed out */
+        instance = ices_config->instances;
+        while(instance)
+        {
+            queue_signal(instance->queue);
+            instance = instance->next;
         }
     }
 
     LOG_INFO0 ("All instances removed, shutting down...");
 
     ices_config->shutdown = 1;
+
+    if(reader.thread)
+    {
+        /* it may be waiting for room in the lookahead */
+        queue_wake(reader.lookahead);
+        thread_join(reader.thread);
+        if(reader.underruns)
+            LOG_DEBUG1("Read-ahead ran dry %lu times", reader.underruns);
+    }
+    queue_free(reader.lookahead);
+    input_report_pacing();
+    encode_groups_shutdown();
+    decode_clear(reader.decoder);
+
     thread_cond_broadcast(&ices_config->event_pending_cond);
     timing_sleep(250); /* sleep for quarter of a second */
 
-    thread_cond_destroy(&ices_config->queue_cond);
     thread_cond_destroy(&ices_config->event_pending_cond);
     thread_mutex_destroy(&ices_config->flush_lock);
-    thread_mutex_destroy(&ices_config->refcount_lock);
 
     inmod->handle_event(inmod, EVENT_SHUTDOWN, NULL);
 
@@ -20,26 +20,58 @@
 #include "cfgparse.h"
 #include "inputmodule.h"
 #include "stream.h"
+#include "queue.h"
 #include "reencode.h"
 #include "encode.h"
 #include "audio.h"
+#include "preroll.h"
 
 typedef struct {
     instance_t *stream;
     input_module_t *input;
     reencode_state *reenc;
     encoder_state *enc;
+    int encoding;
     downmix_state *downmix;
     resample_state *resamp;
     shout_t *shout;
     vorbis_comment vc;
+    preroll_state *preroll;
+    instance_clock clock;
+    stream_sendbuf send;
 } stream_description;
 
 
+/* Timing state for an Ogg input, see input_calculate_ogg_sleep(). Ready
+ * to use when zeroed, give it back with input_ogg_timing_clear(). */
+typedef struct {
+    int in_bos;             /* within the bos pages starting a link */
+    int have_audio;         /* an audio stream has been found in this link */
+    int serial;
+    input_type codec;
+    int samplerate;
+    int need_headers;
+    int need_start_pos;
+
+    /* only used until the start position is known */
+    int state_in_use;
+    ogg_stream_state os;
+    vorbis_info vi;
+    vorbis_comment vc;
+    uint64_t offset;
+    uint64_t first_granulepos;
+
+    uint64_t oldsamples;
+} ogg_timing;
+
 void input_loop(void);
+int  input_queue_buffer(instance_t *instance, ref_buffer *chunk);
 void input_flush_queue(buffer_queue *queue, int keep_critical);
-void input_sleep(void);
-int  input_calculate_ogg_sleep(ogg_page *og);
+uint64_t input_sleep(void);
+uint64_t input_clock(void);
+void input_sleep_until(uint64_t deadline);
+int  input_calculate_ogg_sleep(ogg_timing *t, ogg_page *og);
+void input_ogg_timing_clear(ogg_timing *t);
 int  input_calculate_pcm_sleep(unsigned bytes, unsigned bytes_per_sec);
 
 
@@ -30,6 +30,9 @@ typedef enum _input_type {
 typedef enum _input_subtype {
     INPUT_PCM_LE_16,
     INPUT_PCM_BE_16,
+    INPUT_PCM_LE_24, /* packed in 3 bytes */
+    INPUT_PCM_LE_32,
+    INPUT_PCM_LE_FLOAT,
 } input_subtype;
 
 typedef struct _input_module_tag {
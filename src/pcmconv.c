@@ -0,0 +1,519 @@
+/* pcmconv.c
+ * - interleaved PCM to planar float conversion.
+ *
+ * Every PCM input is converted from interleaved samples to planar floats
+ * before it is encoded, resampled or downmixed. This does it in one place,
+ * with vector versions picked at startup on x86 processors that have them,
+ * and plain C everywhere else. 16 bit input is the common case and has
+ * SSE2 and AVX2 kernels; 24 bit packed, 32 bit and float input (little
+ * endian, as capture hardware delivers it) have SSE2 and SSSE3 ones.
+ * The vector kernels do mono and stereo; more channels are left to the C
+ * loop, which beat spreading vectors out to the planes (see
+ * tests/pcmconv_bench).
+ *
+ * Copyright (c) 2026 The IceS Development Team <team@icecast.org>
+ *
+ * This program is distributed under the terms of the GNU General
+ * Public License, version 2. You may use, modify, and redistribute
+ * it under the terms of this license. A copy should be included
+ * with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+ #include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+ #define PCMCONV_X86
+ #include <immintrin.h>
+#endif
+
+#include "cfgparse.h"
+#include "pcmconv.h"
+
+#define MODULE "pcmconv/"
+#include "logging.h"
+
+#define S16_SCALE (1.f/32768.f)
+#define S32_SCALE (1.f/2147483648.f)
+
+typedef void (*s16_to_float_fn)(float **out, const signed char *in,
+        int samples, int channels, int bigendian);
+typedef void (*s16_downmix_fn)(float *out, const signed char *in,
+        int samples, int bigendian);
+typedef void (*wide_to_float_fn)(float **out, const signed char *in,
+        int samples, int channels, input_subtype format);
+
+#define READ_S16_BE(p) (((p)[0] << 8) | ((p)[1] & 0xff))
+#define READ_S16_LE(p) (((p)[1] << 8) | ((p)[0] & 0xff))
+
+static inline int read_s16(const signed char *in, int bigendian)
+{
+    return bigendian ? READ_S16_BE(in) : READ_S16_LE(in);
+}
+
+static void s16_to_float_c(float **out, const signed char *in, int samples,
+        int channels, int bigendian)
+{
+    int i, j;
+
+    if(bigendian)
+    {
+        for(i = 0; i < samples; i++)
+            for(j = 0; j < channels; j++, in += 2)
+                out[j][i] = READ_S16_BE(in) * S16_SCALE;
+    }
+    else
+    {
+        for(i = 0; i < samples; i++)
+            for(j = 0; j < channels; j++, in += 2)
+                out[j][i] = READ_S16_LE(in) * S16_SCALE;
+    }
+}
+
+static void s16_downmix_c(float *out, const signed char *in, int samples,
+        int bigendian)
+{
+    int i;
+
+    if(bigendian)
+    {
+        for(i = 0; i < samples; i++, in += 4)
+            out[i] = (READ_S16_BE(in) + READ_S16_BE(in + 2)) *
+                (S16_SCALE / 2);
+    }
+    else
+    {
+        for(i = 0; i < samples; i++, in += 4)
+            out[i] = (READ_S16_LE(in) + READ_S16_LE(in + 2)) *
+                (S16_SCALE / 2);
+    }
+}
+
+/* 24 bit samples go in the top of 32 bits, so they scale like 32 bit ones */
+static inline int32_t read_s24le(const signed char *in)
+{
+    const unsigned char *p = (const unsigned char *)in;
+
+    return (int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 |
+            (uint32_t)p[2] << 24);
+}
+
+static inline int32_t read_s32le(const signed char *in)
+{
+    const unsigned char *p = (const unsigned char *)in;
+
+    return (int32_t)((uint32_t)p[0] | (uint32_t)p[1] << 8 |
+            (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+}
+
+static inline float read_float_le(const signed char *in)
+{
+    uint32_t bits = (uint32_t)read_s32le(in);
+    float f;
+
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+static inline float read_wide(const signed char *in, input_subtype format)
+{
+    switch(format)
+    {
+        case INPUT_PCM_LE_24:
+            return read_s24le(in) * S32_SCALE;
+        case INPUT_PCM_LE_32:
+            return read_s32le(in) * S32_SCALE;
+        default:
+            return read_float_le(in);
+    }
+}
+
+static void wide_to_float_c(float **out, const signed char *in, int samples,
+        int channels, input_subtype format)
+{
+    int size = pcm_sample_size(format);
+    int i, j;
+
+    for(i = 0; i < samples; i++)
+        for(j = 0; j < channels; j++, in += size)
+            out[j][i] = read_wide(in, format);
+}
+
+static void wide_downmix_c(float *out, const signed char *in, int samples,
+        input_subtype format)
+{
+    int size = pcm_sample_size(format);
+    int i;
+
+    for(i = 0; i < samples; i++, in += 2*size)
+        out[i] = (read_wide(in, format) + read_wide(in + size, format)) * 0.5f;
+}
+
+#ifdef PCMCONV_X86
+
+/* The vector kernels do as many whole vectors as they can and leave the
+ * rest to the C version, which is why they take the frame to start at.
+ */
+
+__attribute__((target("sse2")))
+static inline __m128i swap16_sse2(__m128i v)
+{
+    return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+__attribute__((target("sse2")))
+static void s16_to_float_sse2(float **out, const signed char *in,
+        int samples, int channels, int bigendian)
+{
+    const __m128 scale = _mm_set1_ps(S16_SCALE);
+    int i = 0, j;
+
+    if(channels == 1)
+    {
+        for(; i + 8 <= samples; i += 8)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(in + 2*i));
+
+            if(bigendian)
+                v = swap16_sse2(v);
+            /* duplicate each sample into 32 bits, then sign extend */
+            _mm_storeu_ps(out[0] + i, _mm_mul_ps(scale, _mm_cvtepi32_ps(
+                    _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16))));
+            _mm_storeu_ps(out[0] + i + 4, _mm_mul_ps(scale, _mm_cvtepi32_ps(
+                    _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16))));
+        }
+    }
+    else if(channels == 2)
+    {
+        for(; i + 4 <= samples; i += 4)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(in + 4*i));
+
+            if(bigendian)
+                v = swap16_sse2(v);
+            /* each frame is one 32 bit lane, left in the low half */
+            _mm_storeu_ps(out[0] + i, _mm_mul_ps(scale, _mm_cvtepi32_ps(
+                    _mm_srai_epi32(_mm_slli_epi32(v, 16), 16))));
+            _mm_storeu_ps(out[1] + i, _mm_mul_ps(scale, _mm_cvtepi32_ps(
+                    _mm_srai_epi32(v, 16))));
+        }
+    }
+    if(i < samples)
+    {
+        float *rest[channels];
+
+        for(j = 0; j < channels; j++)
+            rest[j] = out[j] + i;
+        s16_to_float_c(rest, in + 2*channels*i, samples - i, channels,
+                bigendian);
+    }
+}
+
+__attribute__((target("sse2")))
+static void s16_downmix_sse2(float *out, const signed char *in, int samples,
+        int bigendian)
+{
+    const __m128 scale = _mm_set1_ps(S16_SCALE / 2);
+    int i;
+
+    for(i = 0; i + 4 <= samples; i += 4)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + 4*i));
+
+        if(bigendian)
+            v = swap16_sse2(v);
+        _mm_storeu_ps(out + i, _mm_mul_ps(scale, _mm_cvtepi32_ps(
+                _mm_add_epi32(_mm_srai_epi32(_mm_slli_epi32(v, 16), 16),
+                    _mm_srai_epi32(v, 16)))));
+    }
+
+    s16_downmix_c(out + i, in + 4*i, samples - i, bigendian);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i swap16_avx2(__m256i v)
+{
+    return _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+}
+
+__attribute__((target("avx2")))
+static void s16_to_float_avx2(float **out, const signed char *in,
+        int samples, int channels, int bigendian)
+{
+    const __m256 scale = _mm256_set1_ps(S16_SCALE);
+    int i = 0, j;
+
+    if(channels == 1)
+    {
+        for(; i + 8 <= samples; i += 8)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(in + 2*i));
+
+            if(bigendian)
+                v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+            _mm256_storeu_ps(out[0] + i, _mm256_mul_ps(scale,
+                    _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(v))));
+        }
+    }
+    else if(channels == 2)
+    {
+        for(; i + 8 <= samples; i += 8)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(in + 4*i));
+
+            if(bigendian)
+                v = swap16_avx2(v);
+            _mm256_storeu_ps(out[0] + i, _mm256_mul_ps(scale,
+                    _mm256_cvtepi32_ps(_mm256_srai_epi32(
+                            _mm256_slli_epi32(v, 16), 16))));
+            _mm256_storeu_ps(out[1] + i, _mm256_mul_ps(scale,
+                    _mm256_cvtepi32_ps(_mm256_srai_epi32(v, 16))));
+        }
+    }
+    else
+    {
+        s16_to_float_c(out, in, samples, channels, bigendian);
+        return;
+    }
+
+    if(i < samples)
+    {
+        float *rest[channels];
+
+        for(j = 0; j < channels; j++)
+            rest[j] = out[j] + i;
+        s16_to_float_sse2(rest, in + 2*channels*i, samples - i, channels,
+                bigendian);
+    }
+}
+
+__attribute__((target("avx2")))
+static void s16_downmix_avx2(float *out, const signed char *in, int samples,
+        int bigendian)
+{
+    const __m256 scale = _mm256_set1_ps(S16_SCALE / 2);
+    int i;
+
+    for(i = 0; i + 8 <= samples; i += 8)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(in + 4*i));
+
+        if(bigendian)
+            v = swap16_avx2(v);
+        _mm256_storeu_ps(out + i, _mm256_mul_ps(scale, _mm256_cvtepi32_ps(
+                _mm256_add_epi32(_mm256_srai_epi32(
+                        _mm256_slli_epi32(v, 16), 16),
+                    _mm256_srai_epi32(v, 16)))));
+    }
+
+    s16_downmix_sse2(out + i, in + 4*i, samples - i, bigendian);
+}
+
+/* The wide formats only differ in how four samples are loaded, so the
+ * kernels are written once around a load4 for each. Mono and stereo
+ * are done in vectors, stereo by splitting two loads into left and right;
+ * over is how far past its four samples load4 reads.
+ */
+#define WIDE_TO_FLOAT(name, isa, load4, size, over) \
+__attribute__((target(isa))) \
+static void name(float **out, const signed char *in, int samples, \
+        int channels, input_subtype format) \
+{ \
+    int total = samples * channels * (size); \
+    int i = 0, j; \
+\
+    if(channels == 1) \
+    { \
+        for(; (i + 4) * (size) + (over) <= total; i += 4) \
+            _mm_storeu_ps(out[0] + i, load4(in + i * (size))); \
+    } \
+    else if(channels == 2) \
+    { \
+        for(; (2*i + 8) * (size) + (over) <= total; i += 4) \
+        { \
+            __m128 a = load4(in + 2*i * (size)); \
+            __m128 b = load4(in + (2*i + 4) * (size)); \
+\
+            _mm_storeu_ps(out[0] + i, \
+                    _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0))); \
+            _mm_storeu_ps(out[1] + i, \
+                    _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1))); \
+        } \
+    } \
+\
+    if(i < samples) \
+    { \
+        float *rest[channels]; \
+\
+        for(j = 0; j < channels; j++) \
+            rest[j] = out[j] + i; \
+        wide_to_float_c(rest, in + channels*i * (size), samples - i, \
+                channels, format); \
+    } \
+}
+
+__attribute__((target("sse2")))
+static inline __m128 load4_s32_sse2(const signed char *in)
+{
+    return _mm_mul_ps(_mm_set1_ps(S32_SCALE), _mm_cvtepi32_ps(
+            _mm_loadu_si128((const __m128i *)in)));
+}
+
+__attribute__((target("sse2")))
+static inline __m128 load4_float_sse2(const signed char *in)
+{
+    return _mm_loadu_ps((const float *)in);
+}
+
+/* 12 bytes of packed samples into the top of four lanes; the load takes
+ * 16 */
+__attribute__((target("ssse3")))
+static inline __m128 load4_s24_ssse3(const signed char *in)
+{
+    const __m128i spread = _mm_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5,
+            -1, 6, 7, 8, -1, 9, 10, 11);
+
+    return _mm_mul_ps(_mm_set1_ps(S32_SCALE), _mm_cvtepi32_ps(
+            _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)in), spread)));
+}
+
+WIDE_TO_FLOAT(s32_to_float_sse2, "sse2", load4_s32_sse2, 4, 0)
+WIDE_TO_FLOAT(float_to_float_sse2, "sse2", load4_float_sse2, 4, 0)
+WIDE_TO_FLOAT(s24_to_float_ssse3, "ssse3", load4_s24_ssse3, 3, 4)
+
+#endif /* PCMCONV_X86 */
+
+static s16_to_float_fn s16_to_float = s16_to_float_c;
+static s16_downmix_fn s16_downmix = s16_downmix_c;
+static wide_to_float_fn s24_to_float = wide_to_float_c;
+static wide_to_float_fn s32_to_float = wide_to_float_c;
+static wide_to_float_fn float_to_float = wide_to_float_c;
+static const char *kernel_name = "C";
+static const char *wide_kernel_name = "C";
+
+/* Pick the kernels for this processor. Called once at startup, before any
+ * other threads exist.
+ */
+void pcmconv_initialise(void)
+{
+#ifdef PCMCONV_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+    {
+        s16_to_float = s16_to_float_avx2;
+        s16_downmix = s16_downmix_avx2;
+        kernel_name = "AVX2";
+    }
+    else if(__builtin_cpu_supports("sse2"))
+    {
+        s16_to_float = s16_to_float_sse2;
+        s16_downmix = s16_downmix_sse2;
+        kernel_name = "SSE2";
+    }
+    if(__builtin_cpu_supports("sse2"))
+    {
+        s32_to_float = s32_to_float_sse2;
+        float_to_float = float_to_float_sse2;
+        wide_kernel_name = "SSE2";
+    }
+    if(__builtin_cpu_supports("ssse3"))
+    {
+        s24_to_float = s24_to_float_ssse3;
+        wide_kernel_name = "SSE2/SSSE3";
+    }
+#endif
+    LOG_DEBUG2("Using %s sample conversion, %s for 24 and 32 bit input",
+            kernel_name, wide_kernel_name);
+}
+
+int pcm_sample_size(input_subtype format)
+{
+    switch(format)
+    {
+        case INPUT_PCM_LE_24:
+            return 3;
+        case INPUT_PCM_LE_32:
+        case INPUT_PCM_LE_FLOAT:
+            return 4;
+        default:
+            return 2;
+    }
+}
+
+static const struct {
+    const char *name;
+    input_subtype format;
+} pcm_formats[] = {
+    { "s16", INPUT_PCM_LE_16 },
+    { "s16le", INPUT_PCM_LE_16 },
+    { "s16be", INPUT_PCM_BE_16 },
+    { "s24", INPUT_PCM_LE_24 },
+    { "s24_3le", INPUT_PCM_LE_24 },
+    { "s32", INPUT_PCM_LE_32 },
+    { "s32le", INPUT_PCM_LE_32 },
+    { "float", INPUT_PCM_LE_FLOAT },
+    { "float_le", INPUT_PCM_LE_FLOAT },
+    { NULL, 0 }
+};
+
+int pcm_parse_format(const char *name, input_subtype *format)
+{
+    int i;
+
+    for(i = 0; pcm_formats[i].name; i++)
+        if(!strcasecmp(name, pcm_formats[i].name))
+        {
+            *format = pcm_formats[i].format;
+            return 0;
+        }
+    return -1;
+}
+
+const char *pcm_format_name(input_subtype format)
+{
+    int i;
+
+    for(i = 0; pcm_formats[i].name; i++)
+        if(pcm_formats[i].format == format)
+            return pcm_formats[i].name;
+    return "unknown";
+}
+
+void pcm_to_float(float **out, const signed char *in, int samples,
+        int channels, input_subtype format)
+{
+    switch(format)
+    {
+        case INPUT_PCM_LE_16:
+            s16_to_float(out, in, samples, channels, 0);
+            break;
+        case INPUT_PCM_BE_16:
+            s16_to_float(out, in, samples, channels, 1);
+            break;
+        case INPUT_PCM_LE_24:
+            s24_to_float(out, in, samples, channels, format);
+            break;
+        case INPUT_PCM_LE_32:
+            s32_to_float(out, in, samples, channels, format);
+            break;
+        case INPUT_PCM_LE_FLOAT:
+            float_to_float(out, in, samples, channels, format);
+            break;
+    }
+}
+
+/* Downmixing 24 and 32 bit input is rare enough to be left to C */
+void pcm_downmix(float *out, const signed char *in, int samples,
+        input_subtype format)
+{
+    if(format == INPUT_PCM_LE_16 || format == INPUT_PCM_BE_16)
+        s16_downmix(out, in, samples, format == INPUT_PCM_BE_16);
+    else
+        wide_downmix_c(out, in, samples, format);
+}
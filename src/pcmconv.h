@@ -0,0 +1,34 @@
+/* pcmconv.h
+ * - interleaved PCM to planar float conversion.
+ *
+ * Copyright (c) 2026 The IceS Development Team <team@icecast.org>
+ *
+ * This program is distributed under the terms of the GNU General
+ * Public License, version 2. You may use, modify, and redistribute
+ * it under the terms of this license. A copy should be included
+ * with this source.
+ */
+
+#ifndef __PCMCONV_H
+#define __PCMCONV_H
+
+#include "inputmodule.h"
+
+void pcmconv_initialise(void);
+
+/* bytes in one sample of one channel */
+int pcm_sample_size(input_subtype format);
+/* the format named by an input module's format parameter: returns 0, or
+ * -1 if the name is unknown */
+int pcm_parse_format(const char *name, input_subtype *format);
+const char *pcm_format_name(input_subtype format);
+
+/* samples frames of interleaved PCM to channels planar arrays, scaled to
+ * [-1, 1) */
+void pcm_to_float(float **out, const signed char *in, int samples,
+        int channels, input_subtype format);
+/* samples stereo frames to their mono average */
+void pcm_downmix(float *out, const signed char *in, int samples,
+        input_subtype format);
+
+#endif /* __PCMCONV_H */
@@ -0,0 +1,217 @@
+/* preroll.c
+ * - recent pages kept for sending in a burst on reconnect.
+ *
+ * Everything sent to the server is paced to real time, so after a
+ * reconnect icecast's burst buffer for new listeners takes as long to
+ * fill as it is long. Instead each instance keeps the headers of the
+ * logical stream it is sending plus the last few seconds of pages, and
+ * sends the lot at full speed as soon as it has reconnected, carrying on
+ * with paced delivery afterwards. Having the headers also means it no
+ * longer has to wait for the next logical stream to start.
+ *
+ * Copyright (c) 2026 The IceS Development Team <team@icecast.org>
+ *
+ * This program is distributed under the terms of the GNU General
+ * Public License, version 2. You may use, modify, and redistribute
+ * it under the terms of this license. A copy should be included
+ * with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+ #include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cfgparse.h"
+#include "stream.h"
+#include "bufpool.h"
+#include "stream_shared.h"
+#include "input.h"
+#include "preroll.h"
+
+#define MODULE "preroll/"
+#include "logging.h"
+
+/* With 0 seconds only the headers are kept, as a shared encoder does for
+ * members joining part way through a logical stream. */
+preroll_state *preroll_initialise(int seconds)
+{
+    preroll_state *p = calloc(1, sizeof(preroll_state));
+
+    if(!p)
+        return NULL;
+    p->length = (uint64_t)seconds * 1000000000;
+    p->headers_tail = &p->headers;
+    p->pages_tail = &p->pages;
+
+    return p;
+}
+
+static void preroll_free_list(preroll_page *page)
+{
+    while(page)
+    {
+        preroll_page *next = page->next;
+
+        bufpool_free(page);
+        page = next;
+    }
+}
+
+static void preroll_reset(preroll_state *p)
+{
+    preroll_free_list(p->headers);
+    preroll_free_list(p->pages);
+    p->headers = NULL;
+    p->headers_tail = &p->headers;
+    p->pages = NULL;
+    p->pages_tail = &p->pages;
+    p->bytes = 0;
+}
+
+void preroll_clear(preroll_state *p)
+{
+    if(p)
+    {
+        preroll_reset(p);
+        free(p);
+    }
+}
+
+/* Note a page that has just been sent, or by a shared encoder queued to
+ * its members. Header pages are the ones at the
+ * start of a logical stream before any has a granulepos.
+ */
+void preroll_add_page(preroll_state *p, ogg_page *og)
+{
+    preroll_page *page;
+    uint64_t now;
+
+    if(!p)
+        return;
+
+    if(ogg_page_bos(og))
+    {
+        /* a run of bos pages starts a multiplexed stream, keep them
+         * together */
+        if(!p->in_headers)
+            preroll_reset(p);
+        p->in_headers = 1;
+    }
+    else if(p->in_headers && ogg_page_granulepos(og) > 0)
+        p->in_headers = 0;
+
+    /* joined mid-stream, useless without the headers */
+    if(!p->headers && !p->in_headers)
+        return;
+    /* only the headers are wanted */
+    if(!p->in_headers && !p->length)
+        return;
+
+    page = bufpool_alloc(sizeof(preroll_page) + og->header_len + og->body_len);
+    if(!page)
+        return;
+    page->next = NULL;
+    page->len = og->header_len + og->body_len;
+    memcpy(page->data, og->header, og->header_len);
+    memcpy(page->data + og->header_len, og->body, og->body_len);
+
+    if(p->in_headers)
+    {
+        *p->headers_tail = page;
+        p->headers_tail = &page->next;
+        return;
+    }
+
+    now = input_clock();
+    page->time = now;
+    *p->pages_tail = page;
+    p->pages_tail = &page->next;
+    p->bytes += page->len;
+
+    while(p->pages->time + p->length < now)
+    {
+        preroll_page *old = p->pages;
+
+        p->pages = old->next;
+        p->bytes -= old->len;
+        bufpool_free(old);
+    }
+}
+
+static int preroll_page_sink(void *arg, ogg_page *og)
+{
+    preroll_add_page(arg, og);
+    return 1;
+}
+
+/* Note what stream_send_flush() has just sent to the server, any number
+ * of whole pages. Only what actually went out is kept, so a send that
+ * failed isn't repeated in the burst after reconnecting.
+ */
+void preroll_add_data(preroll_state *p, unsigned char *buf, long len)
+{
+    if(p)
+        stream_split_pages(buf, len, preroll_page_sink, p);
+}
+
+/* The headers of the current logical stream, all in one block from
+ * bufpool_alloc(), or NULL if they aren't complete yet.
+ */
+unsigned char *preroll_get_headers(preroll_state *p, long *len)
+{
+    preroll_page *page;
+    unsigned char *buf;
+    long total = 0;
+
+    if(!p || !p->headers || p->in_headers)
+        return NULL;
+
+    for(page = p->headers; page; page = page->next)
+        total += page->len;
+    buf = bufpool_alloc(total);
+    if(!buf)
+        return NULL;
+
+    *len = 0;
+    for(page = p->headers; page; page = page->next)
+    {
+        memcpy(buf + *len, page->data, page->len);
+        *len += page->len;
+    }
+
+    return buf;
+}
+
+/* Send the headers and the kept pages to a fresh connection, unpaced.
+ * Returns: 1 - sent
+ *          0 - send failed
+ *         -1 - nothing to send, the instance has to wait for the start of
+ *              the next logical stream as before
+ */
+int preroll_send(preroll_state *p, shout_t *shout)
+{
+    preroll_page *page;
+    uint64_t last = 0;
+
+    if(!p || !p->headers)
+        return -1;
+
+    for(page = p->headers; page; page = page->next)
+        if(shout_send_raw(shout, page->data, page->len) < 0)
+            return 0;
+    for(page = p->pages; page; page = page->next)
+    {
+        if(shout_send_raw(shout, page->data, page->len) < 0)
+            return 0;
+        last = page->time;
+    }
+
+    LOG_INFO2("Sent %ld bytes of pre-roll covering %lu ms", p->bytes,
+            (unsigned long)(p->pages ? (last - p->pages->time) / 1000000 : 0));
+
+    return 1;
+}
@@ -0,0 +1,45 @@
+/* preroll.h
+ * - recent pages kept for sending in a burst on reconnect.
+ *
+ * Copyright (c) 2026 The IceS Development Team <team@icecast.org>
+ *
+ * This program is distributed under the terms of the GNU General
+ * Public License, version 2. You may use, modify, and redistribute
+ * it under the terms of this license. A copy should be included
+ * with this source.
+ */
+
+#ifndef __PREROLL_H
+#define __PREROLL_H
+
+#include <stdint.h>
+
+#include <ogg/ogg.h>
+#include <shout/shout.h>
+
+typedef struct preroll_page {
+    struct preroll_page *next;
+    uint64_t time;              /* when it was sent, input_clock() */
+    long len;
+    unsigned char data[];
+} preroll_page;
+
+typedef struct {
+    uint64_t length;            /* ns of pages to keep */
+    int in_headers;             /* still collecting the stream's headers */
+
+    preroll_page *headers;
+    preroll_page **headers_tail;
+    preroll_page *pages;        /* oldest first */
+    preroll_page **pages_tail;
+    long bytes;
+} preroll_state;
+
+preroll_state *preroll_initialise(int seconds);
+void preroll_add_page(preroll_state *p, ogg_page *og);
+void preroll_add_data(preroll_state *p, unsigned char *buf, long len);
+unsigned char *preroll_get_headers(preroll_state *p, long *len);
+int preroll_send(preroll_state *p, shout_t *shout);
+void preroll_clear(preroll_state *p);
+
+#endif /* __PREROLL_H */
@@ -36,52 +36,54 @@ ref_buffer *new_ref_buffer(media_type media, void *data, int len, int aux)
     new->buf = data;
     new->len = len;
 
-    new->count = 1;
+    atomic_init(&new->count, 1);
 
     return new;
 }
 
 void acquire_buffer(ref_buffer *buf)
 {
-    thread_mutex_lock(&ices_config->refcount_lock);
+    int count;
 
 #ifdef DEBUG_BUFFERS
     if(!buf) {
         LOG_ERROR0("Null buffer aquired?");
-        thread_mutex_unlock(&ices_config->refcount_lock);
         return;
     }
-    if(buf->count < 0)
-        LOG_ERROR1("Error: refbuf has count %d before increment.", buf->count);
 #endif
 
-    buf->count++;
+    count = atomic_fetch_add_explicit(&buf->count, 1, memory_order_relaxed);
 
-    thread_mutex_unlock(&ices_config->refcount_lock);
+#ifdef DEBUG_BUFFERS
+    if(count < 0)
+        LOG_ERROR1("Error: refbuf has count %d before increment.", count);
+#endif
 }
 
 void release_buffer(ref_buffer *buf)
 {
-    thread_mutex_lock(&ices_config->refcount_lock);
+    int count;
 
 #ifdef DEBUG_BUFFERS
     if(!buf) {
         LOG_ERROR0("Null buffer released?");
-        thread_mutex_unlock(&ices_config->refcount_lock);
         return;
     }
-    if(buf->count <= 0)
-        LOG_ERROR1("Error: refbuf has count %d before decrement.", buf->count);
 #endif
 
-    buf->count--;
+    count = atomic_fetch_sub_explicit(&buf->count, 1, memory_order_release);
+
+#ifdef DEBUG_BUFFERS
+    if(count <= 0)
+        LOG_ERROR1("Error: refbuf has count %d before decrement.", count);
+#endif
 
-    if(!buf->count)
+    if(count == 1)
     {
+        atomic_thread_fence(memory_order_acquire);
         free(buf->buf);
         free(buf);
     }
-    thread_mutex_unlock(&ices_config->refcount_lock);
 }
 
 /* return values:
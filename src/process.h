@@ -14,6 +14,8 @@
 #ifndef __PROCESS_H__
 #define __PROCESS_H__
 
+#include <stdatomic.h>
+
 #include "event.h"
 
 typedef enum {
@@ -44,7 +46,7 @@ typedef struct {
     void *buf;            /* Actual data */
     int len;             /* Length of data (usually bytes, sometimes samples */
 
-    short count;          /* Reference count */
+    atomic_int count;     /* Reference count */
 
     buffer_flags flags;   /* Flag: critical chunks must be processed fully */
     int aux_data_len;
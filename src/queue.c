@@ -0,0 +1,365 @@
+/* queue.c
+ * - bounded single-producer/single-consumer queue of ref_buffers.
+ *
+ * Each instance has exactly one thread feeding it (the input loop) and one
+ * thread draining it (the instance itself), so a ring indexed by two
+ * free-running counters is all that is needed; no locks and no per-buffer
+ * allocations.
+ *
+ * Copyright (c) 2026 The IceS Development Team <team@icecast.org>
+ *
+ * This program is distributed under the terms of the GNU General
+ * Public License, version 2. You may use, modify, and redistribute
+ * it under the terms of this license. A copy should be included
+ * with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+ #include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "cfgparse.h"
+#include "stream.h"
+#include "stream_shared.h"
+#include "queue.h"
+
+/* upper bound on how long a consumer sleeps without being woken, so that
+ * shutdown and kill requests are always noticed and a partly filled batch
+ * doesn't sit around forever */
+#define QUEUE_WAIT_TIMEOUT_MS 250
+
+/* the timeout is on the monotonic clock where the condvar can be told to
+ * use it, so setting the time of day can't stretch a wait */
+#if defined(HAVE_PTHREAD_CONDATTR_SETCLOCK) && defined(CLOCK_MONOTONIC)
+#define QUEUE_WAIT_CLOCK CLOCK_MONOTONIC
+#else
+#define QUEUE_WAIT_CLOCK CLOCK_REALTIME
+#endif
+
+#define MODULE "queue/"
+#include "logging.h"
+
+buffer_queue *queue_create(int length)
+{
+    buffer_queue *queue;
+    pthread_condattr_t attr;
+    unsigned int size = 2;
+
+    while(size < (unsigned int)length)
+        size <<= 1;
+
+    queue = calloc(1, sizeof(buffer_queue));
+    if(!queue)
+        return NULL;
+    queue->items = calloc(size, sizeof(ref_buffer *));
+    if(!queue->items)
+    {
+        free(queue);
+        return NULL;
+    }
+    queue->size = size;
+    queue->mask = size - 1;
+
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+    atomic_init(&queue->flush_mark, 0);
+    atomic_init(&queue->flush_pending, 0);
+    atomic_init(&queue->trim_pending, 0);
+    atomic_init(&queue->overflows, 0);
+    atomic_init(&queue->dropped_pages, 0);
+    atomic_init(&queue->dropped_bytes, 0);
+    atomic_init(&queue->wake_level, 0);
+    atomic_init(&queue->space_level, 0);
+
+    pthread_mutex_init(&queue->wait_lock, NULL);
+    pthread_condattr_init(&attr);
+#if defined(HAVE_PTHREAD_CONDATTR_SETCLOCK) && defined(CLOCK_MONOTONIC)
+    pthread_condattr_setclock(&attr, QUEUE_WAIT_CLOCK);
+#endif
+    pthread_cond_init(&queue->wait_cond, &attr);
+    pthread_cond_init(&queue->space_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    return queue;
+}
+
+/* Only to be called once neither the producer nor the consumer can touch
+ * the queue any more.
+ */
+void queue_free(buffer_queue *queue)
+{
+    if(queue)
+    {
+        queue_flush(queue, 0);
+        pthread_cond_destroy(&queue->wait_cond);
+        pthread_cond_destroy(&queue->space_cond);
+        pthread_mutex_destroy(&queue->wait_lock);
+        free(queue->items);
+        free(queue);
+    }
+}
+
+/* Returns 0 on success, -1 if the queue is full (in which case the caller
+ * still owns buf).
+ */
+int queue_push(buffer_queue *queue, ref_buffer *buf)
+{
+    unsigned int head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+
+    if(head - tail >= queue->size)
+        return -1;
+
+    queue->items[head & queue->mask] = buf;
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+
+    return 0;
+}
+
+/* Ask the consumer to drop everything that has been queued so far. The
+ * producer cannot touch the consumer's end of the ring, so the actual work
+ * happens on the next queue_pop().
+ */
+void queue_request_flush(buffer_queue *queue)
+{
+    unsigned int head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+
+    atomic_store_explicit(&queue->flush_mark, head, memory_order_relaxed);
+    atomic_store_explicit(&queue->flush_pending, 1, memory_order_release);
+}
+
+/* Ask the consumer to make room by dropping its oldest data, up to the
+ * next critical buffer. Used for the drop-oldest overflow policy.
+ */
+void queue_request_trim(buffer_queue *queue)
+{
+    atomic_store_explicit(&queue->trim_pending, 1, memory_order_release);
+}
+
+/* Producer: wake the consumer if it is asleep and enough has now been
+ * queued for it. Costs no more than a fence and a load when the consumer is
+ * busy, so it is fine to call after every push, or once after a batch of
+ * pushes.
+ */
+void queue_signal(buffer_queue *queue)
+{
+    int level;
+
+    /* pairs with the fence in queue_wait(): either we see the consumer's
+     * wake_level or it sees our head */
+    atomic_thread_fence(memory_order_seq_cst);
+    level = atomic_load_explicit(&queue->wake_level, memory_order_relaxed);
+
+    if(level && queue_length(queue) >= level)
+    {
+        pthread_mutex_lock(&queue->wait_lock);
+        pthread_cond_signal(&queue->wait_cond);
+        pthread_mutex_unlock(&queue->wait_lock);
+    }
+}
+
+/* Wake whichever end is asleep regardless of what is queued, so it can
+ * notice a shutdown or kill request.
+ */
+void queue_wake(buffer_queue *queue)
+{
+    pthread_mutex_lock(&queue->wait_lock);
+    pthread_cond_signal(&queue->wait_cond);
+    pthread_cond_signal(&queue->space_cond);
+    pthread_mutex_unlock(&queue->wait_lock);
+}
+
+static void queue_wait_deadline(struct timespec *deadline)
+{
+    clock_gettime(QUEUE_WAIT_CLOCK, deadline);
+    deadline->tv_nsec += QUEUE_WAIT_TIMEOUT_MS * 1000000L;
+    if(deadline->tv_nsec >= 1000000000L)
+    {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+/* Consumer: sleep until at least batch buffers are queued, queue_wake() is
+ * called, or QUEUE_WAIT_TIMEOUT_MS goes by. May return early; the caller is
+ * expected to re-check whatever it is waiting for.
+ */
+void queue_wait(buffer_queue *queue, int batch)
+{
+    struct timespec deadline;
+
+    if(batch < 1)
+        batch = 1;
+
+    queue_wait_deadline(&deadline);
+
+    pthread_mutex_lock(&queue->wait_lock);
+    atomic_store_explicit(&queue->wake_level, batch, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    /* the producer signals with wait_lock held, so it can't slip in between
+     * this check and the wait */
+    if(queue_length(queue) < batch)
+        pthread_cond_timedwait(&queue->wait_cond, &queue->wait_lock, &deadline);
+
+    atomic_store_explicit(&queue->wake_level, 0, memory_order_relaxed);
+    pthread_mutex_unlock(&queue->wait_lock);
+}
+
+/* Producer: sleep until fewer than limit buffers are queued, queue_wake()
+ * is called, or QUEUE_WAIT_TIMEOUT_MS goes by. The mirror of queue_wait(),
+ * for a producer that would rather wait than drop; it too may return early.
+ */
+void queue_wait_space(buffer_queue *queue, int limit)
+{
+    struct timespec deadline;
+
+    if(limit < 1)
+        limit = 1;
+
+    queue_wait_deadline(&deadline);
+
+    pthread_mutex_lock(&queue->wait_lock);
+    atomic_store_explicit(&queue->space_level, limit, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if(queue_length(queue) >= limit)
+        pthread_cond_timedwait(&queue->space_cond, &queue->wait_lock,
+                &deadline);
+
+    atomic_store_explicit(&queue->space_level, 0, memory_order_relaxed);
+    pthread_mutex_unlock(&queue->wait_lock);
+}
+
+/* Consumer: wake the producer if it is waiting for room and there now is
+ * enough, after a pop or a flush. As cheap as queue_signal() when it isn't.
+ */
+void queue_signal_space(buffer_queue *queue)
+{
+    int level;
+
+    /* pairs with the fence in queue_wait_space() */
+    atomic_thread_fence(memory_order_seq_cst);
+    level = atomic_load_explicit(&queue->space_level, memory_order_relaxed);
+
+    if(level && queue_length(queue) < level)
+    {
+        pthread_mutex_lock(&queue->wait_lock);
+        pthread_cond_signal(&queue->space_cond);
+        pthread_mutex_unlock(&queue->wait_lock);
+    }
+}
+
+/* Account for a buffer the overflow policy is throwing away instead of
+ * sending. This doesn't release it, the caller still has to. Flushes
+ * aren't counted, only what the policy drops.
+ */
+void queue_dropped(buffer_queue *queue, ref_buffer *buf)
+{
+    atomic_fetch_add_explicit(&queue->dropped_pages, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&queue->dropped_bytes, buf->len,
+            memory_order_relaxed);
+}
+
+static void queue_trim(buffer_queue *queue)
+{
+    unsigned int head = atomic_load_explicit(&queue->head, memory_order_acquire);
+    unsigned int tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+
+    if(tail == head)
+        return;
+
+    /* always lose the oldest, then carry on to the next critical buffer */
+    do {
+        ref_buffer *buf = queue->items[tail++ & queue->mask];
+
+        queue_dropped(queue, buf);
+        stream_release_buffer(buf);
+    } while(tail != head && !queue->items[tail & queue->mask]->critical);
+
+    atomic_store_explicit(&queue->tail, tail, memory_order_release);
+}
+
+static void queue_drop_to(buffer_queue *queue, unsigned int mark)
+{
+    unsigned int tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+
+    if((int)(mark - tail) <= 0)
+        return;
+
+    LOG_DEBUG1("Dropping %d queued buffers on request", (int)(mark - tail));
+    while(tail != mark)
+        stream_release_buffer(queue->items[tail++ & queue->mask]);
+
+    atomic_store_explicit(&queue->tail, tail, memory_order_release);
+}
+
+ref_buffer *queue_pop(buffer_queue *queue)
+{
+    unsigned int head, tail;
+    ref_buffer *buf;
+
+    if(atomic_exchange_explicit(&queue->flush_pending, 0, memory_order_acquire))
+        queue_drop_to(queue, atomic_load_explicit(&queue->flush_mark,
+                    memory_order_relaxed));
+    if(atomic_exchange_explicit(&queue->trim_pending, 0, memory_order_acquire))
+        queue_trim(queue);
+
+    tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    head = atomic_load_explicit(&queue->head, memory_order_acquire);
+
+    if(tail == head)
+        return NULL;
+
+    buf = queue->items[tail & queue->mask];
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+
+    return buf;
+}
+
+/* Drop everything currently queued. If keep_critical is set, critical
+ * buffers survive and keep their order; they are packed up against the
+ * head, which is safe as the producer never touches slots before head.
+ */
+void queue_flush(buffer_queue *queue, int keep_critical)
+{
+    unsigned int head = atomic_load_explicit(&queue->head, memory_order_acquire);
+    unsigned int tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    unsigned int pos, keep;
+
+    if(tail == head)
+        return;
+
+    if(!keep_critical)
+    {
+        for(pos = tail; pos != head; pos++)
+            stream_release_buffer(queue->items[pos & queue->mask]);
+        atomic_store_explicit(&queue->tail, head, memory_order_release);
+        return;
+    }
+
+    keep = head;
+    pos = head;
+    while(pos != tail)
+    {
+        ref_buffer *buf = queue->items[--pos & queue->mask];
+
+        if(buf->critical)
+            queue->items[--keep & queue->mask] = buf;
+        else
+            stream_release_buffer(buf);
+    }
+    atomic_store_explicit(&queue->tail, keep, memory_order_release);
+}
+
+int queue_length(buffer_queue *queue)
+{
+    unsigned int tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+    unsigned int head = atomic_load_explicit(&queue->head, memory_order_acquire);
+
+    return (int)(head - tail);
+}
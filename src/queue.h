@@ -0,0 +1,84 @@
+/* queue.h
+ * - bounded single-producer/single-consumer queue of ref_buffers, used
+ *   to hand buffers from the input thread to each instance thread.
+ *
+ * Copyright (c) 2026 The IceS Development Team <team@icecast.org>
+ *
+ * This program is distributed under the terms of the GNU General
+ * Public License, version 2. You may use, modify, and redistribute
+ * it under the terms of this license. A copy should be included
+ * with this source.
+ */
+
+#ifndef __QUEUE_H
+#define __QUEUE_H
+
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "cfgparse.h"
+#include "stream.h"
+
+#define QUEUE_CACHE_LINE 64
+
+/* head is only ever written by the producer and tail by the consumer, so
+ * keep them on separate cache lines to avoid the two threads fighting over
+ * the same line on every buffer.
+ */
+typedef struct buffer_queue {
+    ref_buffer **items;
+    unsigned int size;          /* always a power of two */
+    unsigned int mask;
+
+    /* producer asking the consumer to drop everything before flush_mark,
+     * or to drop the oldest data up to the next critical buffer */
+    atomic_uint flush_mark;
+    atomic_int flush_pending;
+    atomic_int trim_pending;
+
+    /* what the overflow policy discarded rather than sent, updated from
+     * both ends; flushes aren't counted */
+    atomic_ulong overflows;
+    atomic_ulong dropped_pages;
+    atomic_ulong dropped_bytes;
+
+    /* the consumer sleeps here when it runs dry. wake_level is how many
+     * buffers it wants before being woken, 0 while it isn't asleep. */
+    pthread_mutex_t wait_lock;
+    pthread_cond_t wait_cond;
+    atomic_int wake_level;
+
+    /* and the producer sleeps on space_cond when it runs out of room.
+     * space_level is how full the queue must drop below to wake it, 0
+     * while it isn't asleep. */
+    pthread_cond_t space_cond;
+    atomic_int space_level;
+
+    char pad0[QUEUE_CACHE_LINE];
+    atomic_uint head;
+    char pad1[QUEUE_CACHE_LINE - sizeof(atomic_uint)];
+    atomic_uint tail;
+    char pad2[QUEUE_CACHE_LINE - sizeof(atomic_uint)];
+} buffer_queue;
+
+buffer_queue *queue_create(int length);
+void queue_free(buffer_queue *queue);
+
+/* producer side */
+int queue_push(buffer_queue *queue, ref_buffer *buf);
+void queue_request_flush(buffer_queue *queue);
+void queue_request_trim(buffer_queue *queue);
+void queue_signal(buffer_queue *queue);
+void queue_wake(buffer_queue *queue);
+void queue_wait_space(buffer_queue *queue, int limit);
+
+/* consumer side */
+ref_buffer *queue_pop(buffer_queue *queue);
+void queue_flush(buffer_queue *queue, int keep_critical);
+void queue_wait(buffer_queue *queue, int batch);
+void queue_signal_space(buffer_queue *queue);
+
+int queue_length(buffer_queue *queue);
+void queue_dropped(buffer_queue *queue, ref_buffer *buf);
+
+#endif /* __QUEUE_H */
@@ -1,5 +1,6 @@
 /* reencode.c
  * - runtime reencoding of vorbis audio (usually to lower bitrates).
+ *   The decoding is done once for all instances, see decode.c.
  *
  * $Id: reencode.c,v 1.10 2003/12/22 14:01:09 karl Exp $
  *
@@ -25,12 +26,17 @@
 #include "reencode.h"
 #include "cfgparse.h"
 #include "stream.h"
+#include "stream_shared.h"
 #include "encode.h"
 #include "audio.h"
 
 #define MODULE "reencode/"
 #include "logging.h"
 
+/* header pages with more than this in them (cover art, usually) aren't
+ * held, and their stream is always reencoded */
+#define REENCODE_HOLD_MAX (1024*1024)
+
 reencode_state *reencode_init(instance_t *stream)
 {
     reencode_state *new = calloc(1, sizeof(reencode_state));
@@ -40,12 +46,22 @@ reencode_state *reencode_init(instance_t *stream)
     new->out_max_br = stream->max_br;
     new->quality = stream->quality;
     new->managed = stream->managed;
+    new->out_codec = stream->codec;
 
     new->out_samplerate = stream->samplerate;
     new->out_channels = stream->channels;
-    new->current_serial = -1; /* FIXME: that's a valid serial */
-    new->need_headers = 0;
+    new->stream = NULL;
     new->max_samples_ppage = stream->max_samples_ppage;
+    new->latency_ms = stream->latency_ms;
+    new->passthrough = stream->passthrough;
+
+    if(new->passthrough && new->out_nom_br <= 0 &&
+            !(new->managed && new->out_max_br > 0))
+    {
+        LOG_WARN0("passthrough needs a nominal or managed maximum bitrate "
+                "to compare the input with, everything will be reencoded");
+        new->passthrough = 0;
+    }
 
     return new;
 }
@@ -55,193 +71,304 @@ void reencode_clear(reencode_state *s)
     if(s) 
     {
         LOG_DEBUG0("Clearing reencoder");
-        ogg_stream_clear(&s->os);
-        vorbis_block_clear(&s->vb);
-        vorbis_dsp_clear(&s->vd);
-        vorbis_comment_clear(&s->vc);
-        vorbis_info_clear(&s->vi);
+        if(s->passthrough)
+            LOG_INFO2("Reencoder passed %lu streams through, reencoded %lu",
+                    s->passed, s->reencoded);
+        encode_clear(s->encoder);
+        resample_clear(s->resamp);
+        downmix_clear(s->downmix);
+        decode_stream_release(s->stream);
+        free(s->out);
+        free(s->held);
 
         free(s);
     }
 }
 
-/* Returns: -1 fatal death failure, argh!
- *              0 haven't produced any output yet
- *             >0 success
+/* Finish the current output stream at the next page and start another,
+ * with headers, even though the input stream hasn't changed.
  */
-int reencode_page(reencode_state *s, ref_buffer *buf,
-        unsigned char **outbuf, int *outlen)
+void reencode_restart(reencode_state *s)
 {
-    ogg_page og, encog;
-    ogg_packet op;
-    int retbuflen=0, old;
-    unsigned char *retbuf=NULL;
+    decode_stream_release(s->stream);
+    s->stream = NULL;
+    s->restarting = 1;
+}
 
+/* Make room for need bytes in a buffer that only ever grows, so once it
+ * is big enough there are no more allocations. */
+static int reencode_grow(unsigned char **buf, int *size, int need)
+{
+    unsigned char *grown;
 
-    og.header_len = buf->aux_data;
-    og.body_len = buf->len - buf->aux_data;
-    og.header = buf->buf;
-    og.body = buf->buf + og.header_len;
+    if(need <= *size)
+        return 0;
+    grown = realloc(*buf, need * 3 / 2);
+    if(!grown)
+        return -1;
+    *buf = grown;
+    *size = need * 3 / 2;
+
+    return 0;
+}
 
-    if(s->current_serial != ogg_page_serialno(&og))
+/* Append a page to the output */
+static void reencode_add_page(reencode_state *s, ogg_page *og)
+{
+    int len = og->header_len + og->body_len;
+
+    if(reencode_grow(&s->out, &s->outsize, s->outlen + len) < 0)
     {
-        s->current_serial = ogg_page_serialno(&og);
+        LOG_ERROR0("Out of memory reencoding, page dropped");
+        return;
+    }
 
-        if(s->encoder)
-        {
-            if(s->resamp) {
-                resample_finish(s->resamp);
-                encode_data_float(s->encoder, s->resamp->buffers, 
-                        s->resamp->buffill);
-            }
-            encode_finish(s->encoder);
-            while(encode_flush(s->encoder, &encog) != 0)
-            {
-                old = retbuflen;
-                retbuflen += encog.header_len + encog.body_len;
-                retbuf = realloc(retbuf, retbuflen);
-                memcpy(retbuf+old, encog.header, encog.header_len);
-                memcpy(retbuf+old+encog.header_len, encog.body, 
-                        encog.body_len);
-            }
+    memcpy(s->out + s->outlen, og->header, og->header_len);
+    memcpy(s->out + s->outlen + og->header_len, og->body, og->body_len);
+    s->outlen += len;
+}
+
+/* Keep an input page from the headers of the stream it starts */
+static void reencode_hold_page(reencode_state *s, ref_buffer *buf)
+{
+    if(!s->passthrough)
+        return;
+
+    if(buf->critical)
+    {
+        s->heldlen = 0;
+        s->held_complete = 0;
+        s->held_overflow = 0;
+    }
+    if(s->held_complete || s->held_overflow)
+        return;
+
+    if(s->heldlen + buf->len > REENCODE_HOLD_MAX ||
+            reencode_grow(&s->held, &s->heldsize, s->heldlen + buf->len) < 0)
+    {
+        s->held_overflow = 1;
+        return;
+    }
+    memcpy(s->held + s->heldlen, buf->buf, buf->len);
+    s->heldlen += buf->len;
+}
+
+/* Page sink for stream_split_pages(): pass on the pages of our stream,
+ * leaving out anything multiplexed with it, as reencoding would. */
+static int reencode_pass_page(void *arg, ogg_page *og)
+{
+    reencode_state *s = arg;
+
+    if(ogg_page_serialno(og) == s->stream->serial)
+        reencode_add_page(s, og);
+    return 1;
+}
+
+/* Page sink for stream_split_pages(): stops, returning 0, at the first
+ * page of our stream. */
+static int reencode_find_bos(void *arg, ogg_page *og)
+{
+    reencode_state *s = arg;
+
+    return !(ogg_page_bos(og) && ogg_page_serialno(og) == s->stream->serial);
+}
+
+/* Whether a stream already fits the output settings: the same codec,
+ * samplerate and channels, and not more than the bitrate asked for. */
+static int reencode_can_pass(reencode_state *s, decode_stream *stream)
+{
+    long limit = s->out_nom_br > 0 ? s->out_nom_br : s->out_max_br;
+
+    if(!s->passthrough || !s->held_complete || s->held_overflow)
+        return 0;
+    /* the headers held have to be this stream's */
+    if(stream_split_pages(s->held, s->heldlen, reencode_find_bos, s) != 0)
+        return 0;
+
+    return s->out_codec == CODEC_VORBIS &&
+        stream->rate == s->out_samplerate &&
+        stream->channels == s->out_channels &&
+        stream->bitrate_nominal > 0 && stream->bitrate_nominal <= limit &&
+        (!s->managed || s->out_max_br <= 0 ||
+         (stream->bitrate_upper > 0 && stream->bitrate_upper <= s->out_max_br));
+}
+
+/* Finish off the encoder for the previous logical stream and set one up
+ * for the new one, or pass it through untouched if it fits. buf is the
+ * page it starts on. Returns -1 if the new stream can't be reencoded.
+ */
+static int reencode_new_stream(reencode_state *s, decode_stream *stream,
+        ref_buffer *buf)
+{
+    int new_stream = !s->restarting;
+    ogg_page encog;
+
+    if(s->encoder && !s->passing)
+    {
+        if(s->resamp) {
+            resample_finish(s->resamp);
+            encode_data_float(s->encoder, s->resamp->buffers, 
+                    s->resamp->buffill);
         }
-        encode_clear(s->encoder);
-        s->encoder = NULL;
-        resample_clear(s->resamp);
-        s->resamp = NULL;
-        downmix_clear(s->downmix);
-        s->downmix = NULL;
+        encode_finish(s->encoder);
+        while(encode_flush(s->encoder, &encog) != 0)
+            reencode_add_page(s, &encog);
+    }
+    resample_clear(s->resamp);
+    s->resamp = NULL;
+    downmix_clear(s->downmix);
+    s->downmix = NULL;
 
-        ogg_stream_clear(&s->os);
-        ogg_stream_init(&s->os, s->current_serial);
-        ogg_stream_pagein(&s->os, &og);
+    decode_stream_release(s->stream);
+    decode_stream_acquire(stream);
+    s->stream = stream;
+    s->restarting = 0;
 
-        vorbis_block_clear(&s->vb);
-        vorbis_dsp_clear(&s->vd);
-        vorbis_comment_clear(&s->vc);
-        vorbis_info_clear(&s->vi);
+    /* the last header page */
+    if(new_stream)
+    {
+        reencode_hold_page(s, buf);
+        s->held_complete = 1;
+    }
 
-        vorbis_info_init(&s->vi);
-        vorbis_comment_init(&s->vc);
+    s->passing = reencode_can_pass(s, stream);
+    if(s->passthrough && new_stream)
+    {
+        LOG_INFO4("%s stream: %d Hz, %d channels, nominal bitrate %ld",
+                s->passing ? "Passing through" : "Reencoding",
+                stream->rate, stream->channels, stream->bitrate_nominal);
+        if(s->passing)
+            s->passed++;
+        else
+            s->reencoded++;
+    }
+    if(s->passing)
+    {
+        /* the headers, then the page itself if it wasn't one */
+        stream_split_pages(s->held, s->heldlen, reencode_pass_page, s);
+        if(!new_stream)
+            stream_split_pages(buf->buf, buf->len, reencode_pass_page, s);
+        return 0;
+    }
+
+    LOG_DEBUG0("Reinitialising reencoder for new logical stream");
 
-        if(ogg_stream_packetout(&s->os, &op) != 1)
-        {
-            LOG_ERROR0("Invalid primary header in stream");
+    if(stream->channels != s->out_channels) {
+        if(stream->channels == 2 && s->out_channels == 1)
+            s->downmix = downmix_initialise();
+        else {
+            LOG_ERROR2("Converting from %d to %d channels is not"
+                    " currently supported", stream->channels,
+                    s->out_channels);
+            encode_clear(s->encoder);
+            s->encoder = NULL;
             return -1;
         }
+    }
+
+    /* the output settings are fixed, so an existing encoder only needs
+     * to start a new stream */
+    if(!s->encoder || encode_restart(s->encoder, &stream->vc) < 0)
+    {
+        encode_clear(s->encoder);
+        s->encoder = encode_initialise(s->out_codec, s->out_channels, 
+                s->out_samplerate, s->managed, 
+                s->out_min_br, s->out_nom_br, s->out_max_br,
+                s->quality, &stream->vc);
 
-        if(vorbis_synthesis_headerin(&s->vi, &s->vc, &op) < 0)
-        {
-            LOG_ERROR0("Input stream not vorbis, can't reencode");
+        if(!s->encoder) {
+            LOG_ERROR0("Failed to configure encoder for reencoding");
             return -1;
         }
+        s->encoder->max_samples_ppage = s->max_samples_ppage;
+        s->encoder->flush_latency = (uint64_t)s->latency_ms * 1000000;
+    }
+    if(stream->rate != s->out_samplerate) {
+        s->resamp = resample_initialise(s->out_channels,
+                stream->rate, s->out_samplerate);
+    }
 
-        s->need_headers = 2; /* We still need two more header packets */
-        LOG_DEBUG0("Reinitialising reencoder for new logical stream");
+    return 0;
+}
+
+/* Reencode the PCM the shared decoder attached to buf. The output
+ * belongs to s, and is only valid until the next call.
+ * Returns: -1 fatal death failure, argh!
+ *              0 haven't produced any output yet
+ *             >0 success
+ */
+int reencode_page(reencode_state *s, ref_buffer *buf,
+        unsigned char **outbuf, int *outlen)
+{
+    decoded_pcm *block = buf->pcm;
+    ogg_page encog;
+    float **pcm;
+    int samples;
+
+    s->outlen = 0;
+
+    /* headers, or a stream the decoder couldn't handle */
+    if(!block)
+    {
+        reencode_hold_page(s, buf);
+        return 0;
     }
-    else
+
+    if(block->stream != s->stream)
     {
-        ogg_stream_pagein(&s->os, &og);
-        while(ogg_stream_packetout(&s->os, &op) > 0)
-        {
-            if(s->need_headers)
-            {
-                vorbis_synthesis_headerin(&s->vi, &s->vc, &op);
-                /* If this was the last header, init the rest */
-                if(!--s->need_headers)
-                {
-                    vorbis_block_init(&s->vd, &s->vb);
-                    vorbis_synthesis_init(&s->vd, &s->vi);
-
-                    s->encoder = encode_initialise(s->out_channels, 
-                            s->out_samplerate, s->managed, 
-                            s->out_min_br, s->out_nom_br, s->out_max_br,
-                            s->quality, &s->vc);
-
-                    if(!s->encoder) {
-                        LOG_ERROR0("Failed to configure encoder for reencoding");
-                        return -1;
-                    }
-                    s->encoder->max_samples_ppage = s->max_samples_ppage;
-                    if(s->vi.rate != s->out_samplerate) {
-                        s->resamp = resample_initialise(s->out_channels,
-                                s->vi.rate, s->out_samplerate);
-                    }
-                    else
-                        s->resamp = NULL;
-
-                    if(s->vi.channels != s->out_channels) {
-                        if(s->vi.channels == 2 && s->out_channels == 1)
-                            s->downmix = downmix_initialise();
-                        else {
-                            LOG_ERROR2("Converting from %d to %d channels is not"
-                                    " currently supported", s->vi.channels,
-                                    s->out_channels);
-                            return -1;
-                        }
-                    }
-                    else
-                        s->downmix = NULL;
-                }
-            }
-            else
-            {
-                float **pcm;
-                int samples;
-
-
-                if(vorbis_synthesis(&s->vb, &op)==0)
-                {
-                    vorbis_synthesis_blockin(&s->vd, &s->vb);
-                }
-
-                while((samples = vorbis_synthesis_pcmout(&s->vd, &pcm))>0)
-                {
-                    if(s->downmix) {
-                        downmix_buffer_float(s->downmix, pcm, samples);
-                        if(s->resamp) {
-                            resample_buffer_float(s->resamp, &s->downmix->buffer,
-                                    samples);
-                            encode_data_float(s->encoder, s->resamp->buffers,
-                                    s->resamp->buffill);
-                        }
-                        else 
-                            encode_data_float(s->encoder, &s->downmix->buffer,
-                                    samples);
-                    }
-                    else if(s->resamp) {
-                        resample_buffer_float(s->resamp, pcm, samples);
-                        encode_data_float(s->encoder, s->resamp->buffers,
-                                s->resamp->buffill);
-                    }
-                    else
-                        encode_data_float(s->encoder, pcm, samples);
-                    vorbis_synthesis_read(&s->vd, samples);
-                }
-
-                while(encode_dataout(s->encoder, &encog) != 0)
-                {
-
-                    old = retbuflen;
-                    retbuflen += encog.header_len + encog.body_len;
-                    retbuf = realloc(retbuf, retbuflen);
-                    memcpy(retbuf+old, encog.header, encog.header_len);
-                    memcpy(retbuf+old+encog.header_len, encog.body, 
-                            encog.body_len);
-                }
+        if(reencode_new_stream(s, block->stream, buf) < 0)
+            return -1;
+        if(s->passing)
+            goto done;
+    }
+    else if(s->passing)
+    {
+        stream_split_pages(buf->buf, buf->len, reencode_pass_page, s);
+        goto done;
+    }
+    else if(!s->encoder) /* failed earlier, wait for the next stream */
+        return 0;
+
+    pcm = block->pcm;
+    samples = block->samples;
+    s->encoder->captured = buf->captured;
+
+    if(samples > 0)
+    {
+        if(s->downmix) {
+            downmix_buffer_float(s->downmix, pcm, samples);
+            if(s->resamp) {
+                resample_buffer_float(s->resamp, &s->downmix->buffer,
+                        samples);
+                encode_data_float(s->encoder, s->resamp->buffers,
+                        s->resamp->buffill);
             }
+            else 
+                encode_data_float(s->encoder, &s->downmix->buffer,
+                        samples);
+        }
+        else if(s->resamp) {
+            resample_buffer_float(s->resamp, pcm, samples);
+            encode_data_float(s->encoder, s->resamp->buffers,
+                    s->resamp->buffill);
         }
+        else
+            encode_data_float(s->encoder, pcm, samples);
     }
 
+    while(encode_dataout(s->encoder, &encog) != 0)
+        reencode_add_page(s, &encog);
+
+done:
     /* We've completed every packet from this page, so
      * now we can return what we wanted, depending on whether
      * we actually got data out or not
      */
-    if(retbuflen > 0)
+    if(s->outlen > 0)
     {
-        *outbuf = retbuf;
-        *outlen = retbuflen;
-        return retbuflen;
+        *outbuf = s->out;
+        *outlen = s->outlen;
+        return s->outlen;
     }
     else
     {
@@ -21,8 +21,10 @@
 #include "stream.h"
 #include "encode.h"
 #include "audio.h"
+#include "decode.h"
 
 typedef struct {
+    encode_codec out_codec;
     int out_min_br;
     int out_nom_br;
     int out_max_br;
@@ -32,28 +34,40 @@ typedef struct {
     int out_samplerate;
     int out_channels;
 
-    int in_samplerate;
-    int in_channels;
-
-    int current_serial;
-    int need_headers;
-
-    ogg_stream_state os;
-    vorbis_info vi;
-    vorbis_comment vc;
-    vorbis_dsp_state vd;
-    vorbis_block vb;
+    /* the decoded input stream currently being encoded */
+    decode_stream *stream;
     int max_samples_ppage;
+    int latency_ms;
 
     encoder_state *encoder;
     downmix_state *downmix;
     resample_state *resamp;
 
+    /* what reencode_page() returns, kept from call to call */
+    unsigned char *out;
+    int outlen;
+    int outsize;
+
+    /* Pass-through of input that already fits the output settings. The
+     * header pages of the current input stream are held until the
+     * decision can be made, and for a restart. */
+    int passthrough;
+    int passing;            /* the current stream is being passed through */
+    int restarting;
+    unsigned char *held;
+    int heldlen;
+    int heldsize;
+    int held_complete;      /* has every header page */
+    int held_overflow;      /* too much to hold, reencode */
+
+    unsigned long passed;   /* streams taking each path */
+    unsigned long reencoded;
 } reencode_state;
 
 reencode_state *reencode_init(instance_t *stream);
 int reencode_page(reencode_state *s, ref_buffer *buf,
         unsigned char **outbuf, int *outlen);
+void reencode_restart(reencode_state *s);
 void reencode_clear(reencode_state *s);
 
 
@@ -10,6 +10,13 @@
 #include <stdarg.h>
 #include <assert.h>
 
+#include <common/thread/thread.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+ #define RESAMPLE_X86
+ #include <immintrin.h>
+#endif
+
 #include "resample.h"
 
 /* Some systems don't define this */
@@ -17,6 +24,36 @@
 #define M_PI       3.14159265358979323846 
 #endif
 
+/* the vector kernels do 8 coefficients at a time */
+#define STRIDE_ALIGN 8
+
+/* silence pushed through to get the last of the input out */
+#define DRAIN_LENGTH(state) ((state)->taps / 2 - 1)
+
+/* tables kept while no resampler is using them */
+#define CACHE_IDLE_MAX 8
+
+/*
+ * A filter table depends only on the conversion and filter parameters, and
+ * building one takes a Bessel series per tap, so resamplers with the same
+ * parameters share one. Tables are never changed once built. Unused ones
+ * are kept for a while, most recently used first, as a reencoder changing
+ * track wants the same table again straight away.
+ */
+typedef struct resampler_table
+{
+    struct resampler_table *next;
+    unsigned int infreq, outfreq, taps;
+    double cutoff, beta, gain;
+    int refs;
+    int cached;
+    float coeffs[];
+} resampler_table;
+
+static resampler_table *cache;
+static mutex_t cache_lock;
+static int cache_ready;
+
 static int hcf(int arg1, int arg2)
 {
     int mult = 1;
@@ -129,6 +166,371 @@ static void win_kaiser(float *dest, int N, double alpha, int width)
 }
 
 
+/* Filters: one output frame, from count (a multiple of STRIDE_ALIGN)
+ * coefficients and the samples they apply to, starting at source for the
+ * first channel and every span samples after for the rest. Channels are
+ * done together where they can be, so each load of the coefficients
+ * serves several of them. These are the resampler's inner loop; the
+ * vector versions are picked by pick_filter().
+ */
+static void filter_mono_c(float const *coeff, SAMPLE const *source, size_t span, int count, int channels, SAMPLE *out)
+{
+    float a = 0.0, b = 0.0, c = 0.0, d = 0.0;
+    int i;
+
+    for (i = 0; i < count; i += 4)
+    {
+        a += coeff[i] * source[i];
+        b += coeff[i + 1] * source[i + 1];
+        c += coeff[i + 2] * source[i + 2];
+        d += coeff[i + 3] * source[i + 3];
+    }
+
+    *out = (a + b) + (c + d);
+}
+
+
+static void filter_c(float const *coeff, SAMPLE const *source, size_t span, int count, int channels, SAMPLE *out)
+{
+    int c;
+
+    for (c = 0; c < channels; c++)
+        filter_mono_c(coeff, source + c * span, span, count, 1, out + c);
+}
+
+#ifdef RESAMPLE_X86
+
+__attribute__((target("sse")))
+static inline float hsum_sse(__m128 v)
+{
+    v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+    v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 1));
+    return _mm_cvtss_f32(v);
+}
+
+__attribute__((target("avx")))
+static inline float hsum_avx(__m256 v)
+{
+    return hsum_sse(_mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1)));
+}
+
+/* a single channel has two chains of sums, to keep the adds busy */
+__attribute__((target("sse")))
+static void filter_mono_sse(float const *coeff, SAMPLE const *source, size_t span, int count, int channels, SAMPLE *out)
+{
+    __m128 a = _mm_setzero_ps(),
+        b = _mm_setzero_ps();
+    int i;
+
+    for (i = 0; i < count; i += 8)
+    {
+        a = _mm_add_ps(a, _mm_mul_ps(_mm_loadu_ps(coeff + i), _mm_loadu_ps(source + i)));
+        b = _mm_add_ps(b, _mm_mul_ps(_mm_loadu_ps(coeff + i + 4), _mm_loadu_ps(source + i + 4)));
+    }
+
+    *out = hsum_sse(_mm_add_ps(a, b));
+}
+
+__attribute__((target("avx")))
+static void filter_mono_avx(float const *coeff, SAMPLE const *source, size_t span, int count, int channels, SAMPLE *out)
+{
+    __m256 a = _mm256_setzero_ps();
+    int i;
+
+    for (i = 0; i < count; i += 8)
+        a = _mm256_add_ps(a, _mm256_mul_ps(_mm256_loadu_ps(coeff + i), _mm256_loadu_ps(source + i)));
+
+    *out = hsum_avx(a);
+}
+
+__attribute__((target("avx,fma")))
+static void filter_mono_fma(float const *coeff, SAMPLE const *source, size_t span, int count, int channels, SAMPLE *out)
+{
+    __m256 a = _mm256_setzero_ps(),
+        b = _mm256_setzero_ps();
+    int i = 0;
+
+    for (; i + 16 <= count; i += 16)
+    {
+        a = _mm256_fmadd_ps(_mm256_loadu_ps(coeff + i), _mm256_loadu_ps(source + i), a);
+        b = _mm256_fmadd_ps(_mm256_loadu_ps(coeff + i + 8), _mm256_loadu_ps(source + i + 8), b);
+    }
+    if (i < count)
+        a = _mm256_fmadd_ps(_mm256_loadu_ps(coeff + i), _mm256_loadu_ps(source + i), a);
+
+    *out = hsum_avx(_mm256_add_ps(a, b));
+}
+
+/* n (up to 4) channels sharing each load of the coefficients; the tests
+ * on n go at compile time */
+#define FILTER_GROUP_SSE(n) \
+__attribute__((target("sse"))) \
+static inline void filter##n##_sse(float const *coeff, SAMPLE const *source, size_t span, int count, SAMPLE *out) \
+{ \
+    __m128 a = _mm_setzero_ps(), \
+        b = _mm_setzero_ps(), \
+        c = _mm_setzero_ps(), \
+        d = _mm_setzero_ps(), \
+        k; \
+    int i; \
+\
+    for (i = 0; i < count; i += 4) \
+    { \
+        k = _mm_loadu_ps(coeff + i); \
+        a = _mm_add_ps(a, _mm_mul_ps(k, _mm_loadu_ps(source + i))); \
+        if (n > 1) \
+            b = _mm_add_ps(b, _mm_mul_ps(k, _mm_loadu_ps(source + span + i))); \
+        if (n > 2) \
+            c = _mm_add_ps(c, _mm_mul_ps(k, _mm_loadu_ps(source + 2 * span + i))); \
+        if (n > 3) \
+            d = _mm_add_ps(d, _mm_mul_ps(k, _mm_loadu_ps(source + 3 * span + i))); \
+    } \
+    out[0] = hsum_sse(a); \
+    if (n > 1) \
+        out[1] = hsum_sse(b); \
+    if (n > 2) \
+        out[2] = hsum_sse(c); \
+    if (n > 3) \
+        out[3] = hsum_sse(d); \
+}
+
+#define FILTER_GROUP_FMA(n) \
+__attribute__((target("avx,fma"))) \
+static inline void filter##n##_fma(float const *coeff, SAMPLE const *source, size_t span, int count, SAMPLE *out) \
+{ \
+    __m256 a = _mm256_setzero_ps(), \
+        b = _mm256_setzero_ps(), \
+        c = _mm256_setzero_ps(), \
+        d = _mm256_setzero_ps(), \
+        k; \
+    int i; \
+\
+    for (i = 0; i < count; i += 8) \
+    { \
+        k = _mm256_loadu_ps(coeff + i); \
+        a = _mm256_fmadd_ps(k, _mm256_loadu_ps(source + i), a); \
+        if (n > 1) \
+            b = _mm256_fmadd_ps(k, _mm256_loadu_ps(source + span + i), b); \
+        if (n > 2) \
+            c = _mm256_fmadd_ps(k, _mm256_loadu_ps(source + 2 * span + i), c); \
+        if (n > 3) \
+            d = _mm256_fmadd_ps(k, _mm256_loadu_ps(source + 3 * span + i), d); \
+    } \
+    out[0] = hsum_avx(a); \
+    if (n > 1) \
+        out[1] = hsum_avx(b); \
+    if (n > 2) \
+        out[2] = hsum_avx(c); \
+    if (n > 3) \
+        out[3] = hsum_avx(d); \
+}
+
+FILTER_GROUP_SSE(2)
+FILTER_GROUP_SSE(3)
+FILTER_GROUP_SSE(4)
+FILTER_GROUP_FMA(2)
+FILTER_GROUP_FMA(3)
+FILTER_GROUP_FMA(4)
+
+/* more channels go four at a time (5.1 is four, then two) */
+#define FILTER_MULTI(isa, target_isa) \
+__attribute__((target(target_isa))) \
+static void filter_multi_##isa(float const *coeff, SAMPLE const *source, size_t span, int count, int channels, SAMPLE *out) \
+{ \
+    int c = 0; \
+\
+    for (; channels - c >= 4 && channels - c != 6; c += 4) \
+        filter4_##isa(coeff, source + c * span, span, count, out + c); \
+    switch (channels - c) \
+    { \
+    case 6: \
+        filter3_##isa(coeff, source + c * span, span, count, out + c); \
+        filter3_##isa(coeff, source + (c + 3) * span, span, count, out + c + 3); \
+        break; \
+    case 3: \
+        filter3_##isa(coeff, source + c * span, span, count, out + c); \
+        break; \
+    case 2: \
+        filter2_##isa(coeff, source + c * span, span, count, out + c); \
+        break; \
+    case 1: \
+        filter_mono_##isa(coeff, source + c * span, span, count, 1, out + c); \
+        break; \
+    } \
+}
+
+FILTER_MULTI(sse, "sse")
+FILTER_MULTI(fma, "avx,fma")
+
+#endif /* RESAMPLE_X86 */
+
+
+static resampler_filter pick_filter(int channels)
+{
+#ifdef RESAMPLE_X86
+    int avx, fma;
+
+    __builtin_cpu_init();
+    avx = __builtin_cpu_supports("avx");
+    fma = avx && __builtin_cpu_supports("fma");
+    if (channels == 1)
+    {
+        if (fma)
+            return filter_mono_fma;
+        if (avx)
+            return filter_mono_avx;
+        if (__builtin_cpu_supports("sse"))
+            return filter_mono_sse;
+    }
+    else
+    {
+        if (fma)
+            return filter_multi_fma;
+        if (__builtin_cpu_supports("sse"))
+            return filter_multi_sse;
+    }
+#endif
+    return channels == 1 ? filter_mono_c : filter_c;
+}
+
+
+static resampler_table *table_build(unsigned int infreq, unsigned int outfreq, unsigned int taps, unsigned int stride, double cutoff, double beta, double gain)
+{
+    resampler_table *shared;
+    float *table;
+    unsigned int phase, i;
+
+    if ((table = calloc(outfreq * taps, sizeof(float))) == NULL)
+        return NULL;
+    if ((shared = calloc(1, sizeof(resampler_table) + outfreq * stride * sizeof(float))) == NULL)
+    {
+        free(table);
+        return NULL;
+    }
+
+    shared->infreq = infreq;
+    shared->outfreq = outfreq;
+    shared->taps = taps;
+    shared->cutoff = cutoff;
+    shared->beta = beta;
+    shared->gain = gain;
+    shared->refs = 1;
+
+    filt_sinc(table, outfreq * taps, outfreq, cutoff, gain, taps);
+    win_kaiser(table, outfreq * taps, beta, taps);
+
+    /* each phase's taps apply newest sample first; turn them round to
+     * line up with the pool, oldest first */
+    for (phase = 0; phase < outfreq; phase++)
+        for (i = 0; i < taps; i++)
+            shared->coeffs[phase * stride + stride - 1 - i] = table[phase * taps + i];
+    free(table);
+
+    return shared;
+}
+
+
+/* drop the least recently used of the tables nothing is using */
+static void cache_trim(void)
+{
+    resampler_table **prev = &cache,
+        *shared;
+    int idle = 0;
+
+    while ((shared = *prev) != NULL)
+    {
+        if (shared->refs == 0 && ++idle > CACHE_IDLE_MAX)
+        {
+            *prev = shared->next;
+            free(shared);
+        }
+        else
+            prev = &shared->next;
+    }
+}
+
+
+static resampler_table *table_acquire(unsigned int infreq, unsigned int outfreq, unsigned int taps, unsigned int stride, double cutoff, double beta, double gain)
+{
+    resampler_table **prev,
+        *shared;
+
+    if (!cache_ready)
+        return table_build(infreq, outfreq, taps, stride, cutoff, beta, gain);
+
+    thread_mutex_lock(&cache_lock);
+    for (prev = &cache; (shared = *prev) != NULL; prev = &shared->next)
+    {
+        if (shared->infreq == infreq && shared->outfreq == outfreq &&
+                shared->taps == taps && shared->cutoff == cutoff &&
+                shared->beta == beta && shared->gain == gain)
+        {
+            *prev = shared->next;
+            shared->refs++;
+            break;
+        }
+    }
+    if (shared == NULL &&
+            (shared = table_build(infreq, outfreq, taps, stride, cutoff, beta, gain)) != NULL)
+        shared->cached = 1;
+    if (shared != NULL)
+    {
+        shared->next = cache;
+        cache = shared;
+        cache_trim();
+    }
+    thread_mutex_unlock(&cache_lock);
+
+    return shared;
+}
+
+
+static void table_release(resampler_table *shared)
+{
+    int refs;
+
+    if (cache_ready)
+        thread_mutex_lock(&cache_lock);
+    refs = --shared->refs;
+    if (refs == 0 && shared->cached)
+        cache_trim();
+    if (cache_ready)
+        thread_mutex_unlock(&cache_lock);
+
+    if (refs == 0 && !shared->cached)
+        free(shared);
+}
+
+
+void resampler_cache_init(void)
+{
+    thread_mutex_create(&cache_lock);
+    cache_ready = 1;
+}
+
+
+void resampler_cache_clear(void)
+{
+    resampler_table *shared;
+
+    if (!cache_ready)
+        return;
+
+    /* anything still in use is freed by its last resampler */
+    thread_mutex_lock(&cache_lock);
+    while ((shared = cache) != NULL)
+    {
+        cache = shared->next;
+        shared->cached = 0;
+        if (shared->refs == 0)
+            free(shared);
+    }
+    cache_ready = 0;
+    thread_mutex_unlock(&cache_lock);
+    thread_mutex_destroy(&cache_lock);
+}
+
+
 int resampler_init(resampler_state *state, int channels, int outfreq, int infreq, resampler_parameter op1, ...)
 {
     double beta = 16.0,
@@ -136,7 +538,7 @@ int resampler_init(resampler_state *state, int channels, int outfreq, int infreq
         gain = 1.0;
     int taps = 45;
 
-    int factor;
+    int factor, stride;
 
     assert(state);
     assert(channels > 0);
@@ -199,12 +601,17 @@ int resampler_init(resampler_state *state, int channels, int outfreq, int infreq
 
     assert(taps >= (infreq + outfreq - 1) / outfreq);
 
-    if ((state->table = calloc(outfreq * taps, sizeof(float))) == NULL)
+    stride = (taps + STRIDE_ALIGN - 1) / STRIDE_ALIGN * STRIDE_ALIGN;
+
+    if ((state->shared = table_acquire(infreq, outfreq, taps, stride, cutoff, beta, gain)) == NULL)
         return -1;
-    if ((state->pool = calloc(channels * taps, sizeof(SAMPLE))) == NULL)
+    if ((state->pool = calloc(channels * (stride + RESAMPLER_BLOCK), sizeof(SAMPLE))) == NULL ||
+            (state->frame = calloc(channels, sizeof(SAMPLE))) == NULL)
     {
-        free(state->table);
-        state->table = NULL;
+        free(state->pool);
+        state->pool = NULL;
+        table_release(state->shared);
+        state->shared = NULL;
         return -1;
     }
 
@@ -213,109 +620,144 @@ int resampler_init(resampler_state *state, int channels, int outfreq, int infreq
     state->outfreq = outfreq;
     state->infreq = infreq;
     state->taps = taps;
+    state->stride = stride;
     state->offset = 0;
-
-    filt_sinc(state->table, outfreq * taps, outfreq, cutoff, gain, taps);
-    win_kaiser(state->table, outfreq * taps, beta, taps);
+    state->table = state->shared->coeffs;
+    state->filter = pick_filter(channels);
 
     return 0;
 }
 
 
-static SAMPLE sum(float const *scale, int count, SAMPLE const *source, SAMPLE const *trigger, SAMPLE const *reset, int srcstep)
-{
-    float total = 0.0;
-
-    while (count--)
-    {
-        total += *source * *scale;
-
-        if (source == trigger)
-            source = reset, srcstep = 1;
-        source -= srcstep;
-        scale++;
-    }
-
-    return total;
-}
-
-
-static int push(resampler_state const * const state, SAMPLE *pool, int * const poolfill, int * const offset, SAMPLE *dest, int dststep, SAMPLE const *source, int srcstep, size_t srclen)
+/* The pool holds each channel's input in order, so the taps for any
+ * output are contiguous. The first taps samples of history (poolfill of
+ * which have arrived) come before the next output's newest sample; input
+ * is appended a block at a time by fill, every output whose samples have
+ * all arrived is produced, for all the channels at once, and the history
+ * for the next block is moved back to the start. Output goes to dest,
+ * interleaved, or else to dstlist.
+ */
+static int push(resampler_state * const state, SAMPLE **dstlist, SAMPLE *dest, resampler_fill fill, void *arg, size_t srclen)
 {
-    SAMPLE    * const destbase = dest,
-        *poolhead = pool + *poolfill,
-        *poolend = pool + state->taps,
-        *newpool = pool;
-    SAMPLE const *refill, *base, *endpoint;
-    int    lencheck;
+    int    const channels = state->channels,
+        taps = state->taps,
+        stride = state->stride,
+        infreq = state->infreq,
+        outfreq = state->outfreq,
+        room = taps + RESAMPLER_BLOCK;
+    size_t    const span = stride + RESAMPLER_BLOCK;
+    SAMPLE    * const history = state->pool + stride - taps,
+        *heads[channels],
+        *out;
+    int    poolfill = state->poolfill,
+        offset = state->offset,
+        done = 0,
+        lencheck, pos, count, c;
 
 
     assert(state);
-    assert(pool);
-    assert(poolfill);
-    assert(dest);
-    assert(source);
+    assert(dstlist || dest);
+    assert(fill);
 
     assert(state->poolfill != -1);
 
     lencheck = resampler_push_check(state, srclen);
 
-    /* fill the pool before diving in */
-    while (poolhead < poolend && srclen > 0)
+    while (srclen > 0)
     {
-        *poolhead++ = *source;
-        source += srcstep;
-        srclen--;
-    }
-
-    if (srclen <= 0)
-        return 0;
-
-    base = source;
-    endpoint = source + srclen * srcstep;
+        count = (size_t)(room - poolfill) < srclen ? room - poolfill : (int)srclen;
+        for (c = 0; c < channels; c++)
+            heads[c] = history + c * span + poolfill;
+        fill(arg, heads, count);
+        poolfill += count;
+        srclen -= count;
+
+        /* pos is the newest sample of the next output */
+        for (pos = taps; pos < poolfill; done++)
+        {
+            if (dest)
+                out = dest + done * channels;
+            else if (channels == 1)
+                out = dstlist[0] + done;
+            else
+                out = state->frame;
+            state->filter(state->table + offset * stride, history + pos + 1 - stride, span, stride, channels, out);
+            if (out == state->frame)
+                for (c = 0; c < channels; c++)
+                    dstlist[c][done] = out[c];
+
+            offset += infreq;
+            while (offset >= outfreq)
+            {
+                offset -= outfreq;
+                pos++;
+            }
+        }
 
-    while (source < endpoint)
-    {
-        *dest = sum(state->table + *offset * state->taps, state->taps, source, base, poolend, srcstep);
-        dest += dststep;
-        *offset += state->infreq;
-        while (*offset >= state->outfreq)
+        /* keep the taps before pos, which may be fewer than taps if pos
+         * has run past the input we have */
+        if (pos > taps)
         {
-            *offset -= state->outfreq;
-            source += srcstep;
+            for (c = 0; c < channels; c++)
+                memmove(history + c * span, history + c * span + pos - taps, (poolfill - pos + taps) * sizeof(SAMPLE));
+            poolfill -= pos - taps;
         }
     }
 
-    assert(dest == destbase + lencheck * dststep);
+    assert(done == lencheck);
+    assert(poolfill > 0);
+    assert(poolfill <= taps);
 
-    /* pretend that source has that underrun data we're not going to get */
-    srclen += (source - endpoint) / srcstep;
+    state->poolfill = poolfill;
+    state->offset = offset;
 
-    /* if we didn't get enough to completely replace the pool, then shift things about a bit */
-    if (srclen < state->taps)
-    {
-        refill = pool + srclen;
-        while (refill < poolend)
-            *newpool++ = *refill++;
+    return done;
+}
 
-        refill = source - srclen * srcstep;
-    }
-    else
-        refill = source - state->taps * srcstep;
 
-    /* pull in fresh pool data */
-    while (refill < endpoint)
-    {
-        *newpool++ = *refill;
-        refill += srcstep;
-    }
+typedef struct
+{
+    SAMPLE const **srclist;
+    int channels;
+    size_t done;
+} planar_source;
 
-    assert(newpool > pool);
-    assert(newpool <= poolend);
+static void fill_planar(void *arg, SAMPLE **dest, size_t frames)
+{
+    planar_source *source = arg;
+    int c;
 
-    *poolfill = newpool - pool;
+    for (c = 0; c < source->channels; c++)
+        memcpy(dest[c], source->srclist[c] + source->done, frames * sizeof(SAMPLE));
+    source->done += frames;
+}
+
+
+typedef struct
+{
+    SAMPLE const *source;
+    int channels;
+} interleaved_source;
+
+static void fill_interleaved(void *arg, SAMPLE **dest, size_t frames)
+{
+    interleaved_source *source = arg;
+    size_t i;
+    int c;
 
-    return (dest - destbase) / dststep;
+    for (i = 0; i < frames; i++)
+        for (c = 0; c < source->channels; c++)
+            dest[c][i] = *source->source++;
+}
+
+
+static void fill_silence(void *arg, SAMPLE **dest, size_t frames)
+{
+    int const *channels = arg;
+    int c;
+
+    for (c = 0; c < *channels; c++)
+        memset(dest[c], 0, frames * sizeof(SAMPLE));
 }
 
 
@@ -328,7 +770,11 @@ int resampler_push_max_input(resampler_state const * const state, size_t maxoutp
 int resampler_push_check(resampler_state const * const state, size_t srclen)
 {
     if (state->poolfill < state->taps)
+    {
+        if (srclen <= state->taps - state->poolfill)
+            return 0;
         srclen -= state->taps - state->poolfill;
+    }
 
     return (srclen * state->outfreq - state->offset + state->infreq - 1) / state->infreq;
 }
@@ -336,69 +782,56 @@ int resampler_push_check(resampler_state const * const state, size_t srclen)
 
 int resampler_push(resampler_state *state, SAMPLE **dstlist, SAMPLE const **srclist, size_t srclen)
 {
-    int result = -1, poolfill = -1, offset = -1, i;
+    planar_source source = { srclist, state->channels, 0 };
 
     assert(state);
     assert(dstlist);
     assert(srclist);
     assert(state->poolfill >= 0);
 
-    for (i = 0; i < state->channels; i++)
-    {
-        poolfill = state->poolfill;
-        offset = state->offset;
-        result = push(state, state->pool + i * state->taps, &poolfill, &offset, dstlist[i], 1, srclist[i], 1, srclen);
-    }
-    state->poolfill = poolfill;
-    state->offset = offset;
-
-    return result;
+    return push(state, dstlist, NULL, fill_planar, &source, srclen);
 }
 
 
 int resampler_push_interleaved(resampler_state *state, SAMPLE *dest, SAMPLE const *source, size_t srclen)
 {
-    int result = -1, poolfill = -1, offset = -1, i;
+    interleaved_source src = { source, state->channels };
 
     assert(state);
     assert(dest);
     assert(source);
     assert(state->poolfill >= 0);
 
-    for (i = 0; i < state->channels; i++)
-    {
-        poolfill = state->poolfill;
-        offset = state->offset;
-        result = push(state, state->pool + i * state->taps, &poolfill, &offset, dest + i, state->channels, source + i, state->channels, srclen);
-    }
-    state->poolfill = poolfill;
-    state->offset = offset;
-
-    return result;
+    return push(state, NULL, dest, fill_interleaved, &src, srclen);
 }
 
 
-int resampler_drain(resampler_state *state, SAMPLE **dstlist)
+int resampler_push_fill(resampler_state *state, SAMPLE **dstlist, resampler_fill fill, void *arg, size_t srclen)
 {
-    SAMPLE *tail;
-    int result = -1, poolfill = -1, offset = -1, i;
-
     assert(state);
     assert(dstlist);
+    assert(fill);
     assert(state->poolfill >= 0);
 
-    if ((tail = calloc(state->taps, sizeof(SAMPLE))) == NULL)
-        return -1;
+    return push(state, dstlist, NULL, fill, arg, srclen);
+}
 
-    for (i = 0; i < state->channels; i++)
-    {
-        poolfill = state->poolfill;
-        offset = state->offset;
-        result = push(state, state->pool + i * state->taps, &poolfill, &offset, dstlist[i], 1, tail, 1, state->taps / 2 - 1);
-    }
 
-    free(tail);
+int resampler_drain_check(resampler_state const * const state)
+{
+    return resampler_push_check(state, DRAIN_LENGTH(state));
+}
+
 
+int resampler_drain(resampler_state *state, SAMPLE **dstlist)
+{
+    int result, channels = state->channels;
+
+    assert(state);
+    assert(dstlist);
+    assert(state->poolfill >= 0);
+
+    result = push(state, dstlist, NULL, fill_silence, &channels, DRAIN_LENGTH(state));
     state->poolfill = -1;
 
     return result;
@@ -407,25 +840,13 @@ int resampler_drain(resampler_state *state, SAMPLE **dstlist)
 
 int resampler_drain_interleaved(resampler_state *state, SAMPLE *dest)
 {
-    SAMPLE *tail;
-    int result = -1, poolfill = -1, offset = -1, i;
+    int result, channels = state->channels;
 
     assert(state);
     assert(dest);
     assert(state->poolfill >= 0);
 
-    if ((tail = calloc(state->taps, sizeof(SAMPLE))) == NULL)
-        return -1;
-
-    for (i = 0; i < state->channels; i++)
-    {
-        poolfill = state->poolfill;
-        offset = state->offset;
-        result = push(state, state->pool + i * state->taps, &poolfill, &offset, dest + i, state->channels, tail, 1, state->taps / 2 - 1);
-    }
-
-    free(tail);
-
+    result = push(state, NULL, dest, fill_silence, &channels, DRAIN_LENGTH(state));
     state->poolfill = -1;
 
     return result;
@@ -435,10 +856,11 @@ int resampler_drain_interleaved(resampler_state *state, SAMPLE *dest)
 void resampler_clear(resampler_state *state)
 {
     assert(state);
-    assert(state->table);
+    assert(state->shared);
     assert(state->pool);
 
-    free(state->table);
+    table_release(state->shared);
     free(state->pool);
+    free(state->frame);
     memset(state, 0, sizeof(*state));
 }
@@ -22,11 +22,30 @@
 
 typedef float SAMPLE;
 
+/* input samples per channel taken into the pool at a time */
+#define RESAMPLER_BLOCK 1024
+
+struct resampler_table;
+
+typedef void (*resampler_filter)(float const *coeff, SAMPLE const *source, size_t span, int count, int channels, SAMPLE *out);
+typedef void (*resampler_fill)(void *arg, SAMPLE **dest, size_t frames);
+
 typedef struct
 {
     unsigned int channels, infreq, outfreq, taps;
-    float *table;
+    /* taps rounded up to whole vectors */
+    unsigned int stride;
+    /* stride coefficients per phase, reversed and zero padded at the front
+     * so that each output is a plain dot product with the input. Shared
+     * with other resamplers using the same filter, so never written. */
+    float const *table;
+    struct resampler_table *shared;
+    /* per channel, stride + RESAMPLER_BLOCK samples: the last taps of
+     * history after stride - taps zeros, then room for the next block */
     SAMPLE *pool;
+    /* one output frame */
+    SAMPLE *frame;
+    resampler_filter filter;
 
     /* dynamic bits */
     int poolfill;
@@ -75,6 +94,7 @@ int resampler_push_check(resampler_state const *state, size_t srclen);
 
 int resampler_push(resampler_state *state, SAMPLE **dstlist, SAMPLE const **srclist, size_t srclen);
 int resampler_push_interleaved(resampler_state *state, SAMPLE *dest, SAMPLE const *source, size_t srclen);
+int resampler_push_fill(resampler_state *state, SAMPLE **dstlist, resampler_fill fill, void *arg, size_t srclen);
 /*
  * Pushes srclen samples into the front end of the filter, and returns the
  * number of resulting samples.
@@ -84,6 +104,16 @@ int resampler_push_interleaved(resampler_state *state, SAMPLE *dest, SAMPLE cons
  *
  * resampler_push_interleaved(): source and dest point to the beginning of a list of
  * interleaved samples.
+ *
+ * resampler_push_fill(): fill is called with arg to write the next frames of
+ * input straight into the filter, one pointer per channel; for input that
+ * needs converting anyway.  Output goes to dstlist as for resampler_push().
+ */
+
+
+int resampler_drain_check(resampler_state const *state);
+/*
+ * Returns the number of elements that resampler_drain() will return.
  */
 
 
@@ -103,4 +133,13 @@ void resampler_clear(resampler_state *state);
  * Free allocated buffers, etc.
  */
 
+
+void resampler_cache_init(void);
+void resampler_cache_clear(void);
+/*
+ * Start and stop sharing filter tables between resamplers.  Both must be
+ * called while no other thread is using the resampler; resamplers set up
+ * without the cache each build their own table.
+ */
+
 #endif
@@ -65,8 +65,9 @@ static void signal_int_handler(int signum)
     /* Is a mutex needed here? Probably */
     if (!ices_config->shutdown) {
         LOG_INFO0("Shutdown requested...");
+        /* instances notice this within a quarter second, and the input
+         * loop wakes them as soon as it sees it */
         ices_config->shutdown = 1;
-        thread_cond_broadcast(&ices_config->queue_cond);
 
         /* If user gives a second sigint, just die. */
         signal(SIGINT, SIG_DFL);
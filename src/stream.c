@@ -35,6 +35,8 @@
 #include "inputmodule.h"
 #include "stream_shared.h"
 #include "stream.h"
+#include "queue.h"
+#include "preroll.h"
 
 #include <ogg/ogg.h>
 #include <vorbis/codec.h>
@@ -44,6 +46,85 @@
 
 #define MAX_ERRORS 10
 
+/* Drop the server connection and try to establish a new one. Nothing is
+ * queued for this instance while we do this, or we'd overflow once the
+ * reconnect succeeds. Returns 0 if reconnected (or shutting down), -1 if
+ * we gave up.
+ */
+static int stream_reconnect(stream_description *sdsc)
+{
+    instance_t *stream = sdsc->stream;
+    int i = 0, ret;
+
+    thread_mutex_lock(&ices_config->flush_lock);
+    stream->skip = 1;
+    input_flush_queue(stream->queue, 1);
+    thread_mutex_unlock(&ices_config->flush_lock);
+
+    shout_close(sdsc->shout);
+    stream_send_discard(sdsc);
+
+    if (stream->reconnect_attempts == 0)
+        return -1;
+
+    while((i < stream->reconnect_attempts ||
+            stream->reconnect_attempts==-1) && 
+            !ices_config->shutdown)
+    {
+        i++;
+        if(shout_open(sdsc->shout) == SHOUTERR_SUCCESS)
+        {
+            LOG_INFO3("Connected to server: %s:%d%s", 
+                    shout_get_host(sdsc->shout), shout_get_port(sdsc->shout), 
+                    shout_get_mount(sdsc->shout));
+            /* With a pre-roll the server gets the headers from it, and we
+             * can carry on straight away. Otherwise this stream can't
+             * restart until the next logical stream comes along, since the
+             * server won't have any cached headers for this
+             * source/connection. So, don't continue yet.
+             */
+            ret = preroll_send(sdsc->preroll, sdsc->shout);
+            if(ret == 0)
+                LOG_WARN1("Failed to send pre-roll: %s",
+                        shout_get_error(sdsc->shout));
+            thread_mutex_lock(&ices_config->flush_lock);
+            atomic_store(&stream->wait_for_critical, ret <= 0);
+            stream_pace_reset(sdsc);
+            input_flush_queue(stream->queue, 0);
+            stream->skip = 0;
+            thread_mutex_unlock(&ices_config->flush_lock);
+            return 0;
+        }
+
+        LOG_ERROR3("Failed to reconnect to %s:%d (%s)",
+            shout_get_host(sdsc->shout),shout_get_port(sdsc->shout),
+            shout_get_error(sdsc->shout));
+        if(i==stream->reconnect_attempts)
+        {
+            LOG_ERROR0("Reconnect failed too many times, giving up.");
+            return -1;
+        }
+        /* Don't try again too soon */
+        thread_sleep (stream->reconnect_delay*1000000); 
+    }
+
+    return 0;
+}
+
+static void stream_free_description(stream_description *sdsc)
+{
+    if(sdsc->shout)
+        shout_free(sdsc->shout);
+    encode_clear(sdsc->enc);
+    reencode_clear(sdsc->reenc);
+    downmix_clear(sdsc->downmix);
+    resample_clear(sdsc->resamp);
+    preroll_clear(sdsc->preroll);
+    vorbis_comment_clear(&sdsc->vc);
+    free(sdsc->send.buf);
+    free(sdsc);
+}
+
 /* The main loop for each instance. Gets data passed to it from the stream
  * manager (which gets it from the input module), and streams it to the
  * specified server
@@ -51,6 +132,7 @@
 void *ices_instance_stream(void *arg)
 {
     int ret, shouterr, initial_attempts;
+    uint64_t send_start;
     ref_buffer *buffer;
     stream_description *sdsc = arg;
     instance_t *stream = sdsc->stream;
@@ -64,6 +146,11 @@ void *ices_instance_stream(void *arg)
     vorbis_comment_init(&sdsc->vc);
 
     sdsc->shout = shout_new();
+    if(!sdsc->shout)
+    {
+        LOG_ERROR0("Failed to allocate libshout state");
+        goto setup_failed;
+    }
 
     /* we only support the ice protocol */
     shout_set_protocol(sdsc->shout, SHOUT_PROTOCOL_HTTP);
@@ -71,19 +158,24 @@ void *ices_instance_stream(void *arg)
     switch (inmod->type) {
         case ICES_INPUT_UNKNOWN:
             LOG_ERROR0("Unknown stream type.\n");
-            stream->died = 1;
-            return NULL;
-            break;
+            goto setup_failed;
         case ICES_INPUT_VORBIS:
-            shout_set_format(sdsc->shout, SHOUT_FORMAT_VORBIS);
-            reencoding = stream->encode;
+            /* libshout's vorbis format only knows Vorbis */
+            shout_set_format(sdsc->shout, stream->encode &&
+                    stream->codec == CODEC_OPUS ? SHOUT_FORMAT_OGG :
+                    SHOUT_FORMAT_VORBIS);
+            /* a shared encoder does the work for grouped instances */
+            reencoding = stream->encode && !stream->encode_group;
             break;
         case ICES_INPUT_OGG:
             shout_set_format(sdsc->shout, SHOUT_FORMAT_OGG);
             break;
         case ICES_INPUT_PCM:
-            shout_set_format(sdsc->shout, SHOUT_FORMAT_VORBIS);
-            encoding = stream->encode;
+            shout_set_format(sdsc->shout, stream->encode &&
+                    stream->codec == CODEC_OPUS ? SHOUT_FORMAT_OGG :
+                    SHOUT_FORMAT_VORBIS);
+            /* a shared encoder does the work for grouped instances */
+            encoding = stream->encode && !stream->encode_group;
             break;
     }
 
@@ -93,8 +185,7 @@ void *ices_instance_stream(void *arg)
 
     if (!(shout_set_host(sdsc->shout, stream->hostname)) == SHOUTERR_SUCCESS) {
         LOG_ERROR1("libshout error: %s\n", shout_get_error(sdsc->shout));
-        stream->died = 1;
-        return NULL;
+        goto setup_failed;
     }
 
     shout_set_port(sdsc->shout, stream->port);
@@ -102,44 +193,38 @@ void *ices_instance_stream(void *arg)
 #if SHOUT_TLS
     if (!(shout_set_tls(sdsc->shout, stream->tls)) == SHOUTERR_SUCCESS) {
         LOG_ERROR1("libshout error: %s\n", shout_get_error(sdsc->shout));
-        stream->died = 1;
-        return NULL;
+        goto setup_failed;
     }
 
     if (stream->ca_directory)
         if (!(shout_set_ca_directory(sdsc->shout, stream->ca_directory)) == SHOUTERR_SUCCESS) {
             LOG_ERROR1("libshout error: %s\n", shout_get_error(sdsc->shout));
-            stream->died = 1;
-            return NULL;
+            goto setup_failed;
         }
 
     if (stream->ca_file)
         if (!(shout_set_ca_file(sdsc->shout, stream->ca_file)) == SHOUTERR_SUCCESS) {
             LOG_ERROR1("libshout error: %s\n", shout_get_error(sdsc->shout));
-            stream->died = 1;
-            return NULL;
+            goto setup_failed;
         }
 
     if (stream->allowed_ciphers)
         if (!(shout_set_allowed_ciphers(sdsc->shout, stream->allowed_ciphers)) == SHOUTERR_SUCCESS) {
             LOG_ERROR1("libshout error: %s\n", shout_get_error(sdsc->shout));
-            stream->died = 1;
-            return NULL;
+            goto setup_failed;
         }
 
     if (stream->client_certificate)
         if (!(shout_set_client_certificate(sdsc->shout, stream->client_certificate)) == SHOUTERR_SUCCESS) {
             LOG_ERROR1("libshout error: %s\n", shout_get_error(sdsc->shout));
-            stream->died = 1;
-            return NULL;
+            goto setup_failed;
         }
 #endif
 
 
     if (!(shout_set_password(sdsc->shout, stream->password)) == SHOUTERR_SUCCESS) {
         LOG_ERROR1("libshout error: %s\n", shout_get_error(sdsc->shout));
-        stream->died = 1;
-        return NULL;
+        goto setup_failed;
     }
     if (stream->user)
         user = stream->user;
@@ -148,26 +233,22 @@ void *ices_instance_stream(void *arg)
 
     if(shout_set_user(sdsc->shout, user) != SHOUTERR_SUCCESS) {
         LOG_ERROR1("libshout error: %s\n", shout_get_error(sdsc->shout));
-        stream->died = 1;
-        return NULL;
+        goto setup_failed;
     }
 
     if (!(shout_set_agent(sdsc->shout, PACKAGE_STRING)) == SHOUTERR_SUCCESS) {
         LOG_ERROR1("libshout error: %s\n", shout_get_error(sdsc->shout));
-        stream->died = 1;
-        return NULL;
+        goto setup_failed;
     }
 
     if (!(shout_set_mount(sdsc->shout, stream->mount)) == SHOUTERR_SUCCESS) {
         LOG_ERROR1("libshout error: %s\n", shout_get_error(sdsc->shout));
-        stream->died = 1;
-        return NULL;
+        goto setup_failed;
     }
     if (shout_set_public (sdsc->shout, stream->public_stream & 1) != SHOUTERR_SUCCESS)
     {
         LOG_ERROR1("libshout error: %s\n", shout_get_error(sdsc->shout));
-        stream->died = 1;
-        return NULL;
+        goto setup_failed;
     }
 
     /* set the metadata for the stream */
@@ -194,26 +275,22 @@ void *ices_instance_stream(void *arg)
     if(stream_name)
         if (!(shout_set_name(sdsc->shout, stream_name)) == SHOUTERR_SUCCESS) {
             LOG_ERROR1("libshout error: %s\n", shout_get_error(sdsc->shout));
-            stream->died = 1;
-            return NULL;
+            goto setup_failed;
         }
     if (stream_genre)
         if (!(shout_set_genre(sdsc->shout, stream_genre)) == SHOUTERR_SUCCESS) {
             LOG_ERROR1("libshout error: %s\n", shout_get_error(sdsc->shout));
-            stream->died = 1;
-            return NULL;
+            goto setup_failed;
         }
     if (stream_description)
         if (!(shout_set_description(sdsc->shout, stream_description)) == SHOUTERR_SUCCESS) {
             LOG_ERROR1("libshout error: %s\n", shout_get_error(sdsc->shout));
-            stream->died = 1;
-            return NULL;
+            goto setup_failed;
         }
     if (stream_url)
         if (!(shout_set_url(sdsc->shout, stream_url) == SHOUTERR_SUCCESS)) {
             LOG_ERROR1("libshout error: %s\n", shout_get_error(sdsc->shout));
-            stream->died = 1;
-            return NULL;
+            goto setup_failed;
         }
 
     if(stream->downmix && encoding && stream->channels == 1) {
@@ -232,7 +309,7 @@ void *ices_instance_stream(void *arg)
     shout_set_audio_info(sdsc->shout, SHOUT_AI_SAMPLERATE, audio_info);
     snprintf(audio_info, sizeof(audio_info), "%d", stream->channels);
     shout_set_audio_info(sdsc->shout, SHOUT_AI_CHANNELS, audio_info);
-    if (stream->managed)
+    if (stream->managed || (stream->codec == CODEC_OPUS && stream->nom_br > 0))
     {
         snprintf(audio_info, sizeof(audio_info), "%d", stream->nom_br/1000);
         shout_set_audio_info(sdsc->shout, SHOUT_AI_BITRATE, audio_info);
@@ -247,21 +324,23 @@ void *ices_instance_stream(void *arg)
     {
         if(inmod->metadata_update)
             inmod->metadata_update(inmod->internal, &sdsc->vc);
-        sdsc->enc = encode_initialise(stream->channels, stream->samplerate,
-                stream->managed, stream->min_br, stream->nom_br, stream->max_br,
-                stream->quality, &sdsc->vc);
+        sdsc->enc = encode_initialise(stream->codec, stream->channels,
+                stream->samplerate, stream->managed, stream->min_br,
+                stream->nom_br, stream->max_br, stream->quality, &sdsc->vc);
         if(!sdsc->enc) {
             LOG_ERROR0("Failed to configure encoder");
-            stream->died = 1;
-            shout_free (sdsc->shout);
-            sdsc->shout = NULL;
-            return NULL; /* FIXME: probably leaking some memory here */
+            goto setup_failed;
         }
         sdsc->enc->max_samples_ppage = sdsc->stream->max_samples_ppage;
+        sdsc->enc->flush_latency = (uint64_t)stream->latency_ms * 1000000;
+        sdsc->encoding = 1;
     }
     else if(reencoding)
         sdsc->reenc = reencode_init(stream);
 
+    if(stream->preroll > 0)
+        sdsc->preroll = preroll_initialise(stream->preroll);
+
     if(stream->savefilename != NULL) 
     {
         stream->savefile = fopen(stream->savefilename, "wb");
@@ -279,6 +358,7 @@ retry:
         LOG_INFO3("Connected to server: %s:%d%s", 
                 shout_get_host(sdsc->shout), shout_get_port(sdsc->shout), shout_get_mount(sdsc->shout));
 
+        sdsc->clock.started = input_clock();
         while(1)
         {
             if(stream->buffer_failures > MAX_ERRORS)
@@ -287,6 +367,20 @@ retry:
                 break;
             }
 
+            /* The input thread found our queue full and wants us to start
+             * over on a fresh connection */
+            if(stream->resync)
+            {
+                LOG_WARN1("Queue overflow on mount %s, reconnecting to resync",
+                        stream->mount);
+                stream->resync = 0;
+                if(stream_reconnect(sdsc) < 0)
+                {
+                    stream->buffer_failures = MAX_ERRORS+1;
+                    continue;
+                }
+            }
+
             buffer = stream_wait_for_data(stream);
 
             /* buffer being NULL means that either a fatal error occured,
@@ -307,13 +401,13 @@ retry:
                 continue; 
             }
 
-            if(stream->wait_for_critical)
-            {
+            if(atomic_exchange(&stream->wait_for_critical, 0))
                 LOG_INFO0("Trying restart on new substream");
-                stream->wait_for_critical = 0;
-            }
 
+            stream_pace_buffer(sdsc, buffer);
+            send_start = input_clock();
             ret = process_and_send_buffer(sdsc, buffer);
+            sdsc->clock.sending += input_clock() - send_start;
 
             /* No data produced, do nothing */
             if(ret == -1)
@@ -327,7 +421,7 @@ retry:
                  * a new substream, typically), and flush existing queue.
                  */
                 thread_mutex_lock(&ices_config->flush_lock);
-                stream->wait_for_critical = 1;
+                atomic_store(&stream->wait_for_critical, 1);
                 input_flush_queue(stream->queue, 0);
                 thread_mutex_unlock(&ices_config->flush_lock);
             }
@@ -337,68 +431,15 @@ retry:
                 LOG_ERROR1("Send error: %s", shout_get_error(sdsc->shout));
                 if(shout_get_errno(sdsc->shout) == SHOUTERR_SOCKET)
                 {
-                    int i=0;
-
-                    /* While we're trying to reconnect, don't receive data
-                     * to this instance, or we'll overflow once reconnect
-                     * succeeds
-                     */
-                    thread_mutex_lock(&ices_config->flush_lock);
-                    stream->skip = 1;
-
-                    /* Also, flush the current queue */
-                    input_flush_queue(stream->queue, 1);
-                    thread_mutex_unlock(&ices_config->flush_lock);
-
-                    shout_close(sdsc->shout);
-
-                    if (i >= stream->reconnect_attempts)
-                        break;
-                    while((i < stream->reconnect_attempts ||
-                            stream->reconnect_attempts==-1) && 
-                            !ices_config->shutdown)
-                    {
-                        LOG_WARN0("Trying reconnect after server socket error");
-                        i++;
-                        if((shouterr = shout_open(sdsc->shout)) == SHOUTERR_SUCCESS)
-                        {
-                            LOG_INFO3("Connected to server: %s:%d%s", 
-                                    shout_get_host(sdsc->shout), shout_get_port(sdsc->shout), 
-                                    shout_get_mount(sdsc->shout));
-                            /* This stream can't restart until the next
-                             * logical stream comes along, since the
-                             * server won't have any cached headers for
-                             * this source/connection. So, don't continue
-                             * yet.
-                             */
-                            thread_mutex_lock(&ices_config->flush_lock);
-                            stream->wait_for_critical = 1;
-                            input_flush_queue(stream->queue, 0);
-                            stream->skip = 0;
-                            thread_mutex_unlock(&ices_config->flush_lock);
-                            break;
-                        }
-                        else
-                        {
-                            LOG_ERROR3("Failed to reconnect to %s:%d (%s)",
-                                shout_get_host(sdsc->shout),shout_get_port(sdsc->shout),
-                                shout_get_error(sdsc->shout));
-                            if(i==stream->reconnect_attempts)
-                            {
-                                LOG_ERROR0("Reconnect failed too many times, "
-                                          "giving up.");
-                                /* We want to die now */
-                                stream->buffer_failures = MAX_ERRORS+1; 
-                            }
-                            else /* Don't try again too soon */
-                                thread_sleep (stream->reconnect_delay*1000000); 
-                        }
-                    }
+                    LOG_WARN0("Trying reconnect after server socket error");
+                    if(stream_reconnect(sdsc) < 0)
+                        stream->buffer_failures = MAX_ERRORS+1; /* We want to die now */
                 }
                 stream->buffer_failures++;
             }
             stream_release_buffer(buffer);
         }
+        stream_send_flush(sdsc);
     }
     else
     {
@@ -419,16 +460,48 @@ retry:
 
     shout_close(sdsc->shout);
 
+    if(atomic_load(&stream->queue->dropped_pages))
+        LOG_INFO4("Mount %s: %lu queue overflows, %lu pages (%lu bytes) dropped",
+                stream->mount, atomic_load(&stream->queue->overflows),
+                atomic_load(&stream->queue->dropped_pages),
+                atomic_load(&stream->queue->dropped_bytes));
+
+    if(sdsc->clock.started && input_clock() > sdsc->clock.started)
+        LOG_INFO2("Mount %s: busy sending %lu%% of the time", stream->mount,
+                (unsigned long)(sdsc->clock.sending * 100 /
+                    (input_clock() - sdsc->clock.started)));
+
+    if(sdsc->send.sends)
+        LOG_INFO4("Mount %s: %llu bytes in %lu sends, %lu pages or buffers",
+                stream->mount, (unsigned long long)sdsc->send.bytes,
+                sdsc->send.sends, sdsc->send.pieces);
+
+    if(sdsc->clock.latency_count)
+        LOG_INFO3("Mount %s: capture to send latency %lu ms on average, "
+                "%lu ms at most", stream->mount,
+                (unsigned long)(sdsc->clock.latency_total /
+                    sdsc->clock.latency_count / 1000000),
+                (unsigned long)(sdsc->clock.latency_max / 1000000));
+
+    if(sdsc->clock.stalls)
+        LOG_INFO3("Mount %s fell behind %lu times, by at most %lu ms",
+                stream->mount, sdsc->clock.stalls,
+                (unsigned long)(sdsc->clock.max_lag / 1000000));
+
     if(stream->savefile != NULL) 
+    {
         fclose(stream->savefile);
+        stream->savefile = NULL;
+    }
 
-    shout_free(sdsc->shout);
-    encode_clear(sdsc->enc);
-    reencode_clear(sdsc->reenc);
-    downmix_clear(sdsc->downmix);
-    resample_clear(sdsc->resamp);
-    vorbis_comment_clear(&sdsc->vc);
+    stream_free_description(sdsc);
+    stream->died = 1;
+    return NULL;
 
+setup_failed:
+    /* nothing a restart would change, see supervisor_instance_died() */
+    stream_free_description(sdsc);
+    stream->setup_failed = 1;
     stream->died = 1;
     return NULL;
 }
@@ -15,6 +15,8 @@
 #ifndef __STREAM_H
 #define __STREAM_H
 
+#include <stdint.h>
+#include <stdatomic.h>
 #include <shout/shout.h>
 
 #include "common/thread/thread.h"
@@ -23,21 +25,54 @@
 typedef struct {
     unsigned char *buf;
     long len;
-    int count;
+    atomic_int count;   /* see stream_acquire_buffer()/stream_release_buffer() */
     int critical;
     long aux_data;
+    struct decoded_pcm *pcm;    /* shared decode of this page, if any */
+    uint64_t deadline;          /* when to send it, in ns on the monotonic
+                                 * clock; 0 for right away */
+    uint64_t captured;          /* when the input module handed over the
+                                 * oldest audio in it, or paced input was
+                                 * due, same clock; 0 if not known */
 } ref_buffer;
 
-typedef struct _queue_item {
-    ref_buffer *buf;
-    struct _queue_item *next;
-} queue_item;
+/* How one instance is doing against the stream's schedule, see
+ * stream_pace_buffer(). Times in ns on input_clock(). */
+typedef struct {
+    uint64_t last_deadline;     /* of the last buffer sent, 0 for none */
+    uint64_t last_sent;
+    int behind;
+    uint64_t behind_since;
+    unsigned long stalls;       /* times it fell behind */
+    uint64_t max_lag;
+
+    uint64_t started;           /* connected */
+    uint64_t sending;           /* time spent encoding and sending since */
+
+    /* from capture of the audio to having sent it */
+    unsigned long latency_count;
+    uint64_t latency_total;
+    uint64_t latency_max;
+} instance_clock;
+
+/* most pages, or buffers, and bytes gathered into one send */
+#define STREAM_SEND_PIECES 16
+#define STREAM_SEND_BYTES 65536
+
+/* Output gathered so that a page's header and body, and a backlog of
+ * pages, go to the server in one shout_send_raw() and to the savefile in
+ * one fwrite(). See stream_send_flush(). */
+typedef struct {
+    unsigned char *buf;
+    long len;
+    long size;
+    int count;                                  /* pieces in buf */
+    uint64_t captured[STREAM_SEND_PIECES];      /* of each, 0 if unknown */
 
-typedef struct buffer_queue {
-    queue_item *head, *tail;
-    int length;
-    mutex_t lock;
-} buffer_queue;
+    unsigned long sends;
+    unsigned long pieces;
+    uint64_t bytes;
+} stream_sendbuf;
 
 void *ices_instance_stream(void *arg);
 void *savefile_stream(void *arg);
@@ -17,6 +17,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <common/thread/thread.h>
@@ -25,86 +26,400 @@
 #include "inputmodule.h"
 #include "stream_shared.h"
 #include "stream.h"
+#include "queue.h"
+#include "bufpool.h"
+#include "decode.h"
+#include "preroll.h"
 #include "reencode.h"
 #include "encode.h"
 #include "audio.h"
+#include "pcmconv.h"
 
 #define MODULE "stream-shared/"
 #include "logging.h"
 
-static ssize_t stream_send_data(stream_description *s, unsigned char *buf, 
-        size_t len)
+/* Send everything gathered so far. Returns 1, or 0 on a send error. */
+int stream_send_flush(stream_description *s)
 {
+    stream_sendbuf *send = &s->send;
+    instance_clock *clock = &s->clock;
+    uint64_t now;
     ssize_t ret;
+    int i;
+
+    if(!send->len)
+        return 1;
 
     if(s->stream->savefile)
     {
-        size_t ret = fwrite(buf, 1, len, s->stream->savefile);
-        if(ret != len) 
-            LOG_ERROR1("Failed to write %d bytes to savefile", len);
+        size_t ret = fwrite(send->buf, 1, send->len, s->stream->savefile);
+        if(ret != send->len) 
+            LOG_ERROR1("Failed to write %ld bytes to savefile", send->len);
+    }
+
+    ret = shout_send_raw(s->shout, send->buf, send->len);
+    now = input_clock();
+
+    send->sends++;
+    send->pieces += send->count;
+    send->bytes += send->len;
+    for(i = 0; i < send->count; i++)
+    {
+        if(!send->captured[i] || now <= send->captured[i])
+            continue;
+        clock->latency_count++;
+        clock->latency_total += now - send->captured[i];
+        if(now - send->captured[i] > clock->latency_max)
+            clock->latency_max = now - send->captured[i];
     }
+    if(ret >= 0)
+        preroll_add_data(s->preroll, send->buf, send->len);
+    send->len = 0;
+    send->count = 0;
 
-    ret = shout_send_raw(s->shout, buf, len);
     if(ret < 0)
         return 0; /* Force server-reconnect */
     else
-        return ret;
+        return 1;
 }
 
-void stream_release_buffer(ref_buffer *buf)
+/* Drop anything gathered, on a new connection */
+void stream_send_discard(stream_description *s)
 {
-    thread_mutex_lock(&ices_config->refcount_lock);
-    buf->count--;
-    if(!buf->count)
-    {
-        free(buf->buf);
-        free(buf);
-    }
-    thread_mutex_unlock(&ices_config->refcount_lock);
+    s->send.len = 0;
+    s->send.count = 0;
 }
 
-ref_buffer *stream_wait_for_data(instance_t *stream)
+/* Add data to what's waiting to be sent. Returns 1, or 0 if out of
+ * memory. */
+static int stream_send_data(stream_description *s, unsigned char *buf, 
+        long len)
 {
-    ref_buffer *buffer;
-    queue_item *old;
+    stream_sendbuf *send = &s->send;
 
-    thread_mutex_lock(&stream->queue->lock);
-    while(!stream->queue->head && !ices_config->shutdown && !stream->kill)
+    if(send->len + len > send->size)
     {
-        thread_mutex_unlock(&stream->queue->lock);
-        thread_cond_wait(&ices_config->queue_cond);
-        thread_mutex_lock(&stream->queue->lock);
+        long size = send->len + len;
+        unsigned char *grown;
+
+        if(size < STREAM_SEND_BYTES)
+            size = STREAM_SEND_BYTES;
+        grown = realloc(send->buf, size);
+        if(!grown)
+        {
+            LOG_ERROR1("Out of memory gathering %ld bytes to send", len);
+            return 0;
+        }
+        send->buf = grown;
+        send->size = size;
     }
 
-    if(ices_config->shutdown || stream->kill)
+    memcpy(send->buf + send->len, buf, len);
+    send->len += len;
+
+    return 1;
+}
+
+/* The data for a page or buffer, captured when given, is complete. Sends
+ * straight away once as much has been gathered as should be. Returns as
+ * for stream_send_flush(). */
+static int stream_send_mark(stream_description *s, uint64_t captured)
+{
+    stream_sendbuf *send = &s->send;
+
+    send->captured[send->count++] = captured;
+    if(send->count == STREAM_SEND_PIECES || send->len >= STREAM_SEND_BYTES)
+        return stream_send_flush(s);
+
+    return 1;
+}
+
+/* Whether to hold on to what's gathered for the next buffer. Only if
+ * that is already queued, and won't be held back by pacing. */
+static int stream_send_gather(stream_description *s, ref_buffer *buffer)
+{
+    instance_t *stream = s->stream;
+
+    return (!stream->catchup_rate || !buffer->deadline) &&
+        queue_length(stream->queue) > 0;
+}
+
+/* Taking a reference only needs to be atomic, the caller already holds one
+ * so the buffer can't go away underneath us.
+ */
+void stream_acquire_buffer(ref_buffer *buf)
+{
+    atomic_fetch_add_explicit(&buf->count, 1, memory_order_relaxed);
+}
+
+/* Dropping the last reference frees the buffer. The release/acquire pair
+ * makes sure every other holder is finished with the data before it goes.
+ */
+void stream_release_buffer(ref_buffer *buf)
+{
+    if(atomic_fetch_sub_explicit(&buf->count, 1, memory_order_release) == 1)
     {
-        LOG_DEBUG0("Shutdown signalled: thread shutting down");
-        thread_mutex_unlock(&stream->queue->lock);
-        return NULL;
+        atomic_thread_fence(memory_order_acquire);
+        if(buf->pcm)
+            decode_free_pcm(buf->pcm);
+        bufpool_free(buf->buf);
+        bufpool_put_ref(buf);
     }
+}
 
-    buffer = stream->queue->head->buf;
-    old = stream->queue->head;
+ref_buffer *stream_wait_for_data(instance_t *stream)
+{
+    ref_buffer *buffer;
 
-    stream->queue->head = stream->queue->head->next;
-    if(!stream->queue->head)
-        stream->queue->tail = NULL;
+    while(1)
+    {
+        if(ices_config->shutdown || stream->kill)
+        {
+            LOG_DEBUG0("Shutdown signalled: thread shutting down");
+            return NULL;
+        }
+
+        buffer = queue_pop(stream->queue);
+        if(buffer)
+            break;
 
-    free(old);
-    stream->queue->length--;
-    thread_mutex_unlock(&stream->queue->lock);
+        queue_wait(stream->queue, stream->wakeup_batch);
+    }
 
     /* ok, we pulled something off the queue and the queue is
      * now empty - this means we're probably keeping up, so
      * clear one of the errors. This way, very occasional errors
      * don't cause eventual shutdown
      */
-    if(!stream->queue->head && stream->buffer_failures>0)
+    if(!queue_length(stream->queue) && stream->buffer_failures>0)
         stream->buffer_failures--;
 
     return buffer;
 }
 
+/* Hand each whole Ogg page in buf to sink. Returns as for the sink, or 1
+ * if there were no pages.
+ */
+int stream_split_pages(unsigned char *buf, long len, stream_page_sink sink,
+        void *arg)
+{
+    ogg_page og;
+    int ret = 1;
+    long i;
+
+    while(len >= 27 && memcmp(buf, "OggS", 4) == 0)
+    {
+        og.header_len = 27 + buf[26];
+        if(len < og.header_len)
+            break;
+        og.body_len = 0;
+        for(i = 27; i < og.header_len; i++)
+            og.body_len += buf[i];
+        if(len < og.header_len + og.body_len)
+            break;
+        og.header = buf;
+        og.body = buf + og.header_len;
+
+        if((ret = sink(arg, &og)) == 0)
+            return 0;
+
+        buf += og.header_len + og.body_len;
+        len -= og.header_len + og.body_len;
+    }
+
+    return ret;
+}
+
+/* lagging more than this counts as having fallen behind */
+#define PACE_BEHIND_NS 1000000000ULL
+/* and this close again counts as having caught up */
+#define PACE_CAUGHT_UP_NS 100000000ULL
+/* gaps in the schedule longer than this are dropped or flushed buffers,
+ * not time to be paced out */
+#define PACE_MAX_INTERVAL_NS 2000000000ULL
+
+/* The input loop releases each buffer when it is due, but an instance that
+ * has stalled on the server is behind that by the length of its backlog.
+ * Each instance measures its own lag against the deadlines, and works off
+ * a backlog at catchup-rate percent of real time, or as fast as the server
+ * takes it if that is 0, without holding up any other instance.
+ */
+void stream_pace_buffer(stream_description *sdsc, ref_buffer *buffer)
+{
+    instance_clock *clock = &sdsc->clock;
+    instance_t *stream = sdsc->stream;
+    uint64_t now, lag;
+
+    if(buffer->deadline == 0)
+        return;
+
+    if(stream->catchup_rate && clock->last_deadline &&
+            buffer->deadline > clock->last_deadline &&
+            buffer->deadline - clock->last_deadline <= PACE_MAX_INTERVAL_NS)
+        input_sleep_until(clock->last_sent + (buffer->deadline -
+                    clock->last_deadline) * 100 / stream->catchup_rate);
+
+    now = input_clock();
+    lag = now > buffer->deadline ? now - buffer->deadline : 0;
+    clock->last_deadline = buffer->deadline;
+    clock->last_sent = now;
+
+    if(lag > clock->max_lag)
+        clock->max_lag = lag;
+
+    if(!clock->behind && lag > PACE_BEHIND_NS)
+    {
+        LOG_WARN2("Mount %s is %lu ms behind, catching up", stream->mount,
+                (unsigned long)(lag / 1000000));
+        clock->behind = 1;
+        clock->behind_since = now;
+        clock->stalls++;
+    }
+    else if(clock->behind && lag < PACE_CAUGHT_UP_NS)
+    {
+        LOG_INFO2("Mount %s caught up after %lu ms", stream->mount,
+                (unsigned long)((now - clock->behind_since) / 1000000));
+        clock->behind = 0;
+    }
+}
+
+/* after a reconnect there's no backlog to speak of */
+void stream_pace_reset(stream_description *sdsc)
+{
+    sdsc->clock.last_deadline = 0;
+    sdsc->clock.behind = 0;
+}
+
+static int stream_send_page(void *arg, ogg_page *og)
+{
+    stream_description *sdsc = arg;
+
+    if (stream_send_data(sdsc, og->header, og->header_len) == 0)
+        return 0;
+    if (stream_send_data(sdsc, og->body, og->body_len) == 0)
+        return 0;
+    return stream_send_mark(sdsc, sdsc->enc->page_captured);
+}
+
+/* Finish the current logical stream, if any, and start a new one with
+ * fresh metadata. Returns as for stream_encode_buffer().
+ */
+int stream_encode_restart(stream_description *sdsc, stream_page_sink sink,
+        void *arg)
+{
+    ogg_page og;
+    int ret=1;
+
+    if(sdsc->enc)
+    {
+        if(sdsc->resamp) {
+            resample_finish(sdsc->resamp);
+            encode_data_float(sdsc->enc, sdsc->resamp->buffers,
+                    sdsc->resamp->buffill);
+            resample_clear(sdsc->resamp);
+            sdsc->resamp = resample_initialise (sdsc->stream->channels,
+                    sdsc->stream->resampleinrate, sdsc->stream->resampleoutrate);
+        }
+        encode_finish(sdsc->enc);
+        while(encode_flush(sdsc->enc, &og) != 0)
+        {
+            if ((ret = sink(arg, &og)) == 0)
+                return 0;
+        }
+    }
+
+    if(sdsc->input->metadata_update)
+    {
+        vorbis_comment_clear(&sdsc->vc);
+        vorbis_comment_init(&sdsc->vc);
+
+        sdsc->input->metadata_update(sdsc->input->internal, &sdsc->vc);
+    }
+
+    /* the settings haven't changed, so keep the encoder set up */
+    if(sdsc->enc && encode_restart(sdsc->enc, &sdsc->vc) == 0)
+        return ret;
+    encode_clear(sdsc->enc);
+
+    sdsc->enc = encode_initialise(sdsc->stream->codec,
+            sdsc->stream->channels,
+            sdsc->stream->samplerate, sdsc->stream->managed, 
+            sdsc->stream->min_br, sdsc->stream->nom_br, 
+            sdsc->stream->max_br, sdsc->stream->quality,
+            &sdsc->vc);
+    if(!sdsc->enc) {
+        LOG_ERROR0("Failed to initialise encoder");
+        return -2;
+    }
+    sdsc->enc->max_samples_ppage = sdsc->stream->max_samples_ppage;
+    sdsc->enc->flush_latency = (uint64_t)sdsc->stream->latency_ms * 1000000;
+
+    return ret;
+}
+
+/* Encode a buffer of PCM with the encoder in sdsc, handing every Ogg page
+ * produced to sink. A critical buffer finishes the current logical stream
+ * and starts a new one with fresh metadata.
+ * Returns: >0 - success (the last value returned by sink, or 1 if no pages
+ *               were produced)
+ *           0 - sink failed
+ *          -1 - no encoder, waiting for the next logical stream
+ *          -2 - fatal error occurred
+ */
+int stream_encode_buffer(stream_description *sdsc, ref_buffer *buffer,
+        stream_page_sink sink, void *arg)
+{
+    ogg_page og;
+    input_subtype format = sdsc->input->subtype;
+    int samples = buffer->len/(2*pcm_sample_size(format));
+    int ret=1;
+
+    /* We use critical as a flag to say 'start a new stream' */
+    if(buffer->critical)
+    {
+        if((ret = stream_encode_restart(sdsc, sink, arg)) <= 0)
+            return ret;
+    }
+    else if(!sdsc->enc)
+        return -1;
+
+    sdsc->enc->captured = buffer->captured;
+    if(sdsc->downmix) {
+        downmix_buffer(sdsc->downmix, (signed char *)buffer->buf,
+                buffer->len, format);
+        if(sdsc->resamp) {
+            resample_buffer_float(sdsc->resamp, &sdsc->downmix->buffer, 
+                    samples);
+            encode_data_float(sdsc->enc, sdsc->resamp->buffers, 
+                    sdsc->resamp->buffill);
+        }
+        else
+            encode_data_float(sdsc->enc, &sdsc->downmix->buffer,
+                   samples);
+    }
+    else if(sdsc->resamp) {
+        /* resampled straight into the encoder */
+        float **out = encode_buffer(sdsc->enc, resample_buffer_size(
+                    sdsc->resamp, buffer->len, format));
+
+        if(out)
+            encode_wrote(sdsc->enc, resample_buffer(sdsc->resamp, out,
+                        (signed char *)buffer->buf, buffer->len, format));
+    }
+    else {
+        encode_data(sdsc->enc, (signed char *)(buffer->buf), 
+                buffer->len, format);
+    }
+
+    while(encode_dataout(sdsc->enc, &og) > 0)
+    {
+        if ((ret = sink(arg, &og)) == 0)
+            return 0;
+    }
+
+    return ret;
+}
+
 /* Process a buffer (including reencoding or encoding, if desired).
  * Returns: >0 - success
  *           0 - shout error occurred
@@ -113,106 +428,42 @@ ref_buffer *stream_wait_for_data(instance_t *stream)
  */
 int process_and_send_buffer(stream_description *sdsc, ref_buffer *buffer)
 {
+    int ret;
+
     if(sdsc->reenc)
     {
         unsigned char *buf;
-        int buflen,ret;
+        int buflen;
 
         ret = reencode_page(sdsc->reenc, buffer, &buf, &buflen);
         if(ret > 0) 
         {
             ret = stream_send_data(sdsc, buf, buflen);
-            free(buf);
-            return ret;
+            if(ret > 0)
+                ret = stream_send_mark(sdsc, buffer->captured);
         }
         else if(ret==0) /* No data produced by reencode */
-            return -1;
+            ret = -1;
         else
         {
             LOG_ERROR0("Fatal reencoding error encountered");
-            return -2;
+            ret = -2;
         }
     }
-    else if (sdsc->enc)
+    else if (sdsc->encoding)
+        ret = stream_encode_buffer(sdsc, buffer, stream_send_page, sdsc);
+    else
     {
-        ogg_page og;
-        int be = (sdsc->input->subtype == INPUT_PCM_BE_16)?1:0;
-        int ret=1;
-
-        /* We use critical as a flag to say 'start a new stream' */
-        if(buffer->critical)
-        {
-            if(sdsc->resamp) {
-                resample_finish(sdsc->resamp);
-                encode_data_float(sdsc->enc, sdsc->resamp->buffers,
-                        sdsc->resamp->buffill);
-                resample_clear(sdsc->resamp);
-                sdsc->resamp = resample_initialise (sdsc->stream->channels,
-                        sdsc->stream->resampleinrate, sdsc->stream->resampleoutrate);
-            }
-            encode_finish(sdsc->enc);
-            while(encode_flush(sdsc->enc, &og) != 0)
-            {
-                if ((ret = stream_send_data(sdsc, og.header, og.header_len)) == 0)
-                    return 0;
-                if ((ret = stream_send_data(sdsc, og.body, og.body_len)) == 0)
-                    return 0;
-            }
-            encode_clear(sdsc->enc);
-
-            if(sdsc->input->metadata_update)
-            {
-                vorbis_comment_clear(&sdsc->vc);
-                vorbis_comment_init(&sdsc->vc);
-
-                sdsc->input->metadata_update(sdsc->input->internal, &sdsc->vc);
-            }
-
-            sdsc->enc = encode_initialise(sdsc->stream->channels,
-                    sdsc->stream->samplerate, sdsc->stream->managed, 
-                    sdsc->stream->min_br, sdsc->stream->nom_br, 
-                    sdsc->stream->max_br, sdsc->stream->quality,
-                    &sdsc->vc);
-            if(!sdsc->enc) {
-                LOG_ERROR0("Failed to initialise encoder");
-                return -2;
-            }
-            sdsc->enc->max_samples_ppage = sdsc->stream->max_samples_ppage;
-        }
+        ret = stream_send_data(sdsc, buffer->buf, buffer->len);
 
-        if(sdsc->downmix) {
-            downmix_buffer(sdsc->downmix, (signed char *)buffer->buf, buffer->len, be);
-            if(sdsc->resamp) {
-                resample_buffer_float(sdsc->resamp, &sdsc->downmix->buffer, 
-                        buffer->len/4);
-                encode_data_float(sdsc->enc, sdsc->resamp->buffers, 
-                        sdsc->resamp->buffill);
-            }
-            else
-                encode_data_float(sdsc->enc, &sdsc->downmix->buffer,
-                       buffer->len/4);
-        }
-        else if(sdsc->resamp) {
-            resample_buffer(sdsc->resamp, (signed char *)buffer->buf, 
-                    buffer->len, be);
-            encode_data_float(sdsc->enc, sdsc->resamp->buffers,
-                    sdsc->resamp->buffill);
-        }
-        else {
-            encode_data(sdsc->enc, (signed char *)(buffer->buf), 
-                    buffer->len, be);
-        }
+        if(ret > 0)
+            ret = stream_send_mark(sdsc, buffer->captured);
+    }
 
-        while(encode_dataout(sdsc->enc, &og) > 0)
-        {
-            if ((ret = stream_send_data(sdsc, og.header, og.header_len)) == 0)
-                return 0;
-            if ((ret = stream_send_data(sdsc, og.body, og.body_len)) == 0)
-                return 0;
-        }
+    /* the rest of a backlog can go in the same send */
+    if(ret != 0 && !stream_send_gather(sdsc, buffer) &&
+            stream_send_flush(sdsc) == 0)
+        return 0;
 
-        return ret;
-    }
-    else    
-        return stream_send_data(sdsc, buffer->buf, buffer->len);
+    return ret;
 }
@@ -18,8 +18,23 @@
 #include "cfgparse.h"
 #include "input.h"
 
+/* receives each Ogg page produced by stream_encode_buffer(); returns 0 on
+ * failure */
+typedef int (*stream_page_sink)(void *arg, ogg_page *og);
+
 ref_buffer *stream_wait_for_data(instance_t *stream);
+int stream_split_pages(unsigned char *buf, long len, stream_page_sink sink,
+        void *arg);
+void stream_acquire_buffer(ref_buffer *buf);
 void stream_release_buffer(ref_buffer *buf);
+int stream_encode_restart(stream_description *sdsc, stream_page_sink sink,
+        void *arg);
+int stream_encode_buffer(stream_description *sdsc, ref_buffer *buffer,
+        stream_page_sink sink, void *arg);
+void stream_pace_buffer(stream_description *sdsc, ref_buffer *buffer);
+void stream_pace_reset(stream_description *sdsc);
 int process_and_send_buffer(stream_description *sdsc, ref_buffer *buffer);
+int stream_send_flush(stream_description *sdsc);
+void stream_send_discard(stream_description *sdsc);
 
 #endif
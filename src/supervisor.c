@@ -0,0 +1,195 @@
+/* supervisor.c
+ * - starting, and restarting, the instance threads.
+ *
+ * An instance thread that gives up (too many send errors, reconnects
+ * exhausted, ...) used to be removed for good, leaving its mount off the
+ * air until ices was restarted. Now the input loop hands it to the
+ * supervisor instead, which keeps its configuration and queue, and starts
+ * a new thread for it after restartdelay seconds, doubling the delay each
+ * time it dies again soon after a restart. A restarted instance rejoins
+ * the fan-out at the next critical buffer, or straight away with the
+ * headers kept by its shared encoder, so the server gets a stream that
+ * starts with headers.
+ *
+ * Copyright (c) 2026 The IceS Development Team <team@icecast.org>
+ *
+ * This program is distributed under the terms of the GNU General
+ * Public License, version 2. You may use, modify, and redistribute
+ * it under the terms of this license. A copy should be included
+ * with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+ #include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <common/thread/thread.h>
+#include <common/timing/timing.h>
+
+#include "cfgparse.h"
+#include "stream.h"
+#include "input.h"
+#include "inputmodule.h"
+#include "encode_group.h"
+#include "supervisor.h"
+
+#define MODULE "supervisor/"
+#include "logging.h"
+
+/* never wait longer than this between restarts */
+#define SUPERVISOR_MAX_DELAY 300000
+/* an instance that ran at least this long was doing fine, so the next
+ * failure starts the backoff from scratch */
+#define SUPERVISOR_STABLE_TIME 60000
+
+/* Returns 0 once the instance's thread is running. If it can't be
+ * started the instance is marked as died, so that the input loop hands it
+ * to supervisor_instance_died() like any other failure, and -1 returned.
+ */
+int supervisor_start_instance(instance_t *instance, input_module_t *inmod)
+{
+    stream_description *arg = calloc(1, sizeof(stream_description));
+
+    instance->started_at = timing_get_time();
+    if(!arg)
+    {
+        instance->died = 1;
+        return -1;
+    }
+    arg->stream = instance;
+    arg->input = inmod;
+
+    if(!thread_create("stream", ices_instance_stream, arg, 1))
+    {
+        free(arg);
+        instance->died = 1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Called by the input loop when it finds instance->died set. Returns 0 if
+ * the instance is going to be restarted and should stay where it is, -1 if
+ * it is to be removed.
+ */
+int supervisor_instance_died(instance_t *instance)
+{
+    uint64_t now = timing_get_time();
+    uint64_t delay;
+    int i;
+
+    if(ices_config->shutdown || instance->kill)
+        return -1;
+
+    /* a bad server or encoder setting fails the same way every time */
+    if(instance->setup_failed)
+    {
+        LOG_ERROR1("Mount %s couldn't be set up, not restarting it",
+                instance->mount);
+        return -1;
+    }
+
+    if(instance->restart_attempts == 0 || (instance->restart_attempts > 0 &&
+                instance->restarts >= instance->restart_attempts))
+    {
+        if(instance->restart_attempts)
+            LOG_ERROR2("Mount %s died after %d restarts, giving up",
+                    instance->mount, instance->restarts);
+        return -1;
+    }
+
+    if(now - instance->started_at >= SUPERVISOR_STABLE_TIME)
+        instance->consecutive_restarts = 0;
+
+    delay = (uint64_t)instance->restart_delay * 1000;
+    for(i = 0; i < instance->consecutive_restarts &&
+            delay < SUPERVISOR_MAX_DELAY; i++)
+        delay *= 2;
+    if(delay > SUPERVISOR_MAX_DELAY)
+        delay = SUPERVISOR_MAX_DELAY;
+
+    /* its thread has gone, so nothing is draining the queue; stop
+     * feeding it until there is again */
+    thread_mutex_lock(&ices_config->flush_lock);
+    instance->skip = 1;
+    input_flush_queue(instance->queue, 0);
+    thread_mutex_unlock(&ices_config->flush_lock);
+
+    instance->died = 0;
+    instance->restart_pending = 1;
+    instance->died_at = now;
+    instance->restart_at = now + delay;
+
+    LOG_WARN2("Instance for mount %s died, restarting in %lu ms",
+            instance->mount, (unsigned long)delay);
+
+    return 0;
+}
+
+/* Restart whatever is due. On shutdown, pending instances are marked as
+ * died so that the input loop removes them.
+ */
+void supervisor_poll(instance_t *instances, input_module_t *inmod)
+{
+    instance_t *instance;
+    uint64_t now = timing_get_time();
+
+    for(instance = instances; instance; instance = instance->next)
+    {
+        if(!instance->restart_pending)
+            continue;
+
+        if(ices_config->shutdown)
+        {
+            instance->restart_pending = 0;
+            instance->died = 1;
+            continue;
+        }
+
+        if(now < instance->restart_at)
+            continue;
+
+        instance->restart_pending = 0;
+        instance->restarts++;
+        instance->consecutive_restarts++;
+        instance->downtime += now - instance->died_at;
+
+        LOG_INFO3("Restarting instance for mount %s (restart %d, down for "
+                "%lu ms)", instance->mount, instance->restarts,
+                (unsigned long)(now - instance->died_at));
+
+        instance->buffer_failures = 0;
+        instance->resync = 0;
+        instance->queue_full = 0;
+
+        /* an instance running its own encoder starts a new stream with
+         * headers by itself, and a shared encoder sends its members the
+         * headers of the stream it is on; anything else has to pick up at
+         * the start of the next logical stream */
+        thread_mutex_lock(&ices_config->flush_lock);
+        atomic_store(&instance->wait_for_critical,
+                !(inmod->type == ICES_INPUT_PCM && instance->encode &&
+                    !instance->encode_group));
+        instance->skip = 0;
+        thread_mutex_unlock(&ices_config->flush_lock);
+
+        if(instance->encode_group)
+            encode_group_rejoin(instance->encode_group);
+
+        if(supervisor_start_instance(instance, inmod) < 0)
+            LOG_ERROR1("Failed to restart instance for mount %s",
+                    instance->mount);
+    }
+}
+
+void supervisor_report(instance_t *instance)
+{
+    if(instance->restarts)
+        LOG_INFO3("Mount %s: %d restarts, %lu seconds total downtime",
+                instance->mount, instance->restarts,
+                (unsigned long)(instance->downtime / 1000));
+}
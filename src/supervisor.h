@@ -0,0 +1,23 @@
+/* supervisor.h
+ * - starting, and restarting, the instance threads.
+ *
+ * Copyright (c) 2026 The IceS Development Team <team@icecast.org>
+ *
+ * This program is distributed under the terms of the GNU General
+ * Public License, version 2. You may use, modify, and redistribute
+ * it under the terms of this license. A copy should be included
+ * with this source.
+ */
+
+#ifndef __SUPERVISOR_H
+#define __SUPERVISOR_H
+
+#include "cfgparse.h"
+#include "inputmodule.h"
+
+int supervisor_start_instance(instance_t *instance, input_module_t *inmod);
+int supervisor_instance_died(instance_t *instance);
+void supervisor_poll(instance_t *instances, input_module_t *inmod);
+void supervisor_report(instance_t *instance);
+
+#endif /* __SUPERVISOR_H */
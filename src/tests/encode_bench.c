@@ -0,0 +1,146 @@
+/* encode_bench.c
+ * - processor time per stream, for each codec.
+ *
+ * Encodes a minute of generated stereo audio at 48kHz through
+ * encode_data_float() and encode_dataout(), the way a stream does, for
+ * a few typical Vorbis and Opus settings. Prints the processor time
+ * the encoder counted per second of audio, which is what one more
+ * stream costs, and how many such streams one processor could run in
+ * real time.
+ *
+ * Copyright (c) 2026 The IceS Development Team <team@icecast.org>
+ *
+ * This program is distributed under the terms of the GNU General
+ * Public License, version 2. You may use, modify, and redistribute
+ * it under the terms of this license. A copy should be included
+ * with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+ #include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include <ogg/ogg.h>
+#include <vorbis/codec.h>
+#ifdef HAVE_OPUS
+ #include <opus/opus.h>
+#endif
+
+#include "cfgparse.h"
+#include "encode.h"
+#include "harness.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define RATE 48000
+#define CHANNELS 2
+#define SECONDS 60
+#define CHUNK 1024              /* frames per encode_data_float() */
+
+static const struct {
+    const char *name;
+    encode_codec codec;
+    int managed, nom_br;
+    float quality;
+} settings[] = {
+    { "vorbis q3", CODEC_VORBIS, 0, -1, 3.0 },
+    { "vorbis 128k", CODEC_VORBIS, 0, 128000, 0.0 },
+#ifdef HAVE_OPUS
+    { "opus 64k", CODEC_OPUS, 1, 64000, 0.0 },
+    { "opus 128k", CODEC_OPUS, 1, 128000, 0.0 },
+#endif
+};
+
+#define COUNT(a) (sizeof(a) / sizeof((a)[0]))
+
+/* music-ish: a few tones that move, under some noise, so neither codec
+ * gets an easy ride on silence or a pure sine */
+static void make_audio(float **pcm, long offset, int frames)
+{
+    int i, c;
+
+    for(i = 0; i < frames; i++)
+    {
+        double t = (double)(offset + i) / RATE;
+
+        for(c = 0; c < CHANNELS; c++)
+            pcm[c][i] = 0.2 * sin(2 * M_PI * (220 + 30 * c) * t) +
+                0.1 * sin(2 * M_PI * 1375 * t + sin(2 * M_PI * 0.5 * t)) +
+                0.05 * sin(2 * M_PI * (3000 + 500 * sin(t)) * t) +
+                0.02 * ((double)rand() / RAND_MAX - 0.5);
+    }
+}
+
+int main(void)
+{
+    float *audio[CHANNELS], *pcm[CHANNELS];
+    vorbis_comment vc;
+    unsigned int n;
+    int c;
+
+    harness_start(0);
+    vorbis_comment_init(&vc);
+
+    /* generated once, so making it isn't timed */
+    for(c = 0; c < CHANNELS; c++)
+        audio[c] = malloc(SECONDS * RATE * sizeof(float));
+    make_audio(audio, 0, SECONDS * RATE);
+
+    /* figures are only comparable between the same library versions */
+    printf("%s\n", vorbis_version_string());
+#ifdef HAVE_OPUS
+    printf("%s\n", opus_get_version_string());
+#endif
+    printf("%-12s %12s %14s %14s\n", "settings", "kbit/s", "cpu ms per s",
+            "streams/core");
+    for(n = 0; n < COUNT(settings); n++)
+    {
+        encoder_state *enc;
+        ogg_page og;
+        uint64_t bytes = 0;
+        double per_second;
+        long pos;
+
+        enc = encode_initialise(settings[n].codec, CHANNELS, RATE,
+                settings[n].managed, -1, settings[n].nom_br, -1,
+                settings[n].quality, &vc);
+        if(!enc)
+        {
+            fprintf(stderr, "couldn't set up %s\n", settings[n].name);
+            return 1;
+        }
+
+        for(pos = 0; pos + CHUNK <= SECONDS * RATE; pos += CHUNK)
+        {
+            for(c = 0; c < CHANNELS; c++)
+                pcm[c] = audio[c] + pos;
+            encode_data_float(enc, pcm, CHUNK);
+            while(encode_dataout(enc, &og) > 0)
+                bytes += og.header_len + og.body_len;
+        }
+        encode_finish(enc);
+        while(encode_flush(enc, &og) > 0)
+            bytes += og.header_len + og.body_len;
+
+        /* enc->cpu_time is what the stream statistics report too */
+        per_second = (double)enc->cpu_time / 1000000 / SECONDS;
+        printf("%-12s %12.1f %14.2f %14.0f\n", settings[n].name,
+                (double)bytes * 8 / 1000 / SECONDS, per_second,
+                1000 / per_second);
+
+        encode_clear(enc);
+    }
+
+    for(c = 0; c < CHANNELS; c++)
+        free(audio[c]);
+    vorbis_comment_clear(&vc);
+    harness_stop();
+
+    return 0;
+}
@@ -0,0 +1,53 @@
+/* harness.c
+ * - common setup for the test and benchmark programs.
+ *
+ * Copyright (c) 2026 The IceS Development Team <team@icecast.org>
+ *
+ * This program is distributed under the terms of the GNU General
+ * Public License, version 2. You may use, modify, and redistribute
+ * it under the terms of this license. A copy should be included
+ * with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+ #include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <common/thread/thread.h>
+#include <common/log/log.h>
+
+#include "cfgparse.h"
+#include "bufpool.h"
+#include "resample.h"
+#include "encode.h"
+#include "harness.h"
+
+void harness_start(int loglevel)
+{
+    config_initialize();
+    log_initialize();
+    thread_initialize();
+
+    ices_config->log_id = log_open_file(stderr);
+    if(loglevel)
+        log_set_level(ices_config->log_id, loglevel);
+
+    bufpool_initialise();
+    resampler_cache_init();
+    encode_init();
+}
+
+void harness_stop(void)
+{
+    encode_close();
+    resampler_cache_clear();
+    bufpool_shutdown();
+
+    log_close(ices_config->log_id);
+    thread_shutdown();
+    log_shutdown();
+    config_shutdown();
+}
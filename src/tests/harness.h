@@ -0,0 +1,21 @@
+/* harness.h
+ * - common setup for the test and benchmark programs, which are linked
+ *   against everything but ices.c.
+ *
+ * Copyright (c) 2026 The IceS Development Team <team@icecast.org>
+ *
+ * This program is distributed under the terms of the GNU General
+ * Public License, version 2. You may use, modify, and redistribute
+ * it under the terms of this license. A copy should be included
+ * with this source.
+ */
+
+#ifndef __HARNESS_H
+#define __HARNESS_H
+
+/* what main() in ices.c sets up before reading input, with logging to
+ * stderr at the given level (0 for the default, warnings and errors) */
+void harness_start(int loglevel);
+void harness_stop(void);
+
+#endif /* __HARNESS_H */
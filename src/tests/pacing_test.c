@@ -0,0 +1,177 @@
+/* pacing_test.c
+ * - the input schedule must not drift, however long the stream.
+ *
+ * Feeds a day's worth of 44.1kHz Ogg pages of varying length through
+ * input_calculate_ogg_sleep(), then a day of 44.1kHz stereo PCM in odd
+ * sized chunks through input_calculate_pcm_sleep(), and checks after
+ * each one that the deadline input_sleep() gives is within a sample of
+ * the exact time of the audio sent so far.
+ *
+ * Copyright (c) 2026 The IceS Development Team <team@icecast.org>
+ *
+ * This program is distributed under the terms of the GNU General
+ * Public License, version 2. You may use, modify, and redistribute
+ * it under the terms of this license. A copy should be included
+ * with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+ #include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <ogg/ogg.h>
+
+#include "cfgparse.h"
+#include "input.h"
+#include "harness.h"
+
+#define RATE 44100
+#define DAY 86400
+#define PCM_BYTES_PER_SEC (RATE * 2 * 2)
+
+static long double worst_error;
+
+/* how far the deadline is from where it should be, in samples */
+static int check_deadline(long double exact_ns, long double ns_per_sample)
+{
+    long double error = ((long double)input_sleep() - exact_ns) /
+        ns_per_sample;
+
+    if(error < 0)
+        error = -error;
+    if(error > worst_error)
+        worst_error = error;
+
+    return error < 1 ? 0 : -1;
+}
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+static int feed_page(ogg_stream_state *os, ogg_timing *t,
+        unsigned char *data, long bytes, ogg_int64_t granulepos, int bos)
+{
+    ogg_packet op;
+    ogg_page og;
+
+    memset(&op, 0, sizeof(op));
+    op.packet = data;
+    op.bytes = bytes;
+    op.b_o_s = bos;
+    op.granulepos = granulepos;
+    ogg_stream_packetin(os, &op);
+    if(!ogg_stream_flush(os, &og))
+        return -1;
+
+    return input_calculate_ogg_sleep(t, &og);
+}
+
+/* a Speex stream, the simplest header that names its own rate */
+static int ogg_day(long double *sent_ns)
+{
+    ogg_stream_state os;
+    ogg_timing timing;
+    unsigned char header[80], audio[16];
+    ogg_int64_t granulepos, first;
+    long pages = 0;
+    int ret = 0;
+
+    memset(&timing, 0, sizeof(timing));
+    ogg_stream_init(&os, 1);
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, "Speex   ", 8);
+    put_le32(header + 28, 1);               /* header version */
+    put_le32(header + 32, sizeof(header));  /* header size */
+    put_le32(header + 36, RATE);
+    memset(audio, 0, sizeof(audio));
+
+    if(feed_page(&os, &timing, header, sizeof(header), 0, 1) != 1)
+    {
+        printf("FAIL: the header page wasn't taken as a new stream\n");
+        return -1;
+    }
+    /* the first audio page only sets where the stream starts */
+    first = granulepos = 1000;
+    feed_page(&os, &timing, audio, sizeof(audio), granulepos, 0);
+
+    while(granulepos - first < (ogg_int64_t)RATE * DAY)
+    {
+        /* lengths that don't divide into the rate, like real pages */
+        granulepos += 1000 + pages * 7919 % 3001;
+        pages++;
+        if(feed_page(&os, &timing, audio, sizeof(audio), granulepos, 0) < 0)
+        {
+            printf("FAIL: page %ld wasn't timed\n", pages);
+            ret = -1;
+            break;
+        }
+        *sent_ns = (long double)(granulepos - first) * 1e9L / RATE;
+        if(check_deadline(*sent_ns, 1e9L / RATE) < 0)
+        {
+            printf("FAIL: %ld pages in, the deadline is %.2Lf samples out\n",
+                    pages, worst_error);
+            ret = -1;
+            break;
+        }
+    }
+
+    input_ogg_timing_clear(&timing);
+    ogg_stream_clear(&os);
+    printf("%ld Ogg pages, worst error %.6Lf samples\n", pages, worst_error);
+
+    return ret;
+}
+
+/* carries on from the Ogg day, at a new rate */
+static int pcm_day(long double start_ns)
+{
+    uint64_t bytes = 0;
+    long chunks = 0;
+
+    worst_error = 0;
+    while(bytes < (uint64_t)PCM_BYTES_PER_SEC * DAY)
+    {
+        /* whole frames, in sizes a read from a pipe might give */
+        unsigned len = 4 * (500 + chunks * 104729 % 1531);
+
+        input_calculate_pcm_sleep(len, PCM_BYTES_PER_SEC);
+        bytes += len;
+        chunks++;
+        if(check_deadline(start_ns + (long double)bytes * 1e9L /
+                    PCM_BYTES_PER_SEC, 1e9L / RATE) < 0)
+        {
+            printf("FAIL: %ld PCM chunks in, the deadline is %.2Lf samples "
+                    "out\n", chunks, worst_error);
+            return -1;
+        }
+    }
+    printf("%ld PCM chunks, worst error %.6Lf samples\n", chunks,
+            worst_error);
+
+    return 0;
+}
+
+int main(void)
+{
+    long double sent_ns = 0;
+    int ret = 0;
+
+    harness_start(0);
+
+    if(ogg_day(&sent_ns) < 0 || pcm_day(sent_ns) < 0)
+        ret = 1;
+
+    harness_stop();
+
+    return ret;
+}
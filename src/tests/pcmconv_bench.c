@@ -0,0 +1,121 @@
+/* pcmconv_bench.c
+ * - throughput of the interleaved PCM to planar float conversion.
+ *
+ * Each input format and channel count is converted with the plain C
+ * kernels pcmconv starts out with, then again with the ones
+ * pcmconv_initialise() picks for this processor.
+ *
+ * Copyright (c) 2026 The IceS Development Team <team@icecast.org>
+ *
+ * This program is distributed under the terms of the GNU General
+ * Public License, version 2. You may use, modify, and redistribute
+ * it under the terms of this license. A copy should be included
+ * with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+ #include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "cfgparse.h"
+#include "input.h"
+#include "inputmodule.h"
+#include "pcmconv.h"
+#include "harness.h"
+
+#define FRAMES 4096             /* per call, about an input chunk */
+#define MAX_CHANNELS 6
+#define RUN_NS 200000000        /* how long to time each case for */
+
+static const input_subtype formats[] = {
+    INPUT_PCM_LE_16, INPUT_PCM_BE_16, INPUT_PCM_LE_24, INPUT_PCM_LE_32,
+    INPUT_PCM_LE_FLOAT
+};
+static const int channel_counts[] = { 1, 2, 6 };
+
+#define COUNT(a) (sizeof(a) / sizeof((a)[0]))
+
+static signed char *input;
+static float *planes[MAX_CHANNELS];
+
+/* frames converted per second, in millions */
+static double bench_convert(input_subtype format, int channels)
+{
+    uint64_t start = input_clock(), now;
+    unsigned long calls = 0;
+
+    do {
+        pcm_to_float(planes, input, FRAMES, channels, format);
+        calls++;
+        now = input_clock();
+    } while(now - start < RUN_NS);
+
+    return (double)calls * FRAMES * 1000 / (now - start);
+}
+
+static double bench_downmix(void)
+{
+    uint64_t start = input_clock(), now;
+    unsigned long calls = 0;
+
+    do {
+        pcm_downmix(planes[0], input, FRAMES, INPUT_PCM_LE_16);
+        calls++;
+        now = input_clock();
+    } while(now - start < RUN_NS);
+
+    return (double)calls * FRAMES * 1000 / (now - start);
+}
+
+int main(void)
+{
+    double scalar[COUNT(formats)][COUNT(channel_counts)], scalar_downmix;
+    double vector, vector_downmix;
+    unsigned int f, c;
+    long i;
+
+    harness_start(0);
+
+    /* random floats rather than random bytes, which would make NaNs and
+     * denormals for the float format; any bytes do for the others */
+    input = malloc(FRAMES * MAX_CHANNELS * sizeof(float));
+    for(i = 0; i < FRAMES * MAX_CHANNELS; i++)
+        ((float *)input)[i] = (float)(rand() - RAND_MAX / 2) / RAND_MAX;
+    for(c = 0; c < MAX_CHANNELS; c++)
+        planes[c] = malloc(FRAMES * sizeof(float));
+
+    /* pcmconv_initialise() hasn't been called yet, so these are the C
+     * kernels */
+    for(f = 0; f < COUNT(formats); f++)
+        for(c = 0; c < COUNT(channel_counts); c++)
+            scalar[f][c] = bench_convert(formats[f], channel_counts[c]);
+    scalar_downmix = bench_downmix();
+
+    pcmconv_initialise();
+
+    /* Mframes/s, with the C kernels and with the ones picked */
+    printf("%-8s %8s %12s %12s %8s\n", "format", "channels", "C",
+            "picked", "speedup");
+    for(f = 0; f < COUNT(formats); f++)
+        for(c = 0; c < COUNT(channel_counts); c++)
+        {
+            vector = bench_convert(formats[f], channel_counts[c]);
+            printf("%-8s %8d %12.1f %12.1f %7.2fx\n",
+                    pcm_format_name(formats[f]), channel_counts[c],
+                    scalar[f][c], vector, vector / scalar[f][c]);
+        }
+    vector_downmix = bench_downmix();
+    printf("%-8s %8s %12.1f %12.1f %7.2fx\n", "s16le", "downmix",
+            scalar_downmix, vector_downmix, vector_downmix / scalar_downmix);
+
+    for(c = 0; c < MAX_CHANNELS; c++)
+        free(planes[c]);
+    free(input);
+    harness_stop();
+
+    return 0;
+}
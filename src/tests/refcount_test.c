@@ -0,0 +1,180 @@
+/* refcount_test.c
+ * - stress test for ref_buffer reference counting.
+ *
+ * Several producers each hand every buffer they make to all of the
+ * consumers, through one queue per producer and consumer pair, the same
+ * way the input loop fans pages out to instances. Consumers take and drop
+ * extra references of their own along the way. Every buffer has to be
+ * freed exactly once: the buffer pool must get back as many blocks as it
+ * handed out, and no consumer may see a buffer's data change under it,
+ * which is what reusing a buffer freed too early would do.
+ *
+ * Copyright (c) 2026 The IceS Development Team <team@icecast.org>
+ *
+ * This program is distributed under the terms of the GNU General
+ * Public License, version 2. You may use, modify, and redistribute
+ * it under the terms of this license. A copy should be included
+ * with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+ #include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+#include <common/thread/thread.h>
+
+#include "cfgparse.h"
+#include "stream.h"
+#include "stream_shared.h"
+#include "queue.h"
+#include "bufpool.h"
+#include "harness.h"
+
+#define PRODUCERS 4
+#define CONSUMERS 6
+#define BUFFERS 50000       /* per producer */
+#define QUEUE_LENGTH 32
+
+static buffer_queue *queues[PRODUCERS][CONSUMERS];
+static atomic_int producers_done;
+static atomic_ulong received;
+static atomic_ulong corrupt;
+
+static void *producer(void *arg)
+{
+    int id = (int)(long)arg;
+    int n, c;
+
+    for(n = 0; n < BUFFERS; n++)
+    {
+        ref_buffer *buf = bufpool_get_ref();
+
+        /* some payloads too big for the pool, to cover both paths */
+        buf->len = (n % 97 == 0) ? 200000 : 64 + n % 2000;
+        buf->buf = bufpool_alloc(buf->len);
+        buf->aux_data = (id * BUFFERS + n) & 0xff;
+        memset(buf->buf, (int)buf->aux_data, buf->len);
+        atomic_init(&buf->count, 1);
+
+        for(c = 0; c < CONSUMERS; c++)
+        {
+            stream_acquire_buffer(buf);
+            while(queue_push(queues[id][c], buf) < 0)
+                sched_yield();
+        }
+        /* usually not the last reference, sometimes it is */
+        stream_release_buffer(buf);
+    }
+    atomic_fetch_add(&producers_done, 1);
+
+    return NULL;
+}
+
+static int check_buffer(ref_buffer *buf)
+{
+    long i;
+
+    for(i = 0; i < buf->len; i += 61)
+        if(buf->buf[i] != (unsigned char)buf->aux_data)
+            return -1;
+    return buf->buf[buf->len - 1] == (unsigned char)buf->aux_data ? 0 : -1;
+}
+
+static void *consumer(void *arg)
+{
+    int id = (int)(long)arg;
+    int p, idle;
+
+    do {
+        idle = atomic_load(&producers_done) == PRODUCERS;
+
+        for(p = 0; p < PRODUCERS; p++)
+        {
+            ref_buffer *buf;
+
+            while((buf = queue_pop(queues[p][id])))
+            {
+                idle = 0;
+                /* an extra reference, as a shared encoder takes */
+                stream_acquire_buffer(buf);
+                if(check_buffer(buf) < 0)
+                    atomic_fetch_add(&corrupt, 1);
+                stream_release_buffer(buf);
+                if(check_buffer(buf) < 0)
+                    atomic_fetch_add(&corrupt, 1);
+                stream_release_buffer(buf);
+                atomic_fetch_add(&received, 1);
+            }
+        }
+        if(!idle)
+            sched_yield();
+    } while(!idle);
+
+    return NULL;
+}
+
+int main(void)
+{
+    thread_type *threads[PRODUCERS + CONSUMERS];
+    bufpool_stats stats;
+    unsigned long handed_out;
+    int p, c, ret = 0;
+
+    harness_start(0);
+    atomic_init(&producers_done, 0);
+    atomic_init(&received, 0);
+    atomic_init(&corrupt, 0);
+
+    for(p = 0; p < PRODUCERS; p++)
+        for(c = 0; c < CONSUMERS; c++)
+            queues[p][c] = queue_create(QUEUE_LENGTH);
+
+    for(c = 0; c < CONSUMERS; c++)
+        threads[PRODUCERS + c] = thread_create("consumer", consumer,
+                (void *)(long)c, 0);
+    for(p = 0; p < PRODUCERS; p++)
+        threads[p] = thread_create("producer", producer, (void *)(long)p, 0);
+    for(p = 0; p < PRODUCERS + CONSUMERS; p++)
+        thread_join(threads[p]);
+
+    for(p = 0; p < PRODUCERS; p++)
+        for(c = 0; c < CONSUMERS; c++)
+            queue_free(queues[p][c]);
+
+    bufpool_get_stats(&stats);
+    handed_out = stats.hits + stats.misses + stats.oversize;
+
+    printf("%lu buffers received by %d consumers, %lu with changed data\n",
+            (unsigned long)atomic_load(&received), CONSUMERS,
+            (unsigned long)atomic_load(&corrupt));
+    printf("%lu blocks handed out by the buffer pool, %lu given back\n",
+            handed_out, stats.frees);
+
+    if(atomic_load(&received) != (unsigned long)PRODUCERS * BUFFERS * CONSUMERS)
+    {
+        printf("FAIL: buffers went missing\n");
+        ret = 1;
+    }
+    if(atomic_load(&corrupt))
+    {
+        printf("FAIL: buffers were freed while still in use\n");
+        ret = 1;
+    }
+    /* a ref_buffer and a payload per buffer */
+    if(handed_out != (unsigned long)PRODUCERS * BUFFERS * 2 ||
+            stats.frees != handed_out)
+    {
+        printf("FAIL: buffers weren't freed exactly once\n");
+        ret = 1;
+    }
+
+    harness_stop();
+
+    return ret;
+}
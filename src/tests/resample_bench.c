@@ -0,0 +1,114 @@
+/* resample_bench.c
+ * - throughput of the resampler.
+ *
+ * Pushes blocks of planar float input through resampler_push() for the
+ * common rate conversions, with the filter resampler_init() picks for
+ * this processor. Only calls the resampler has always had are used, so
+ * the same file can be built against an older resample.c to compare with
+ * (with the cache calls in the harness stubbed out, if it predates the
+ * cache).
+ *
+ * Copyright (c) 2026 The IceS Development Team <team@icecast.org>
+ *
+ * This program is distributed under the terms of the GNU General
+ * Public License, version 2. You may use, modify, and redistribute
+ * it under the terms of this license. A copy should be included
+ * with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+ #include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "cfgparse.h"
+#include "input.h"
+#include "resample.h"
+#include "harness.h"
+
+#define FRAMES 4096             /* per push, about an input chunk */
+#define MAX_CHANNELS 6
+#define RUN_NS 500000000        /* how long to time each case for */
+
+static const struct {
+    int infreq, outfreq;
+} rates[] = {
+    { 48000, 44100 },
+    { 44100, 22050 },
+    { 44100, 48000 },
+};
+static const int channel_counts[] = { 1, 2, 6 };
+
+#define COUNT(a) (sizeof(a) / sizeof((a)[0]))
+
+static float *input[MAX_CHANNELS];
+static float *output[MAX_CHANNELS];
+
+/* input frames resampled per second, in millions */
+static double bench_resample(int infreq, int outfreq, int channels)
+{
+    resampler_state state;
+    uint64_t start, now;
+    unsigned long calls = 0;
+
+    if(resampler_init(&state, channels, outfreq, infreq, RES_END) < 0)
+    {
+        fprintf(stderr, "couldn't set up %d->%d\n", infreq, outfreq);
+        exit(1);
+    }
+
+    start = input_clock();
+    do {
+        resampler_push(&state, output, (SAMPLE const **)input, FRAMES);
+        calls++;
+        now = input_clock();
+    } while(now - start < RUN_NS);
+
+    resampler_clear(&state);
+
+    return (double)calls * FRAMES * 1000 / (now - start);
+}
+
+int main(void)
+{
+    unsigned int r, c;
+    int i;
+
+    harness_start(0);
+
+    for(c = 0; c < MAX_CHANNELS; c++)
+    {
+        input[c] = malloc(FRAMES * sizeof(float));
+        /* room for the most any push can return, upsampling */
+        output[c] = malloc(2 * FRAMES * sizeof(float));
+        for(i = 0; i < FRAMES; i++)
+            input[c][i] = (float)(rand() - RAND_MAX / 2) / RAND_MAX;
+    }
+
+    printf("%-16s %8s %14s %14s\n", "conversion", "channels",
+            "Mframes/s", "Msamples/s");
+    for(r = 0; r < COUNT(rates); r++)
+        for(c = 0; c < COUNT(channel_counts); c++)
+        {
+            char name[32];
+            double frames = bench_resample(rates[r].infreq, rates[r].outfreq,
+                    channel_counts[c]);
+
+            snprintf(name, sizeof(name), "%d->%d", rates[r].infreq,
+                    rates[r].outfreq);
+            printf("%-16s %8d %14.1f %14.1f\n", name, channel_counts[c],
+                    frames, frames * channel_counts[c]);
+        }
+
+    for(c = 0; c < MAX_CHANNELS; c++)
+    {
+        free(input[c]);
+        free(output[c]);
+    }
+    harness_stop();
+
+    return 0;
+}
@@ -0,0 +1,153 @@
+/* restart_bench.c
+ * - cost of a track change to the encoder.
+ *
+ * Encodes a series of short tracks, starting a new logical stream for
+ * each the two ways stream_encode_restart() has done it: clearing the
+ * encoder and setting it up again with encode_initialise(), and keeping
+ * it with encode_restart(). Only the restart itself is timed; encoding
+ * the audio and finishing the old stream are the same either way.
+ *
+ * Copyright (c) 2026 The IceS Development Team <team@icecast.org>
+ *
+ * This program is distributed under the terms of the GNU General
+ * Public License, version 2. You may use, modify, and redistribute
+ * it under the terms of this license. A copy should be included
+ * with this source.
+ */
+
+#ifdef HAVE_CONFIG_H
+ #include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <ogg/ogg.h>
+#include <vorbis/codec.h>
+
+#include "cfgparse.h"
+#include "input.h"
+#include "encode.h"
+#include "harness.h"
+
+#define RATE 48000
+#define CHANNELS 2
+#define TRACKS 200
+#define CHUNK 1024              /* frames per encode_data_float() */
+#define CHUNKS_PER_TRACK 8      /* enough to leave the encoder mid stream */
+
+/* the restart cost hardly depends on the bitrate, so one each */
+#define BITRATE 128000
+
+static const encode_codec codecs[] = {
+    CODEC_VORBIS,
+#ifdef HAVE_OPUS
+    CODEC_OPUS,
+#endif
+};
+
+#define COUNT(a) (sizeof(a) / sizeof((a)[0]))
+
+static float *pcm[CHANNELS];
+static vorbis_comment vc;
+
+static const char *codec_name(encode_codec codec)
+{
+    return codec == CODEC_OPUS ? "opus" : "vorbis";
+}
+
+static encoder_state *setup(encode_codec codec)
+{
+    encoder_state *enc = encode_initialise(codec, CHANNELS, RATE, 0, -1,
+            BITRATE, -1, 0.0, &vc);
+
+    if(!enc)
+    {
+        fprintf(stderr, "couldn't set up a %s encoder\n", codec_name(codec));
+        exit(1);
+    }
+    return enc;
+}
+
+/* encode a track's worth and finish its stream, throwing the pages away */
+static void play_track(encoder_state *enc)
+{
+    ogg_page og;
+    int i;
+
+    for(i = 0; i < CHUNKS_PER_TRACK; i++)
+    {
+        encode_data_float(enc, pcm, CHUNK);
+        while(encode_dataout(enc, &og) > 0)
+            ;
+    }
+    encode_finish(enc);
+    while(encode_flush(enc, &og) > 0)
+        ;
+}
+
+/* mean time per track change, in us; the worst one in *worst */
+static double bench_restart(encode_codec codec, int in_place,
+        double *worst)
+{
+    encoder_state *enc = setup(codec);
+    uint64_t total = 0, longest = 0, start, took;
+    int track;
+
+    for(track = 0; track < TRACKS; track++)
+    {
+        play_track(enc);
+
+        start = input_clock();
+        if(!in_place || encode_restart(enc, &vc) < 0)
+        {
+            encode_clear(enc);
+            enc = setup(codec);
+        }
+        took = input_clock() - start;
+
+        total += took;
+        if(took > longest)
+            longest = took;
+    }
+    encode_clear(enc);
+
+    *worst = (double)longest / 1000;
+    return (double)total / 1000 / TRACKS;
+}
+
+int main(void)
+{
+    unsigned int n;
+    int c, i;
+
+    harness_start(0);
+    vorbis_comment_init(&vc);
+    vorbis_comment_add_tag(&vc, "TITLE", "restart_bench");
+
+    for(c = 0; c < CHANNELS; c++)
+    {
+        pcm[c] = malloc(CHUNK * sizeof(float));
+        for(i = 0; i < CHUNK; i++)
+            pcm[c][i] = (float)(rand() - RAND_MAX / 2) / RAND_MAX / 4;
+    }
+
+    for(n = 0; n < COUNT(codecs); n++)
+    {
+        double setup_mean, setup_worst, restart_mean, restart_worst;
+
+        setup_mean = bench_restart(codecs[n], 0, &setup_worst);
+        restart_mean = bench_restart(codecs[n], 1, &restart_worst);
+        printf("%s, %d track changes: set up again %.1f us (worst %.1f), "
+                "restarted %.1f us (worst %.1f), %.0fx faster\n",
+                codec_name(codecs[n]), TRACKS, setup_mean, setup_worst,
+                restart_mean, restart_worst, setup_mean / restart_mean);
+    }
+
+    for(c = 0; c < CHANNELS; c++)
+        free(pcm[c]);
+    vorbis_comment_clear(&vc);
+    harness_stop();
+
+    return 0;
+}